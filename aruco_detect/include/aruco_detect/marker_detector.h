@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+// Marker detection in the style of cv::aruco::detectMarkers, with a faster
+// identification step. The dictionary is packed into one 64-bit word per
+// marker rotation, so that comparing the bits read from a candidate with
+// a codeword is an XOR and a popcount, done for the four rotations of a
+// marker at once with AVX2 where the CPU has it.
+
+#ifndef ARUCO_DETECT_MARKER_DETECTOR_H
+#define ARUCO_DETECT_MARKER_DETECTOR_H
+
+#include <opencv2/core.hpp>
+#include <opencv2/aruco.hpp>
+
+#include <stdint.h>
+
+#include <vector>
+
+// The codewords of a dictionary, in all four rotations
+class MarkerDecoder {
+    int markerSize;
+    int numMarkers;
+    bool simd;
+
+    // The rotations of each marker are contiguous, marker m rotation r is
+    // at 4 * m + r
+    std::vector<uint64_t> codes;
+
+  public:
+    MarkerDecoder(const cv::Ptr<cv::aruco::Dictionary> &dictionary);
+
+    // Whether the codewords of the dictionary fit in 64 bits
+    static bool supports(const cv::Ptr<cv::aruco::Dictionary> &dictionary) {
+        return dictionary->markerSize * dictionary->markerSize <= 64;
+    }
+
+    // Pack a size by size matrix of 0 and 1 bits, rotated in the same way
+    // as the rotations of cv::aruco::Dictionary
+    static uint64_t pack(const uchar *bits, int size, int stride, int rotation);
+
+    // Use AVX2 if enable is set and the CPU has it, which is the default.
+    // Returns whether it is used
+    bool setSimd(bool enable);
+
+    // Find the marker and rotation nearest to a packed candidate, within
+    // maxDistance bits. An exact match ends the search
+    bool identify(uint64_t code, int maxDistance, int &id, int &rotation) const;
+
+    // As above, but only comparing against the given markers, such as
+    // those expected in a region of the image
+    bool identify(uint64_t code, int maxDistance, const std::vector<int> &markers,
+                  int &id, int &rotation) const;
+};
+
+// Cheap tests of a candidate before its perspective is removed, which is
+// the most expensive step for the many candidates that are not markers
+struct PrefilterParams {
+    bool enabled;
+
+    // Longest side over shortest side
+    double maxAspectRatio;
+
+    // Least mean difference in intensity across each side, from the
+    // quiet zone outside to the border inside
+    double minGradient;
+
+    PrefilterParams() : enabled(false), maxAspectRatio(4.0), minGradient(10.0) {}
+};
+
+// Numbers of candidates found, and of those rejected by each test, since
+// startup
+struct MarkerDetectorStats {
+    uint64_t candidates;
+    uint64_t notConvex;
+    uint64_t aspectRatio;
+    uint64_t edgeGradient;
+    uint64_t borderSample;
+    uint64_t warped;
+    uint64_t border;
+    uint64_t unidentified;
+
+    MarkerDetectorStats() : candidates(0), notConvex(0), aspectRatio(0),
+                            edgeGradient(0), borderSample(0), warped(0),
+                            border(0), unidentified(0) {}
+};
+
+class MarkerDetector {
+    cv::Ptr<cv::aruco::Dictionary> dictionary;
+    cv::Ptr<cv::aruco::DetectorParameters> params;
+    MarkerDecoder decoder;
+
+    // A quadrilateral which may be a marker, corners clockwise. The
+    // contour is only kept for contour corner refinement
+    struct Candidate {
+        std::vector<cv::Point2f> corners;
+        std::vector<cv::Point> contour;
+        double perimeter;
+    };
+
+    // Reused every image
+    cv::Mat gray;
+    cv::Mat thresh;
+    cv::Mat warped;
+    std::vector<uchar> cells;
+    std::vector<std::vector<cv::Point> > contours;
+    std::vector<cv::Point> approx;
+    std::vector<Candidate> candidates;
+    std::vector<bool> removed;
+    std::vector<int> borderSamples;
+
+    void findCandidates(bool keepContours);
+    void removeTooClose();
+    bool prefilter(const std::vector<cv::Point2f> &corners);
+    bool readBits(const std::vector<cv::Point2f> &corners, uint64_t &code);
+
+  public:
+    PrefilterParams prefilterParams;
+    MarkerDetectorStats stats;
+
+    // The parameters are read on every call of detect, so they can be
+    // changed in between
+    MarkerDetector(const cv::Ptr<cv::aruco::Dictionary> &dictionary,
+                   const cv::Ptr<cv::aruco::DetectorParameters> &params);
+
+    // As MarkerDecoder::setSimd
+    bool setSimd(bool enable) {
+        return decoder.setSimd(enable);
+    }
+
+    // If expected is given, only those markers are looked for. Corners are
+    // refined with the cornerRefinementMethod of the parameters, methods
+    // other than subpixel and contour refinement are left to
+    // cv::aruco::detectMarkers
+    void detect(const cv::Mat &image, std::vector<std::vector<cv::Point2f> > &corners,
+                std::vector<int> &ids, const std::vector<int> *expected = nullptr);
+};
+
+#endif
@@ -32,6 +32,7 @@
 #include <assert.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <signal.h>
 
 #include <ros/ros.h>
 #include <tf/transform_datatypes.h>
@@ -45,17 +46,28 @@
 #include <cv_bridge/cv_bridge.h>
 #include <sensor_msgs/image_encodings.h>
 #include <dynamic_reconfigure/server.h>
+#include <camera_calibration_parsers/parse.h>
+#include <nav_msgs/Odometry.h>
 
 #include "fiducial_msgs/Fiducial.h"
 #include "fiducial_msgs/FiducialArray.h"
 #include "fiducial_msgs/FiducialTransform.h"
 #include "fiducial_msgs/FiducialTransformArray.h"
+#include "fiducial_msgs/LatencyTrace.h"
+#include "fiducial_msgs/MemoryStats.h"
+#include "fiducial_msgs/DetectionHints.h"
 #include "aruco_detect/DetectorParamsConfig.h"
+#include "fiducial_common/reprojection.h"
+#include "fiducial_common/frame_diagnostics.h"
+#include "fiducial_common/detection_log.h"
+#include "fiducial_common/memory.h"
+#include "aruco_detect/marker_detector.h"
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/aruco.hpp>
 #include <opencv2/calib3d.hpp>
 
+#include <algorithm>
 #include <list>
 #include <string>
 
@@ -66,6 +78,7 @@ class FiducialsNode {
   private:
     ros::Publisher * vertices_pub;
     ros::Publisher * pose_pub;
+    ros::Publisher trace_pub;
 
     ros::Subscriber caminfo_sub;
     image_transport::ImageTransport it;
@@ -74,10 +87,64 @@ class FiducialsNode {
     // if set, we publish the images that contain fiducials
     bool publish_images;
 
+    // if set, we publish the times at which each image was processed
+    bool trace_latency;
+
+    // if set, the fiducials found in each image and the camera info are
+    // written to this file, for fiducial_slam_replay
+    std::string detection_log_file;
+    DetectionLogWriter detection_log;
+
+    // memory used by the images and messages of the last frame, and the
+    // most since startup, published on /fiducial_memory
+    fiducial_msgs::MemoryUsage image_memory;
+    fiducial_msgs::MemoryUsage queue_memory;
+    uint64_t peak_total;
+    double memory_stats_interval;
+    ros::Publisher memory_pub;
+    ros::Timer memory_timer;
+
     double fiducial_len;
 
     bool doPoseEstimation;
     bool haveCamInfo;
+
+    // intrinsics are preloaded from, and saved to, calibration_file so that
+    // poses can be estimated before the first camera_info arrives
+    std::string calibration_file;
+    bool camInfoFromFile;
+    sensor_msgs::CameraInfo fileCamInfo;
+
+    // with adaptive_rate, images are skipped while odometry reports the
+    // robot moving slowly, down to min_detection_rate when it is stationary
+    bool adaptive_rate;
+    double stationary_linear_speed;
+    double stationary_angular_speed;
+    double fast_linear_speed;
+    double fast_angular_speed;
+    double min_detection_rate;
+    double odom_timeout;
+    ros::Subscriber odom_sub;
+
+    // 0 when stationary to 1 when moving fast, from the last odometry
+    double motion;
+    ros::Time odomReceived;
+    ros::Time lastDetection;
+
+    // with use_hints, only the parts of the image where fiducial_slam
+    // expects fiducials are searched, for the fiducials it expects, with
+    // a full search every full_scan_interval images
+    bool use_hints;
+    double hint_timeout;
+    int full_scan_interval;
+    ros::Subscriber hints_sub;
+    fiducial_msgs::DetectionHints hints;
+    ros::Time hintsReceived;
+    int framesSinceFullScan;
+
+    // time from startup to the first fiducial pose
+    ros::WallTime startTime;
+    bool haveFirstPose;
     cv::Mat cameraMatrix;
     cv::Mat distortionCoeffs;
     int frameNum;
@@ -88,13 +155,38 @@ class FiducialsNode {
     cv::Ptr<aruco::DetectorParameters> detectorParams;
     cv::Ptr<aruco::Dictionary> dictionary;
 
+    // with fast_decoder, markers are found by MarkerDetector rather than
+    // cv::aruco::detectMarkers
+    cv::Ptr<MarkerDetector> markerDetector;
+
     void imageCallback(const sensor_msgs::ImageConstPtr &msg);
+    void publishTrace(const std_msgs::Header &header, int imageSeq,
+                      const ros::Time &received, const ros::Time &detected);
+    void updateMemory(size_t imageBytes, size_t queueBytes);
+    void memoryTimerCallback(const ros::TimerEvent &event);
     void camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg);
+    void odomCallback(const nav_msgs::Odometry::ConstPtr &msg);
+    bool skipImage(const ros::Time &stamp);
+    void hintsCallback(const fiducial_msgs::DetectionHints::ConstPtr &msg);
+    void detect(const cv::Mat &image, vector<vector<Point2f> > &corners,
+                vector<int> &ids);
+    void findMarkers(const cv::Mat &image, vector<vector<Point2f> > &corners,
+                     vector<int> &ids, const vector<int> *expected = nullptr);
+    bool setCameraInfo(const sensor_msgs::CameraInfo &info);
+    void loadCalibration();
+    void prewarm();
     void configCallback(aruco_detect::DetectorParamsConfig &config, uint32_t level);
 
     dynamic_reconfigure::Server<aruco_detect::DetectorParamsConfig> configServer;
     dynamic_reconfigure::Server<aruco_detect::DetectorParamsConfig>::CallbackType callbackType;
 
+    // health and throughput, published on /diagnostics
+    diagnostic_updater::Updater updater;
+    FrameDiagnostics diagnostics;
+    ros::Timer diagnostic_timer;
+    void diagnosticTimerCallback(const ros::TimerEvent &event);
+    void decoderDiagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat);
+
   public:
     FiducialsNode(ros::NodeHandle &nh);
 };
@@ -153,27 +245,6 @@ static double calcFiducialArea(const std::vector<cv::Point2f> &pts)
     return a1+a2;
 }
 
-// estimate reprojection error
-static double getReprojectionError(const vector<Point3f> &objectPoints,
-                            const vector<Point2f> &imagePoints,
-                            const Mat &cameraMatrix, const Mat  &distCoeffs,
-                            const Vec3d &rvec, const Vec3d &tvec) {
-
-    vector<Point2f> projectedPoints;
-
-    cv::projectPoints(objectPoints, rvec, tvec, cameraMatrix,
-                      distCoeffs, projectedPoints);
-
-    // calculate RMS image error
-    double totalError = 0.0;
-    for (unsigned int i=0; i<objectPoints.size(); i++) {
-        double error = dist(imagePoints[i], projectedPoints[i]);
-        totalError += error*error;
-    }
-    double rerror = totalError/objectPoints.size();
-    return rerror;
-}
-
 void estimatePoseSingleMarkers(const vector<vector<Point2f > >&corners,
                                float markerLength,
                                const cv::Mat &cameraMatrix,
@@ -186,9 +257,9 @@ void estimatePoseSingleMarkers(const vector<vector<Point2f > >&corners,
     vector<Point3f> markerObjPoints;
     getSingleMarkerObjectPoints(markerLength, markerObjPoints);
     int nMarkers = (int)corners.size();
-    rvecs.reserve(nMarkers);
-    tvecs.reserve(nMarkers);
-    reprojectionError.reserve(nMarkers);
+    rvecs.resize(nMarkers);
+    tvecs.resize(nMarkers);
+    reprojectionError.resize(nMarkers);
 
     // for each marker, calculate its pose
     for (int i = 0; i < nMarkers; i++) {
@@ -197,9 +268,9 @@ void estimatePoseSingleMarkers(const vector<vector<Point2f > >&corners,
                     rvecs[i], tvecs[i]);
 
        reprojectionError[i] =
-          getReprojectionError(markerObjPoints, corners[i],
-                               cameraMatrix, distCoeffs,
-                               rvecs[i], tvecs[i]);
+          ::reprojectionError<4>(cameraMatrix, distCoeffs,
+                                 markerObjPoints.data(), corners[i].data(),
+                                 rvecs[i], tvecs[i]);
     }
 }
 
@@ -246,32 +317,334 @@ void FiducialsNode::configCallback(aruco_detect::DetectorParamsConfig & config,
     detectorParams->polygonalApproxAccuracyRate = config.polygonalApproxAccuracyRate;
 }
 
+bool FiducialsNode::setCameraInfo(const sensor_msgs::CameraInfo &info)
+{
+    if (info.K == boost::array<double, 9>({0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0})) {
+        ROS_WARN("%s", "CameraInfo message has invalid intrinsics, K matrix all zeros");
+        return false;
+    }
+
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            cameraMatrix.at<double>(i, j) = info.K[i*3+j];
+        }
+    }
+
+    // at least 5 coefficients, more for the rational model
+    distortionCoeffs = cv::Mat::zeros(1, std::max(5, (int)info.D.size()), CV_64F);
+    for (int i=0; i<info.D.size(); i++) {
+        distortionCoeffs.at<double>(0,i) = info.D[i];
+    }
+
+    haveCamInfo = true;
+    frameId = info.header.frame_id;
+    detection_log.write(info);
+    return true;
+}
+
+// Intrinsics from a previous run, the camera name in the file is the frame id
+
+void FiducialsNode::loadCalibration()
+{
+    std::string cameraName;
+    if (!camera_calibration_parsers::readCalibration(calibration_file, cameraName,
+                                                      fileCamInfo)) {
+        ROS_INFO("No cached calibration in %s", calibration_file.c_str());
+        return;
+    }
+
+    fileCamInfo.header.frame_id = cameraName;
+    if (setCameraInfo(fileCamInfo)) {
+        camInfoFromFile = true;
+        ROS_INFO("Loaded calibration of %s from %s", cameraName.c_str(),
+                 calibration_file.c_str());
+    }
+}
+
+// The first camera_info replaces intrinsics loaded from the calibration
+// file, which is updated if they have changed
+
 void FiducialsNode::camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr& msg)
 {
-    if (haveCamInfo) {
+    if (haveCamInfo && !camInfoFromFile) {
+        return;
+    }
+
+    bool changed = !camInfoFromFile || msg->K != fileCamInfo.K ||
+                   msg->D != fileCamInfo.D ||
+                   msg->header.frame_id != fileCamInfo.header.frame_id;
+
+    if (!setCameraInfo(*msg)) {
+        return;
+    }
+    camInfoFromFile = false;
+
+    if (!calibration_file.empty() && changed) {
+        if (camera_calibration_parsers::writeCalibration(calibration_file,
+                                                         msg->header.frame_id, *msg)) {
+            ROS_INFO("Saved calibration to %s", calibration_file.c_str());
+        }
+        else {
+            ROS_WARN("Could not save calibration to %s", calibration_file.c_str());
+        }
+    }
+}
+
+// Run the detector once on an image of a marker, so that the first real
+// image does not pay for allocating buffers and starting threads
+
+void FiducialsNode::prewarm()
+{
+    ros::WallTime start = ros::WallTime::now();
+
+    cv::Mat marker;
+    aruco::drawMarker(dictionary, 0, 200, marker, 1);
+
+    cv::Mat image(480, 640, CV_8UC3, cv::Scalar(255, 255, 255));
+    cv::cvtColor(marker, marker, cv::COLOR_GRAY2BGR);
+    cv::Mat roi = image(cv::Rect(220, 140, 200, 200));
+    marker.copyTo(roi);
+
+    vector <int> ids;
+    vector <vector <Point2f> > corners;
+    findMarkers(image, corners, ids);
+
+    ROS_INFO("Detector prewarmed in %.3f s, found %d markers",
+             (ros::WallTime::now() - start).toSec(), (int)ids.size());
+}
+
+void FiducialsNode::publishTrace(const std_msgs::Header &header, int imageSeq,
+                                 const ros::Time &received, const ros::Time &detected)
+{
+    if (!trace_latency) {
         return;
     }
 
-    if (msg->K != boost::array<double, 9>({0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0})) {
-        for (int i=0; i<3; i++) {
-            for (int j=0; j<3; j++) {
-                cameraMatrix.at<double>(i, j) = msg->K[i*3+j];
+    fiducial_msgs::LatencyTrace trace;
+    trace.header = header;
+    trace.image_seq = imageSeq;
+    trace.received = received;
+    trace.detected = detected;
+    trace.published = ros::Time::now();
+    trace_pub.publish(trace);
+}
+
+static void setUsage(fiducial_msgs::MemoryUsage &usage, size_t bytes)
+{
+    usage.bytes = bytes;
+    if (usage.bytes > usage.peak) {
+        usage.peak = usage.bytes;
+    }
+}
+
+void FiducialsNode::updateMemory(size_t imageBytes, size_t queueBytes)
+{
+    setUsage(image_memory, imageBytes);
+    setUsage(queue_memory, queueBytes);
+    peak_total = max(peak_total, image_memory.bytes + queue_memory.bytes);
+}
+
+// Set by SIGUSR1, the memory usage is logged by the timer
+static volatile sig_atomic_t memoryDumpRequested = 0;
+
+static void sigusr1Handler(int sig)
+{
+    memoryDumpRequested = 1;
+}
+
+void FiducialsNode::memoryTimerCallback(const ros::TimerEvent &event)
+{
+    fiducial_msgs::MemoryStats stats;
+    stats.header.stamp = ros::Time::now();
+    stats.node = ros::this_node::getName();
+    stats.subsystems.push_back(image_memory);
+    stats.subsystems.push_back(queue_memory);
+    stats.total = image_memory.bytes + queue_memory.bytes;
+    stats.peak_total = peak_total;
+    stats.resident = residentBytes();
+
+    if (memory_stats_interval > 0) {
+        memory_pub.publish(stats);
+    }
+
+    if (memoryDumpRequested) {
+        memoryDumpRequested = 0;
+        ROS_INFO("Memory usage kB (peak): image_buffers %.1f (%.1f) "
+                 "message_queues %.1f (%.1f) total %.1f (%.1f) resident %.1f",
+                 image_memory.bytes / 1024.0, image_memory.peak / 1024.0,
+                 queue_memory.bytes / 1024.0, queue_memory.peak / 1024.0,
+                 stats.total / 1024.0, stats.peak_total / 1024.0,
+                 stats.resident / 1024.0);
+    }
+}
+
+// How fast the robot is moving, relative to the speeds at which every
+// image is used
+
+void FiducialsNode::odomCallback(const nav_msgs::Odometry::ConstPtr &msg)
+{
+    const geometry_msgs::Vector3 &v = msg->twist.twist.linear;
+    const geometry_msgs::Vector3 &w = msg->twist.twist.angular;
+    double linear = sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+    double angular = sqrt(w.x * w.x + w.y * w.y + w.z * w.z);
+
+    if (linear < stationary_linear_speed && angular < stationary_angular_speed) {
+        motion = 0.0;
+    }
+    else {
+        motion = std::min(1.0, std::max(linear / fast_linear_speed,
+                                        angular / fast_angular_speed));
+    }
+    odomReceived = ros::Time::now();
+}
+
+// Whether to skip detection in an image. The interval between detections
+// shrinks from 1 / min_detection_rate when stationary to nothing when
+// moving fast. Without recent odometry every image is used
+
+bool FiducialsNode::skipImage(const ros::Time &stamp)
+{
+    if (!adaptive_rate || (ros::Time::now() - odomReceived).toSec() > odom_timeout) {
+        lastDetection = stamp;
+        return false;
+    }
+
+    double interval = (1.0 - motion) / min_detection_rate;
+    if (stamp > lastDetection && (stamp - lastDetection).toSec() < interval) {
+        return true;
+    }
+
+    lastDetection = stamp;
+    return false;
+}
+
+void FiducialsNode::hintsCallback(const fiducial_msgs::DetectionHints::ConstPtr &msg)
+{
+    if (msg->header.frame_id != frameId) {
+        return;
+    }
+    hints = *msg;
+    hintsReceived = ros::Time::now();
+}
+
+// Find the fiducials in an image. With recent hints, each hinted region,
+// merged with those it overlaps, is searched for the hinted fiducials.
+// The whole image is searched if the hints are stale or find nothing
+
+void FiducialsNode::detect(const cv::Mat &image, vector<vector<Point2f> > &corners,
+                           vector<int> &ids)
+{
+    if (use_hints && !hints.hints.empty() &&
+        framesSinceFullScan < full_scan_interval &&
+        (ros::Time::now() - hintsReceived).toSec() < hint_timeout) {
+        framesSinceFullScan++;
+
+        vector<int> expected;
+        vector<Rect> regions;
+        Rect bounds(0, 0, image.cols, image.rows);
+        for (const fiducial_msgs::FiducialHint &hint : hints.hints) {
+            expected.push_back(hint.fiducial_id);
+
+            Rect region = Rect(hint.x, hint.y, hint.width, hint.height) & bounds;
+            for (int i = 0; i < regions.size(); ) {
+                if ((region & regions[i]).empty()) {
+                    i++;
+                }
+                else {
+                    region |= regions[i];
+                    regions.erase(regions.begin() + i);
+                    i = 0;
+                }
+            }
+            if (!region.empty()) {
+                regions.push_back(region);
             }
         }
 
-        for (int i=0; i<5; i++) {
-            distortionCoeffs.at<double>(0,i) = msg->D[i];
+        vector<int> regionIds;
+        vector<vector<Point2f> > regionCorners;
+        for (const Rect &region : regions) {
+            findMarkers(image(region), regionCorners, regionIds, &expected);
+
+            for (int i = 0; i < regionIds.size(); i++) {
+                for (Point2f &p : regionCorners[i]) {
+                    p.x += region.x;
+                    p.y += region.y;
+                }
+                ids.push_back(regionIds[i]);
+                corners.push_back(regionCorners[i]);
+            }
         }
 
-        haveCamInfo = true;
-        frameId = msg->header.frame_id;
+        if (!ids.empty()) {
+            diagnostics.hinted();
+            return;
+        }
     }
-    else {
-        ROS_WARN("%s", "CameraInfo message has invalid intrinsics, K matrix all zeros");
+
+    framesSinceFullScan = 0;
+    findMarkers(image, corners, ids);
+}
+
+// Find markers with the fast decoder if it is enabled, otherwise with
+// OpenCV. If expected is given only those markers are found, which the
+// fast decoder does by only comparing their codewords, while OpenCV's
+// results are filtered
+
+void FiducialsNode::findMarkers(const cv::Mat &image, vector<vector<Point2f> > &corners,
+                                vector<int> &ids, const vector<int> *expected)
+{
+    if (!markerDetector.empty()) {
+        markerDetector->detect(image, corners, ids, expected);
+        return;
+    }
+
+    aruco::detectMarkers(image, dictionary, corners, ids, detectorParams);
+    if (expected != nullptr) {
+        int n = 0;
+        for (int i = 0; i < ids.size(); i++) {
+            if (find(expected->begin(), expected->end(), ids[i]) != expected->end()) {
+                ids[n] = ids[i];
+                corners[n] = corners[i];
+                n++;
+            }
+        }
+        ids.resize(n);
+        corners.resize(n);
     }
 }
 
+void FiducialsNode::diagnosticTimerCallback(const ros::TimerEvent &event)
+{
+    diagnostics.cameraInfo(haveCamInfo ? 1 : 0, doPoseEstimation ? 1 : 0);
+    updater.update();
+}
+
+// Candidates rejected at each stage of the fast decoder, since startup
+
+void FiducialsNode::decoderDiagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    const MarkerDetectorStats &stats = markerDetector->stats;
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+    stat.add("Candidates", stats.candidates);
+    stat.add("Not convex", stats.notConvex);
+    stat.add("Rejected on aspect ratio", stats.aspectRatio);
+    stat.add("Rejected on edge gradient", stats.edgeGradient);
+    stat.add("Rejected on border samples", stats.borderSample);
+    stat.add("Warped", stats.warped);
+    stat.add("Rejected on border", stats.border);
+    stat.add("Not identified", stats.unidentified);
+}
+
 void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg) {
+    ros::Time receivedTime = ros::Time::now();
+    ros::WallTime callbackStart = ros::WallTime::now();
+    diagnostics.received(msg->header.frame_id, msg->header.seq);
+
+    if (skipImage(msg->header.stamp)) {
+        diagnostics.skipped();
+        return;
+    }
     ROS_INFO("Got image %d", msg->header.seq);
     frameNum++;
 
@@ -294,7 +667,8 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg) {
         vector <vector <Point2f> > corners, rejected;
         vector <Vec3d>  rvecs, tvecs;
 
-        aruco::detectMarkers(cv_ptr->image, dictionary, corners, ids, detectorParams);
+        detect(cv_ptr->image, corners, ids);
+        ros::Time detectedTime = ros::Time::now();
         ROS_INFO("Detected %d markers", (int)ids.size());
 
         for (int i=0; i<ids.size(); i++) {
@@ -313,6 +687,13 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg) {
         }
 
         vertices_pub->publish(fva);
+        detection_log.write(fva);
+        if (!doPoseEstimation) {
+            publishTrace(fva.header, fva.image_seq, receivedTime, detectedTime);
+            if (!ids.empty()) {
+                diagnostics.posed();
+            }
+        }
 
         if(ids.size() > 0) {
             aruco::drawDetectedMarkers(cv_ptr->image, corners, ids);
@@ -323,6 +704,9 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg) {
                 if (frameNum > 5) {
                     ROS_ERROR("No camera intrinsics");
                 }
+                diagnostics.processed((ros::WallTime::now() - callbackStart).toSec(),
+                                      ids.size());
+                diagnostics.published();
                 return;
             }
 
@@ -371,8 +755,31 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg) {
                 fta.transforms.push_back(ft);
             }
             pose_pub->publish(fta);
+            publishTrace(fta.header, fta.image_seq, receivedTime, detectedTime);
+            if (!fta.transforms.empty()) {
+                diagnostics.posed();
+            }
+
+            if (!haveFirstPose && !fta.transforms.empty()) {
+                haveFirstPose = true;
+                ROS_INFO("Time to first pose %.3f s",
+                         (ros::WallTime::now() - startTime).toSec());
+            }
         }
-	image_pub.publish(cv_ptr->toImageMsg());
+
+        // The converted image, and the copy of it that is published. The
+        // subscriber queues one image, the fiducial messages are copied
+        // when they are published
+        sensor_msgs::ImagePtr out = cv_ptr->toImageMsg();
+        updateMemory(cv_ptr->image.total() * cv_ptr->image.elemSize() + out->data.size(),
+                     msg->data.size() +
+                     ros::serialization::serializationLength(fva) +
+                     ros::serialization::serializationLength(fta));
+	image_pub.publish(out);
+
+        diagnostics.processed((ros::WallTime::now() - callbackStart).toSec(),
+                              ids.size());
+        diagnostics.published();
     }
     catch(cv_bridge::Exception & e) {
         ROS_ERROR("cv_bridge exception: %s", e.what());
@@ -382,9 +789,11 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg) {
     }
 }
 
-FiducialsNode::FiducialsNode(ros::NodeHandle & nh) : it(nh)
+FiducialsNode::FiducialsNode(ros::NodeHandle & nh) : it(nh), diagnostics(nh)
 {
     frameNum = 0;
+    startTime = ros::WallTime::now();
+    haveFirstPose = false;
 
     // Camera intrinsics
     cameraMatrix = cv::Mat::zeros(3, 3, CV_64F);
@@ -393,6 +802,7 @@ FiducialsNode::FiducialsNode(ros::NodeHandle & nh) : it(nh)
     distortionCoeffs = cv::Mat::zeros(1, 5, CV_64F);
 
     haveCamInfo = false;
+    camInfoFromFile = false;
 
     int dicno;
 
@@ -402,12 +812,68 @@ FiducialsNode::FiducialsNode(ros::NodeHandle & nh) : it(nh)
     nh.param<double>("fiducial_len", fiducial_len, 0.14);
     nh.param<int>("dictionary", dicno, 7);
     nh.param<bool>("do_pose_estimation", doPoseEstimation, true);
+    nh.param<bool>("trace_latency", trace_latency, false);
+    nh.param<double>("memory_stats_interval", memory_stats_interval, 1.0);
+    nh.param<std::string>("calibration_file", calibration_file, "");
+    nh.param<std::string>("detection_log", detection_log_file, "");
+
+    nh.param<bool>("adaptive_rate", adaptive_rate, false);
+    nh.param<double>("stationary_linear_speed", stationary_linear_speed, 0.02);
+    nh.param<double>("stationary_angular_speed", stationary_angular_speed, 0.02);
+    nh.param<double>("fast_linear_speed", fast_linear_speed, 0.3);
+    nh.param<double>("fast_angular_speed", fast_angular_speed, 0.3);
+    nh.param<double>("min_detection_rate", min_detection_rate, 1.0);
+    nh.param<double>("odom_timeout", odom_timeout, 0.5);
+
+    motion = 1.0;
+    if (adaptive_rate) {
+        if (min_detection_rate <= 0 || fast_linear_speed <= 0 || fast_angular_speed <= 0) {
+            ROS_ERROR("min_detection_rate and fast speeds must be positive, "
+                      "adaptive_rate disabled");
+            adaptive_rate = false;
+        }
+        else {
+            std::string odom_topic;
+            nh.param<std::string>("odom_topic", odom_topic, "/odom");
+            odom_sub = nh.subscribe(odom_topic, 1, &FiducialsNode::odomCallback, this);
+        }
+    }
+
+    framesSinceFullScan = 0;
+    nh.param<bool>("use_hints", use_hints, false);
+    nh.param<double>("hint_timeout", hint_timeout, 0.5);
+    nh.param<int>("full_scan_interval", full_scan_interval, 10);
+    if (use_hints) {
+        // Hints for all the cameras share the topic
+        hints_sub = nh.subscribe("/fiducial_hints", 10,
+                                 &FiducialsNode::hintsCallback, this);
+    }
+
     image_pub = it.advertise("/fiducial_images", 1);
 
     vertices_pub = new ros::Publisher(nh.advertise<fiducial_msgs::FiducialArray>("/fiducial_vertices", 1));
 
     pose_pub = new ros::Publisher(nh.advertise<fiducial_msgs::FiducialTransformArray>("/fiducial_transforms", 1));
 
+    if (trace_latency) {
+        trace_pub = nh.advertise<fiducial_msgs::LatencyTrace>("/fiducial_trace", 10);
+    }
+
+    image_memory.name = "image_buffers";
+    image_memory.bytes = image_memory.peak = 0;
+    queue_memory.name = "message_queues";
+    queue_memory.bytes = queue_memory.peak = 0;
+    peak_total = 0;
+    memory_pub = nh.advertise<fiducial_msgs::MemoryStats>("/fiducial_memory", 1);
+    memory_timer = nh.createTimer(ros::Duration(memory_stats_interval > 0 ? memory_stats_interval : 1.0),
+                                  &FiducialsNode::memoryTimerCallback, this);
+    signal(SIGUSR1, sigusr1Handler);
+
+    updater.setHardwareID("none");
+    updater.add("Detector", &diagnostics, &FrameDiagnostics::run);
+    diagnostic_timer = nh.createTimer(ros::Duration(0.5),
+                                      &FiducialsNode::diagnosticTimerCallback, this);
+
     dictionary = aruco::getPredefinedDictionary(dicno);
 
     img_sub = it.subscribe("/camera", 1,
@@ -458,6 +924,42 @@ FiducialsNode::FiducialsNode(ros::NodeHandle & nh) : it(nh)
     nh.param<int>("perspectiveRemovePixelPerCell", detectorParams->perspectiveRemovePixelPerCell, 8);
     nh.param<double>("polygonalApproxAccuracyRate", detectorParams->polygonalApproxAccuracyRate, 0.01); /* default 0.05 */
 
+    if (!detection_log_file.empty()) {
+        if (detection_log.open(detection_log_file)) {
+            ROS_INFO("Logging detections to %s", detection_log_file.c_str());
+        }
+        else {
+            ROS_ERROR("Could not write detection log %s", detection_log_file.c_str());
+        }
+    }
+
+    if (!calibration_file.empty()) {
+        loadCalibration();
+    }
+
+    bool fastDecoder;
+    nh.param<bool>("fast_decoder", fastDecoder, false);
+    if (fastDecoder) {
+        if (MarkerDecoder::supports(dictionary)) {
+            markerDetector = makePtr<MarkerDetector>(dictionary, detectorParams);
+
+            PrefilterParams &prefilter = markerDetector->prefilterParams;
+            nh.param<bool>("prefilter", prefilter.enabled, false);
+            nh.param<double>("prefilter_max_aspect_ratio", prefilter.maxAspectRatio, 4.0);
+            nh.param<double>("prefilter_min_gradient", prefilter.minGradient, 10.0);
+            updater.add("Decoder", this, &FiducialsNode::decoderDiagnostics);
+        }
+        else {
+            ROS_ERROR("fast_decoder does not support dictionary %d", dicno);
+        }
+    }
+
+    bool prewarmDetector;
+    nh.param<bool>("prewarm", prewarmDetector, false);
+    if (prewarmDetector) {
+        prewarm();
+    }
+
     ROS_INFO("Aruco detection ready");
 }
 
@@ -38,22 +38,359 @@ the use of this software, even if advised of the possibility of such damage.
 
 
 #include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/aruco.hpp>
 
+#include <stdio.h>
+
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
 using namespace cv;
 
 namespace {
-const char* about = "Create an ArUco marker image";
+const char* about = "Create an ArUco marker image, or sheets of markers for printing";
 const char* keys  =
-        "{@outfile |<none> | Output image }"
+        "{@outfile |<none> | Output image, or with --last .pdf, .svg or .png sheets }"
         "{d        |       | dictionary: DICT_4X4_50=0, DICT_4X4_100=1, DICT_4X4_250=2,"
         "DICT_4X4_1000=3, DICT_5X5_50=4, DICT_5X5_100=5, DICT_5X5_250=6, DICT_5X5_1000=7, "
         "DICT_6X6_50=8, DICT_6X6_100=9, DICT_6X6_250=10, DICT_6X6_1000=11, DICT_7X7_50=12,"
         "DICT_7X7_100=13, DICT_7X7_250=14, DICT_7X7_1000=15, DICT_ARUCO_ORIGINAL = 16}"
-        "{id       |       | Marker id in the dictionary }"
+        "{id       |       | Marker id in the dictionary. With --last the first "
+        "marker on the sheets, which is optional and defaults to 0 }"
         "{ms       | 200   | Marker size in pixels }"
         "{bb       | 1     | Number of bits in marker borders }"
-        "{si       | false | show generated image }";
+        "{si       | false | show generated image }"
+        "{last     | -1    | Create sheets of the markers from id to last }"
+        "{rows     | 1     | Rows of markers on each sheet }"
+        "{cols     | 1     | Columns of markers on each sheet }"
+        "{dpi      | 300   | Resolution of .png sheets }"
+        "{threads  | 0     | Threads to create sheets with, 0 for one per CPU }";
+}
+
+// Layout of a sheet in mm, the same as create_markers.py used to make
+static const double pageWidth = 208.0;
+static const double pageHeight = 240.0;
+static const double markerX = 31.0;
+static const double markerY = 47.0;
+static const double markerLen = 140.0;
+static const double labelX = 90.0;
+static const double labelY = 220.0;
+static const double labelSize = 6.35;
+
+static const double cropMarks[12][4] = {
+    {5, 5, 7, 5}, {195, 5, 197, 5},
+    {5, 21, 7, 21}, {5, 21, 5, 23}, {197, 21, 195, 21}, {197, 21, 197, 23},
+    {5, 213, 7, 213}, {5, 213, 5, 211}, {195, 213, 197, 213}, {197, 213, 197, 211},
+    {5, 229, 7, 229}, {195, 229, 197, 229}
+};
+
+// Somewhere to draw a sheet, with all positions and sizes in mm from the
+// top left of the page. Text is positioned by the left of its baseline
+class Canvas {
+  public:
+    virtual ~Canvas() {}
+    virtual void rect(double x, double y, double w, double h) = 0;
+    virtual void line(double x1, double y1, double x2, double y2) = 0;
+    virtual void text(double x, double y, double size, const std::string &str) = 0;
+};
+
+// The content stream of a PDF page, in points from the bottom left
+class PdfCanvas : public Canvas {
+    static double pt(double mm) { return mm * 72.0 / 25.4; }
+
+  public:
+    std::ostringstream out;
+
+    void rect(double x, double y, double w, double h) {
+        out << pt(x) << " " << pt(pageHeight - y - h) << " "
+            << pt(w) << " " << pt(h) << " re f\n";
+    }
+
+    void line(double x1, double y1, double x2, double y2) {
+        out << pt(x1) << " " << pt(pageHeight - y1) << " m "
+            << pt(x2) << " " << pt(pageHeight - y2) << " l S\n";
+    }
+
+    void text(double x, double y, double size, const std::string &str) {
+        out << "BT /F1 " << pt(size) << " Tf " << pt(x) << " "
+            << pt(pageHeight - y) << " Td (" << str << ") Tj ET\n";
+    }
+};
+
+class SvgCanvas : public Canvas {
+  public:
+    std::ostringstream out;
+
+    void rect(double x, double y, double w, double h) {
+        out << "  <rect x=\"" << x << "mm\" y=\"" << y << "mm\" width=\"" << w
+            << "mm\" height=\"" << h << "mm\" style=\"fill:black\"/>\n";
+    }
+
+    void line(double x1, double y1, double x2, double y2) {
+        out << "  <line x1=\"" << x1 << "mm\" y1=\"" << y1 << "mm\" x2=\"" << x2
+            << "mm\" y2=\"" << y2 << "mm\" style=\"stroke:black\"/>\n";
+    }
+
+    void text(double x, double y, double size, const std::string &str) {
+        out << "  <text x=\"" << x << "mm\" y=\"" << y << "mm\" "
+            << "style=\"font-family:sans-serif; font-size:" << size << "mm\">"
+            << str << "</text>\n";
+    }
+};
+
+// An image of the page, white, at the given resolution
+class PngCanvas : public Canvas {
+    double scale;
+
+    int px(double mm) const { return cvRound(mm * scale); }
+
+  public:
+    Mat image;
+
+    PngCanvas(int dpi) : scale(dpi / 25.4),
+        image(cvRound(pageHeight * dpi / 25.4), cvRound(pageWidth * dpi / 25.4),
+              CV_8UC1, Scalar(255)) {}
+
+    void rect(double x, double y, double w, double h) {
+        // Rounding each edge, not the size, so that adjacent cells meet
+        rectangle(image, Point(px(x), px(y)), Point(px(x + w) - 1, px(y + h) - 1),
+                  Scalar(0), FILLED);
+    }
+
+    void line(double x1, double y1, double x2, double y2) {
+        cv::line(image, Point(px(x1), px(y1)), Point(px(x2), px(y2)), Scalar(0),
+                 std::max(1, px(0.25)));
+    }
+
+    void text(double x, double y, double size, const std::string &str) {
+        int baseline;
+        Size unit = getTextSize(str, FONT_HERSHEY_SIMPLEX, 1.0, 1, &baseline);
+        double fontScale = 0.7 * px(size) / unit.height;
+        putText(image, str, Point(px(x), px(y)), FONT_HERSHEY_SIMPLEX, fontScale,
+                Scalar(0), std::max(1, cvRound(fontScale * 2)));
+    }
+};
+
+
+// Draw a marker as black rectangles, one for each run of black cells in
+// a row
+
+static void drawMarkerCells(Canvas &canvas, const Ptr<aruco::Dictionary> &dictionary,
+                            int id, int borderBits, double x, double y, double len)
+{
+    int cells = dictionary->markerSize + 2 * borderBits;
+    Mat bits;
+    aruco::drawMarker(dictionary, id, cells, bits, borderBits);
+
+    double cell = len / cells;
+    for (int row = 0; row < cells; row++) {
+        int col = 0;
+        while (col < cells) {
+            if (bits.at<uchar>(row, col) != 0) {
+                col++;
+                continue;
+            }
+            int start = col;
+            while (col < cells && bits.at<uchar>(row, col) == 0) {
+                col++;
+            }
+            canvas.rect(x + start * cell, y + row * cell, (col - start) * cell, cell);
+        }
+    }
+}
+
+
+// Draw a sheet of up to rows by cols markers, starting with firstId. A
+// single marker fills the marker area, a grid of them is spaced by a
+// quarter of a marker, each labelled with its id
+
+static void drawSheet(Canvas &canvas, const Ptr<aruco::Dictionary> &dictionary,
+                      int dictionaryId, int borderBits, int firstId, int lastId,
+                      int rows, int cols)
+{
+    for (const double *mark : cropMarks) {
+        canvas.line(mark[0], mark[1], mark[2], mark[3]);
+    }
+
+    int n = std::max(rows, cols);
+    double len = markerLen / (n + (n - 1) * 0.25);
+    double gap = len * 0.25;
+    int pageLast = std::min(lastId, firstId + rows * cols - 1);
+
+    for (int id = firstId; id <= pageLast; id++) {
+        int i = id - firstId;
+        double x = markerX + (i % cols) * (len + gap);
+        double y = markerY + (i / cols) * (len + gap);
+        drawMarkerCells(canvas, dictionary, id, borderBits, x, y, len);
+
+        if (n > 1) {
+            canvas.text(x, y + len + gap * 0.6, gap * 0.4, std::to_string(id));
+        }
+    }
+
+    char label[64];
+    if (pageLast > firstId) {
+        snprintf(label, sizeof(label), "%d-%d D%d", firstId, pageLast, dictionaryId);
+    }
+    else {
+        snprintf(label, sizeof(label), "%d D%d", firstId, dictionaryId);
+    }
+    canvas.text(labelX, labelY, labelSize, label);
+}
+
+
+// The file for one page of .svg or .png output, numbered by its first
+// marker if there is more than one page
+
+static std::string pageFilename(const std::string &out, int firstId, int numPages)
+{
+    if (numPages == 1) {
+        return out;
+    }
+    size_t dot = out.rfind('.');
+    return out.substr(0, dot) + "_" + std::to_string(firstId) + out.substr(dot);
+}
+
+
+// Write the pages as a PDF with a page object and content stream for each,
+// drawing text in Helvetica
+
+static bool writePdf(const std::string &out, const std::vector<std::string> &pages)
+{
+    std::vector<std::string> objects;
+    int numPages = pages.size();
+
+    std::ostringstream kids;
+    for (int i = 0; i < numPages; i++) {
+        kids << (4 + 2 * i) << " 0 R ";
+    }
+
+    std::ostringstream size;
+    size << "[0 0 " << pageWidth * 72.0 / 25.4 << " " << pageHeight * 72.0 / 25.4 << "]";
+
+    objects.push_back("<< /Type /Catalog /Pages 2 0 R >>");
+    objects.push_back("<< /Type /Pages /Kids [" + kids.str() + "] /Count " +
+                      std::to_string(numPages) + " >>");
+    objects.push_back("<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>");
+    for (int i = 0; i < numPages; i++) {
+        objects.push_back("<< /Type /Page /Parent 2 0 R /MediaBox " + size.str() +
+                          " /Resources << /Font << /F1 3 0 R >> >> /Contents " +
+                          std::to_string(5 + 2 * i) + " 0 R >>");
+        objects.push_back("<< /Length " + std::to_string(pages[i].size()) +
+                          " >>\nstream\n" + pages[i] + "endstream");
+    }
+
+    std::ofstream file(out.c_str(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    std::vector<long> offsets;
+    file << "%PDF-1.4\n";
+    for (int i = 0; i < objects.size(); i++) {
+        offsets.push_back(file.tellp());
+        file << (i + 1) << " 0 obj\n" << objects[i] << "\nendobj\n";
+    }
+
+    long xref = file.tellp();
+    file << "xref\n0 " << objects.size() + 1 << "\n0000000000 65535 f \n";
+    for (long offset : offsets) {
+        char entry[21];
+        snprintf(entry, sizeof(entry), "%010ld 00000 n \n", offset);
+        file << entry;
+    }
+    file << "trailer\n<< /Size " << objects.size() + 1 << " /Root 1 0 R >>\n"
+         << "startxref\n" << xref << "\n%%EOF\n";
+
+    return file.good();
+}
+
+
+// Create sheets of the markers from firstId to lastId, each page on its
+// own thread. .pdf output is one file, .svg and .png one file per page
+
+static int createSheets(const std::string &out, const Ptr<aruco::Dictionary> &dictionary,
+                        int dictionaryId, int borderBits, int firstId, int lastId,
+                        int rows, int cols, int dpi, int numThreads)
+{
+    size_t dot = out.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : out.substr(dot);
+    if (ext != ".pdf" && ext != ".svg" && ext != ".png") {
+        fprintf(stderr, "Sheets must be .pdf, .svg or .png\n");
+        return 1;
+    }
+    if (firstId < 0 || lastId < firstId || lastId >= dictionary->bytesList.rows) {
+        fprintf(stderr, "Marker ids must be from 0 to %d\n",
+                dictionary->bytesList.rows - 1);
+        return 1;
+    }
+
+    int perPage = rows * cols;
+    int numPages = (lastId - firstId) / perPage + 1;
+    std::vector<std::string> pdfPages(numPages);
+    std::atomic<int> nextPage(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&]() {
+        for (int page = nextPage++; page < numPages; page = nextPage++) {
+            int pageFirst = firstId + page * perPage;
+            std::string filename = pageFilename(out, pageFirst, numPages);
+
+            if (ext == ".pdf") {
+                PdfCanvas canvas;
+                drawSheet(canvas, dictionary, dictionaryId, borderBits,
+                          pageFirst, lastId, rows, cols);
+                pdfPages[page] = canvas.out.str();
+            }
+            else if (ext == ".svg") {
+                SvgCanvas canvas;
+                drawSheet(canvas, dictionary, dictionaryId, borderBits,
+                          pageFirst, lastId, rows, cols);
+                std::ofstream file(filename.c_str());
+                file << "<svg width=\"" << pageWidth << "mm\" height=\"" << pageHeight
+                     << "mm\" version=\"1.1\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+                     << canvas.out.str() << "</svg>\n";
+                if (!file.good()) {
+                    failed = true;
+                }
+            }
+            else {
+                PngCanvas canvas(dpi);
+                drawSheet(canvas, dictionary, dictionaryId, borderBits,
+                          pageFirst, lastId, rows, cols);
+                if (!imwrite(filename, canvas.image)) {
+                    failed = true;
+                }
+            }
+        }
+    };
+
+    if (numThreads <= 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::min(numThreads, numPages); i++) {
+        threads.push_back(std::thread(worker));
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    if (ext == ".pdf" && !failed) {
+        failed = !writePdf(out, pdfPages);
+    }
+    if (failed) {
+        fprintf(stderr, "Could not write %s\n", out.c_str());
+        return 1;
+    }
+
+    printf("Created %d markers on %d pages\n", lastId - firstId + 1, numPages);
+    return 0;
 }
 
 
@@ -67,10 +404,16 @@ int main(int argc, char *argv[]) {
     }
 
     int dictionaryId = parser.get<int>("d");
-    int markerId = parser.get<int>("id");
+    bool haveId = parser.has("id");
+    int markerId = haveId ? parser.get<int>("id") : 0;
     int borderBits = parser.get<int>("bb");
     int markerSize = parser.get<int>("ms");
     bool showImage = parser.get<bool>("si");
+    int lastId = parser.get<int>("last");
+    int rows = parser.get<int>("rows");
+    int cols = parser.get<int>("cols");
+    int dpi = parser.get<int>("dpi");
+    int numThreads = parser.get<int>("threads");
 
     String out = parser.get<String>(0);
 
@@ -79,9 +422,21 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    // Only sheets can start from the first marker by default
+    if (!haveId && lastId < 0) {
+        printf("A marker id is needed without --last\n");
+        parser.printMessage();
+        return 1;
+    }
+
     Ptr<aruco::Dictionary> dictionary =
         aruco::getPredefinedDictionary(aruco::PREDEFINED_DICTIONARY_NAME(dictionaryId));
 
+    if (lastId >= 0) {
+        return createSheets(out, dictionary, dictionaryId, borderBits, markerId, lastId,
+                            std::max(1, rows), std::max(1, cols), dpi, numThreads);
+    }
+
     Mat markerImg;
     aruco::drawMarker(dictionary, markerId, markerSize, markerImg, borderBits);
 
@@ -0,0 +1,659 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <aruco_detect/marker_detector.h>
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define MARKER_DECODER_AVX2
+#endif
+
+using namespace std;
+using namespace cv;
+
+
+MarkerDecoder::MarkerDecoder(const Ptr<aruco::Dictionary> &dictionary)
+{
+    markerSize = dictionary->markerSize;
+    numMarkers = dictionary->bytesList.rows;
+    codes.resize(numMarkers * 4);
+
+    if (!supports(dictionary)) {
+        numMarkers = 0;
+        codes.clear();
+    }
+
+    for (int m = 0; m < numMarkers; m++) {
+        Mat bits = aruco::Dictionary::getBitsFromByteList(
+            dictionary->bytesList.rowRange(m, m + 1), markerSize);
+        for (int r = 0; r < 4; r++) {
+            codes[4 * m + r] = pack(bits.ptr(), markerSize, bits.step, r);
+        }
+    }
+
+    setSimd(true);
+}
+
+
+bool MarkerDecoder::setSimd(bool enable)
+{
+#ifdef MARKER_DECODER_AVX2
+    simd = enable && __builtin_cpu_supports("avx2");
+#else
+    simd = false;
+#endif
+    return simd;
+}
+
+
+uint64_t MarkerDecoder::pack(const uchar *bits, int size, int stride, int rotation)
+{
+    uint64_t code = 0;
+    for (int row = 0; row < size; row++) {
+        for (int col = 0; col < size; col++) {
+            int y, x;
+            switch (rotation) {
+              case 1:  y = col;            x = size - 1 - row; break;
+              case 2:  y = size - 1 - row; x = size - 1 - col; break;
+              case 3:  y = size - 1 - col; x = row;            break;
+              default: y = row;            x = col;            break;
+            }
+            code = (code << 1) | (bits[y * stride + x] & 1);
+        }
+    }
+    return code;
+}
+
+
+static bool identifyScalar(const uint64_t *codes, int numMarkers, uint64_t code,
+                           int maxDistance, int &id, int &rotation)
+{
+    int best = maxDistance + 1;
+    for (int i = 0; i < numMarkers * 4; i++) {
+        int distance = __builtin_popcountll(code ^ codes[i]);
+        if (distance < best) {
+            best = distance;
+            id = i / 4;
+            rotation = i % 4;
+            if (distance == 0) {
+                break;
+            }
+        }
+    }
+    return best <= maxDistance;
+}
+
+
+#ifdef MARKER_DECODER_AVX2
+
+// The distances to the four rotations of a marker are counted together,
+// 4 bits at a time with a lookup table, and summed per 64-bit lane. Only
+// when one of them beats the best so far is it looked at on its own
+
+__attribute__((target("avx2")))
+static bool identifyAvx2(const uint64_t *codes, int numMarkers, uint64_t code,
+                         int maxDistance, int &id, int &rotation)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i candidate = _mm256_set1_epi64x(code);
+
+    int best = maxDistance + 1;
+    __m256i bestVec = _mm256_set1_epi64x(best);
+
+    for (int m = 0; m < numMarkers; m++) {
+        __m256i diff = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i *)(codes + 4 * m)), candidate);
+        __m256i low = _mm256_and_si256(diff, nibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(diff, 4), nibble);
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low),
+                                         _mm256_shuffle_epi8(lookup, high));
+        __m256i distances = _mm256_sad_epu8(counts, zero);
+
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi64(bestVec, distances)) == 0) {
+            continue;
+        }
+
+        alignas(32) uint64_t d[4];
+        _mm256_store_si256((__m256i *)d, distances);
+        for (int r = 0; r < 4; r++) {
+            if ((int)d[r] < best) {
+                best = d[r];
+                id = m;
+                rotation = r;
+            }
+        }
+        if (best == 0) {
+            break;
+        }
+        bestVec = _mm256_set1_epi64x(best);
+    }
+    return best <= maxDistance;
+}
+
+#endif
+
+
+bool MarkerDecoder::identify(uint64_t code, int maxDistance, int &id, int &rotation) const
+{
+#ifdef MARKER_DECODER_AVX2
+    if (simd) {
+        return identifyAvx2(codes.data(), numMarkers, code, maxDistance, id, rotation);
+    }
+#endif
+    return identifyScalar(codes.data(), numMarkers, code, maxDistance, id, rotation);
+}
+
+
+bool MarkerDecoder::identify(uint64_t code, int maxDistance, const vector<int> &markers,
+                             int &id, int &rotation) const
+{
+    int best = maxDistance + 1;
+    for (int m : markers) {
+        if (m < 0 || m >= numMarkers) {
+            continue;
+        }
+        for (int r = 0; r < 4; r++) {
+            int distance = __builtin_popcountll(code ^ codes[4 * m + r]);
+            if (distance < best) {
+                best = distance;
+                id = m;
+                rotation = r;
+            }
+        }
+        if (best == 0) {
+            break;
+        }
+    }
+    return best <= maxDistance;
+}
+
+
+MarkerDetector::MarkerDetector(const Ptr<aruco::Dictionary> &dictionary,
+                               const Ptr<aruco::DetectorParameters> &params) :
+    dictionary(dictionary), params(params), decoder(dictionary)
+{
+}
+
+
+// Quadrilaterals in the image thresholded at each window size, filtered on
+// size, shape and distance from the edge of the image as in
+// cv::aruco::detectMarkers
+
+void MarkerDetector::findCandidates(bool keepContours)
+{
+    candidates.clear();
+
+    int maxDimension = max(gray.cols, gray.rows);
+    double minPerimeter = params->minMarkerPerimeterRate * maxDimension;
+    double maxPerimeter = params->maxMarkerPerimeterRate * maxDimension;
+    int minWindow = max(3, params->adaptiveThreshWinSizeMin);
+    int maxWindow = max(minWindow, params->adaptiveThreshWinSizeMax);
+    int step = max(1, params->adaptiveThreshWinSizeStep);
+    int border = params->minDistanceToBorder;
+
+    for (int window = minWindow; window <= maxWindow; window += step) {
+        adaptiveThreshold(gray, thresh, 255, ADAPTIVE_THRESH_MEAN_C,
+                          THRESH_BINARY_INV, window | 1,
+                          params->adaptiveThreshConstant);
+        findContours(thresh, contours, RETR_LIST, CHAIN_APPROX_NONE);
+
+        for (const vector<Point> &contour : contours) {
+            if (contour.size() < minPerimeter || contour.size() > maxPerimeter) {
+                continue;
+            }
+
+            approxPolyDP(contour, approx,
+                         contour.size() * params->polygonalApproxAccuracyRate, true);
+            if (approx.size() != 4) {
+                continue;
+            }
+            if (!isContourConvex(approx)) {
+                stats.notConvex++;
+                continue;
+            }
+
+            double minCornerDistance = contour.size() * params->minCornerDistanceRate;
+            bool good = true;
+            for (int i = 0; i < 4 && good; i++) {
+                Point d = approx[i] - approx[(i + 1) % 4];
+                good = d.x * d.x + d.y * d.y >= minCornerDistance * minCornerDistance &&
+                       approx[i].x >= border && approx[i].y >= border &&
+                       approx[i].x < gray.cols - 1 - border &&
+                       approx[i].y < gray.rows - 1 - border;
+            }
+            if (!good) {
+                continue;
+            }
+
+            Candidate candidate;
+            candidate.perimeter = contour.size();
+            for (const Point &p : approx) {
+                candidate.corners.push_back(Point2f(p.x, p.y));
+            }
+
+            vector<Point2f> &c = candidate.corners;
+            double cross = (c[1].x - c[0].x) * (c[2].y - c[0].y) -
+                           (c[1].y - c[0].y) * (c[2].x - c[0].x);
+            if (cross < 0.0) {
+                swap(c[1], c[3]);
+            }
+            if (keepContours) {
+                candidate.contour = contour;
+            }
+            candidates.push_back(std::move(candidate));
+        }
+    }
+}
+
+
+// Of candidates whose corners are closer than minMarkerDistanceRate of the
+// smaller perimeter, keep the larger one. The same quadrilateral is
+// usually found at several window sizes, and both edges of the border
+
+void MarkerDetector::removeTooClose()
+{
+    removed.assign(candidates.size(), false);
+
+    for (int i = 0; i < candidates.size(); i++) {
+        for (int j = i + 1; j < candidates.size() && !removed[i]; j++) {
+            if (removed[j]) {
+                continue;
+            }
+            const vector<Point2f> &a = candidates[i].corners;
+            const vector<Point2f> &b = candidates[j].corners;
+
+            double minDistance = params->minMarkerDistanceRate *
+                min(candidates[i].perimeter, candidates[j].perimeter);
+
+            for (int offset = 0; offset < 4; offset++) {
+                double sum = 0.0;
+                for (int k = 0; k < 4; k++) {
+                    Point2f d = a[(k + offset) % 4] - b[k];
+                    sum += d.x * d.x + d.y * d.y;
+                }
+                if (sum / 4.0 < minDistance * minDistance) {
+                    if (candidates[i].perimeter > candidates[j].perimeter) {
+                        removed[j] = true;
+                    }
+                    else {
+                        removed[i] = true;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+// Intensity of the pixel at a point given in cells of the marker, from
+// the top left of its border, or -1 outside the image
+
+static int sampleCell(const Mat &gray, const Matx33d &H, double u, double v)
+{
+    double w = H(2, 0) * u + H(2, 1) * v + H(2, 2);
+    int x = cvRound((H(0, 0) * u + H(0, 1) * v + H(0, 2)) / w);
+    int y = cvRound((H(1, 0) * u + H(1, 1) * v + H(1, 2)) / w);
+    if (x < 0 || y < 0 || x >= gray.cols || y >= gray.rows) {
+        return -1;
+    }
+    return gray.at<uchar>(y, x);
+}
+
+
+// Reject candidates that are not markers from a few pixels, without
+// removing their perspective. The sides must be of similar lengths, each
+// side must be darker just inside than just outside, and the centres of
+// the border cells must be dark compared with the quiet zone around the
+// marker
+
+bool MarkerDetector::prefilter(const vector<Point2f> &corners)
+{
+    double shortest = norm(corners[0] - corners[3]);
+    double longest = shortest;
+    for (int i = 0; i < 3; i++) {
+        double length = norm(corners[i + 1] - corners[i]);
+        shortest = min(shortest, length);
+        longest = max(longest, length);
+    }
+    if (longest > prefilterParams.maxAspectRatio * shortest) {
+        stats.aspectRatio++;
+        return false;
+    }
+
+    const double size = dictionary->markerSize + 2 * params->markerBorderBits;
+    Point2f square[4] = {
+        Point2f(0, 0), Point2f(size, 0), Point2f(size, size), Point2f(0, size)
+    };
+    Matx33d H = getPerspectiveTransform(square, corners.data());
+
+    // Each side, from its start in cells and along it, and the outward normal
+    const double sides[4][6] = {
+        {0, 0, 1, 0, 0, -1}, {size, 0, 0, 1, 1, 0},
+        {size, size, -1, 0, 0, 1}, {0, size, 0, -1, -1, 0}
+    };
+    double outsideTotal = 0.0;
+    int outsideCount = 0;
+    for (int s = 0; s < 4; s++) {
+        const double *side = sides[s];
+        double gradient = 0.0;
+        int count = 0;
+        for (int i = 1; i <= 3; i++) {
+            double u = side[0] + side[2] * size * i / 4.0;
+            double v = side[1] + side[3] * size * i / 4.0;
+            int outside = sampleCell(gray, H, u + side[4] * 0.5, v + side[5] * 0.5);
+            int inside = sampleCell(gray, H, u - side[4] * 0.5, v - side[5] * 0.5);
+            if (outside >= 0 && inside >= 0) {
+                gradient += outside - inside;
+                outsideTotal += outside;
+                outsideCount++;
+                count++;
+            }
+        }
+        if (count > 0 && gradient / count < prefilterParams.minGradient) {
+            stats.edgeGradient++;
+            return false;
+        }
+    }
+
+    borderSamples.clear();
+    double borderTotal = 0.0;
+    for (int i = 0; i < size - 1; i++) {
+        const double cells[4][2] = {
+            {i + 0.5, 0.5}, {size - 0.5, i + 0.5},
+            {size - 0.5 - i, size - 0.5}, {0.5, size - 0.5 - i}
+        };
+        for (int s = 0; s < 4; s++) {
+            int sample = sampleCell(gray, H, cells[s][0], cells[s][1]);
+            if (sample >= 0) {
+                borderSamples.push_back(sample);
+                borderTotal += sample;
+            }
+        }
+    }
+    if (outsideCount == 0 || borderSamples.empty()) {
+        return true;
+    }
+
+    double threshold = (outsideTotal / outsideCount +
+                        borderTotal / borderSamples.size()) / 2.0;
+    int maxBorderErrors = dictionary->markerSize * dictionary->markerSize *
+                          params->maxErroneousBitsInBorderRate;
+    int borderErrors = 0;
+    for (int sample : borderSamples) {
+        if (sample > threshold && ++borderErrors > maxBorderErrors) {
+            stats.borderSample++;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Remove the perspective of a candidate and read its cells. The border
+// is read first, so that most candidates that are not markers are
+// rejected before the inside is looked at. Returns false if there are too
+// many white cells in the border
+
+bool MarkerDetector::readBits(const vector<Point2f> &corners, uint64_t &code)
+{
+    const int borderBits = params->markerBorderBits;
+    const int size = dictionary->markerSize + 2 * borderBits;
+    const int cell = params->perspectiveRemovePixelPerCell;
+    const int side = size * cell;
+
+    Point2f square[4] = {
+        Point2f(0, 0), Point2f(side - 1, 0),
+        Point2f(side - 1, side - 1), Point2f(0, side - 1)
+    };
+    Mat transform = getPerspectiveTransform(corners.data(), square);
+    warpPerspective(gray, warped, transform, Size(side, side), INTER_NEAREST);
+
+    Scalar mean, stddev;
+    meanStdDev(warped, mean, stddev);
+    if (stddev[0] < params->minOtsuStdDev) {
+        // All one colour, which is a marker of all black cells only if the
+        // colour is black
+        code = 0;
+        return mean[0] <= 127;
+    }
+    threshold(warped, warped, 125, 255, THRESH_BINARY | THRESH_OTSU);
+
+    const int margin = params->perspectiveRemoveIgnoredMarginPerCell * cell;
+    const int inner = cell - 2 * margin;
+    const int half = inner * inner / 2;
+    const int maxBorderErrors = dictionary->markerSize * dictionary->markerSize *
+                                params->maxErroneousBitsInBorderRate;
+    int borderErrors = 0;
+    cells.resize(size * size);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                bool inBorder = y < borderBits || y >= size - borderBits ||
+                                x < borderBits || x >= size - borderBits;
+                if (inBorder != (pass == 0)) {
+                    continue;
+                }
+
+                Mat square = warped(Rect(x * cell + margin, y * cell + margin,
+                                         inner, inner));
+                cells[y * size + x] = countNonZero(square) > half ? 1 : 0;
+
+                if (inBorder) {
+                    borderErrors += cells[y * size + x];
+                    if (borderErrors > maxBorderErrors) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    code = MarkerDecoder::pack(&cells[borderBits * size + borderBits],
+                               dictionary->markerSize, size, 0);
+    return true;
+}
+
+
+// Corner refinement methods. OpenCV 3.2 only has a flag for subpixel
+// refinement, later versions have cv::aruco::CornerRefineMethod
+
+enum Refinement { REFINE_NONE, REFINE_SUBPIX, REFINE_CONTOUR, REFINE_OTHER };
+
+static Refinement refinementMethod(const aruco::DetectorParameters &params)
+{
+#if OPENCV_MINOR_VERSION==2
+    return params.doCornerRefinement ? REFINE_SUBPIX : REFINE_NONE;
+#else
+    switch (params.cornerRefinementMethod) {
+        case aruco::CORNER_REFINE_NONE:
+            return REFINE_NONE;
+        case aruco::CORNER_REFINE_SUBPIX:
+            return REFINE_SUBPIX;
+        case aruco::CORNER_REFINE_CONTOUR:
+            return REFINE_CONTOUR;
+        default:
+            // Such as CORNER_REFINE_APRILTAG, which finds the quadrilaterals
+            // differently
+            return REFINE_OTHER;
+    }
+#endif
+}
+
+
+// Refine the corners of a candidate as CORNER_REFINE_CONTOUR does, by
+// fitting a line to the points of its contour along each side and
+// intersecting the lines of adjacent sides. The corners are points of the
+// contour, as they were found by approximating it
+
+static void refineCornersWithContour(const vector<Point> &contour,
+                                     vector<Point2f> &corners)
+{
+    int n = contour.size();
+    int index[4];
+    for (int j = 0; j < 4; j++) {
+        float best = FLT_MAX;
+        for (int k = 0; k < n; k++) {
+            float dx = contour[k].x - corners[j].x;
+            float dy = contour[k].y - corners[j].y;
+            if (dx * dx + dy * dy < best) {
+                best = dx * dx + dy * dy;
+                index[j] = k;
+            }
+        }
+    }
+
+    // The contour may run either way round the corners
+    int dir = (index[1] - index[0] + n) % n < (index[3] - index[0] + n) % n ? 1 : n - 1;
+
+    // Line along the side from corner j to corner j + 1, excluding the
+    // corners themselves
+    Vec4f lines[4];
+    vector<Point> side;
+    for (int j = 0; j < 4; j++) {
+        side.clear();
+        for (int k = (index[j] + dir) % n; k != index[(j + 1) % 4]; k = (k + dir) % n) {
+            side.push_back(contour[k]);
+        }
+        if (side.size() < 2) {
+            return;
+        }
+        fitLine(side, lines[j], DIST_L2, 0, 0.01, 0.01);
+    }
+
+    for (int j = 0; j < 4; j++) {
+        const Vec4f &a = lines[(j + 3) % 4];
+        const Vec4f &b = lines[j];
+        float det = a[0] * b[1] - a[1] * b[0];
+        if (fabs(det) < 1e-6) {
+            continue;
+        }
+        float t = ((b[2] - a[2]) * b[1] - (b[3] - a[3]) * b[0]) / det;
+        corners[j] = Point2f(a[2] + t * a[0], a[3] + t * a[1]);
+    }
+}
+
+
+void MarkerDetector::detect(const Mat &image, vector<vector<Point2f> > &corners,
+                            vector<int> &ids, const vector<int> *expected)
+{
+    corners.clear();
+    ids.clear();
+
+    if (image.channels() == 3) {
+        cvtColor(image, gray, COLOR_BGR2GRAY);
+    }
+    else {
+        gray = image;
+    }
+
+    Refinement refinement = refinementMethod(*params);
+    if (refinement == REFINE_OTHER) {
+        vector<vector<Point2f> > found;
+        vector<int> foundIds;
+        aruco::detectMarkers(gray, dictionary, found, foundIds, params);
+        for (int i = 0; i < foundIds.size(); i++) {
+            if (expected == nullptr ||
+                find(expected->begin(), expected->end(), foundIds[i]) != expected->end()) {
+                ids.push_back(foundIds[i]);
+                corners.push_back(found[i]);
+            }
+        }
+        return;
+    }
+
+    findCandidates(refinement == REFINE_CONTOUR);
+    removeTooClose();
+
+    int maxDistance = dictionary->maxCorrectionBits * params->errorCorrectionRate;
+
+    for (int i = 0; i < candidates.size(); i++) {
+        if (removed[i]) {
+            continue;
+        }
+
+        stats.candidates++;
+        if (prefilterParams.enabled && !prefilter(candidates[i].corners)) {
+            continue;
+        }
+
+        stats.warped++;
+        uint64_t code;
+        int id, rotation;
+        if (!readBits(candidates[i].corners, code)) {
+            stats.border++;
+            continue;
+        }
+        bool found = expected != nullptr ?
+            decoder.identify(code, maxDistance, *expected, id, rotation) :
+            decoder.identify(code, maxDistance, id, rotation);
+        if (!found) {
+            stats.unidentified++;
+            continue;
+        }
+
+        vector<Point2f> &c = candidates[i].corners;
+        if (refinement == REFINE_CONTOUR) {
+            refineCornersWithContour(candidates[i].contour, c);
+        }
+
+        // Start from the corner that is top left in the dictionary
+        vector<Point2f> rotated(4);
+        for (int j = 0; j < 4; j++) {
+            rotated[j] = c[(j + 4 - rotation) % 4];
+        }
+
+        ids.push_back(id);
+        corners.push_back(rotated);
+    }
+
+    if (refinement == REFINE_SUBPIX) {
+        TermCriteria criteria(TermCriteria::MAX_ITER | TermCriteria::EPS,
+                              params->cornerRefinementMaxIterations,
+                              params->cornerRefinementMinAccuracy);
+        Size window(params->cornerRefinementWinSize, params->cornerRefinementWinSize);
+        for (vector<Point2f> &c : corners) {
+            cornerSubPix(gray, c, window, Size(-1, -1), criteria);
+        }
+    }
+}
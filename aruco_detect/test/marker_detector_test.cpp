@@ -0,0 +1,164 @@
+/*
+Checks that MarkerDetector finds the same markers, with the same corners,
+as cv::aruco::detectMarkers with the same parameters. Both the AVX2 and
+the scalar identification are checked, as is the search for an expected
+subset of markers used with detection hints
+*/
+
+#include <gtest/gtest.h>
+
+#include <aruco_detect/marker_detector.h>
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<int, std::vector<cv::Point2f> > Markers;
+
+
+class MarkerDetectorTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    dictionary = cv::aruco::getPredefinedDictionary(7);
+    params = cv::aruco::DetectorParameters::create();
+  }
+
+  // Markers found by each detector, keyed by id
+  Markers arucoMarkers(const cv::Mat &image) {
+    std::vector<std::vector<cv::Point2f> > corners;
+    std::vector<int> ids;
+    cv::aruco::detectMarkers(image, dictionary, corners, ids, params);
+    return toMap(corners, ids);
+  }
+
+  Markers detectorMarkers(const cv::Mat &image, bool simd,
+                          const std::vector<int> *expected = nullptr) {
+    MarkerDetector detector(dictionary, params);
+    detector.setSimd(simd);
+    std::vector<std::vector<cv::Point2f> > corners;
+    std::vector<int> ids;
+    detector.detect(image, corners, ids, expected);
+    return toMap(corners, ids);
+  }
+
+  static Markers toMap(const std::vector<std::vector<cv::Point2f> > &corners,
+                       const std::vector<int> &ids) {
+    Markers markers;
+    for (int i = 0; i < ids.size(); i++) {
+      markers[ids[i]] = corners[i];
+    }
+    return markers;
+  }
+
+  // Corners are compared to within half a pixel, as the detectors can
+  // pick different contours of the same border
+  static void expectSame(const Markers &expected, const Markers &actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (const auto &m : expected) {
+      Markers::const_iterator it = actual.find(m.first);
+      ASSERT_TRUE(it != actual.end()) << "marker " << m.first;
+      ASSERT_EQ(4u, it->second.size());
+      for (int j = 0; j < 4; j++) {
+        EXPECT_NEAR(m.second[j].x, it->second[j].x, 0.5) << "marker " << m.first;
+        EXPECT_NEAR(m.second[j].y, it->second[j].y, 0.5) << "marker " << m.first;
+      }
+    }
+  }
+
+  // Markers on a white background, seen at an angle
+  cv::Mat board(const std::vector<int> &ids) {
+    const int size = 120, gap = 60;
+    cv::Mat image(2 * gap + 3 * (size + gap), 2 * gap + 4 * (size + gap), CV_8UC1,
+                  cv::Scalar(255));
+    for (int i = 0; i < ids.size(); i++) {
+      cv::Mat marker;
+      cv::aruco::drawMarker(dictionary, ids[i], size, marker, 1);
+      int x = gap + (i % 4) * (size + gap) + gap / 2;
+      int y = gap + (i / 4) * (size + gap) + gap / 2;
+      marker.copyTo(image(cv::Rect(x, y, size, size)));
+    }
+
+    std::vector<cv::Point2f> from = {
+      cv::Point2f(0, 0), cv::Point2f(image.cols, 0),
+      cv::Point2f(image.cols, image.rows), cv::Point2f(0, image.rows)
+    };
+    std::vector<cv::Point2f> to = {
+      cv::Point2f(40, 20), cv::Point2f(image.cols - 10, 60),
+      cv::Point2f(image.cols - 60, image.rows - 20), cv::Point2f(10, image.rows - 40)
+    };
+    cv::Mat warped;
+    cv::warpPerspective(image, warped, cv::getPerspectiveTransform(from, to),
+                        image.size(), cv::INTER_LINEAR, cv::BORDER_CONSTANT,
+                        cv::Scalar(255));
+    cv::GaussianBlur(warped, warped, cv::Size(3, 3), 0);
+    return warped;
+  }
+
+  std::vector<cv::Mat> images() {
+    std::vector<cv::Mat> result;
+    result.push_back(cv::imread(std::string(TEST_IMAGES) + "tag_01_d7_14cm.png",
+                                CV_LOAD_IMAGE_COLOR));
+    result.push_back(board({0, 1, 2, 3, 42, 100, 250, 511, 600, 777, 998, 999}));
+    return result;
+  }
+
+  cv::Ptr<cv::aruco::Dictionary> dictionary;
+  cv::Ptr<cv::aruco::DetectorParameters> params;
+};
+
+
+TEST_F(MarkerDetectorTest, sameAsAruco) {
+  for (const cv::Mat &image : images()) {
+    ASSERT_FALSE(image.empty());
+    Markers expected = arucoMarkers(image);
+    ASSERT_FALSE(expected.empty());
+
+    expectSame(expected, detectorMarkers(image, true));
+    expectSame(expected, detectorMarkers(image, false));
+  }
+}
+
+TEST_F(MarkerDetectorTest, sameAsArucoRefined) {
+#if OPENCV_MINOR_VERSION==2
+  params->doCornerRefinement = true;
+#else
+  params->cornerRefinementMethod = cv::aruco::CORNER_REFINE_SUBPIX;
+#endif
+  for (const cv::Mat &image : images()) {
+    Markers expected = arucoMarkers(image);
+    ASSERT_FALSE(expected.empty());
+
+    expectSame(expected, detectorMarkers(image, true));
+    expectSame(expected, detectorMarkers(image, false));
+  }
+}
+
+TEST_F(MarkerDetectorTest, expectedSubset) {
+  std::vector<int> subset = {1, 42, 777, 5};
+
+  for (const cv::Mat &image : images()) {
+    Markers expected;
+    for (const auto &m : arucoMarkers(image)) {
+      if (std::find(subset.begin(), subset.end(), m.first) != subset.end()) {
+        expected.insert(m);
+      }
+    }
+
+    expectSame(expected, detectorMarkers(image, true, &subset));
+    expectSame(expected, detectorMarkers(image, false, &subset));
+  }
+
+  // Nothing expected, nothing found
+  std::vector<int> none;
+  EXPECT_TRUE(detectorMarkers(images()[1], true, &none).empty());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+// Compact log of the fiducials detected in each image and the camera info,
+// written by aruco_detect and replayed by fiducial_slam_replay without
+// images, detection or ROS transport. Logs are typically a few hundred
+// bytes per frame, and are read into memory in one go.
+//
+// All values are in host byte order:
+//   "FDET" version:u32
+//   then records, each starting with a type:u8
+//   'C' camera info: sec nsec:u32 frameId:str width height:u32
+//       distortionModel:str numD:u32 D:f64[numD] K:f64[9] R:f64[9] P:f64[12]
+//   'F' frame: sec nsec:u32 imageSeq:i32 frameId:str count:u32
+//       count * { id:i32 x0 y0 x1 y1 x2 y2 x3 y3:f32 }
+//   str is length:u16 followed by the characters
+
+#ifndef FIDUCIAL_COMMON_DETECTION_LOG_H
+#define FIDUCIAL_COMMON_DETECTION_LOG_H
+
+#include <fiducial_msgs/FiducialArray.h>
+#include <sensor_msgs/CameraInfo.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+namespace detection_log {
+
+static const char magic[4] = {'F', 'D', 'E', 'T'};
+static const uint32_t version = 1;
+
+// Bytes taken by each fiducial of a frame record
+static const size_t fiducialSize = sizeof(int32_t) + 8 * sizeof(float);
+
+// Counts above these are taken to be corruption rather than a record cut
+// short at the end of the log. OpenCV has at most 14 distortion
+// coefficients, and no dictionary has more than 1024 markers, each of
+// which is detected at most a few times in a frame
+static const uint32_t maxDistortion = 16;
+static const uint32_t maxFiducials = 16384;
+
+template<typename T>
+inline void put(std::string &buf, const T &value)
+{
+    buf.append((const char *)&value, sizeof(T));
+}
+
+inline void putString(std::string &buf, const std::string &s)
+{
+    uint16_t len = s.size() < 0xffff ? s.size() : 0xffff;
+    put(buf, len);
+    buf.append(s.data(), len);
+}
+
+template<typename T>
+inline bool get(const char *&p, const char *end, T &value)
+{
+    if (end - p < (ptrdiff_t)sizeof(T)) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+inline bool getString(const char *&p, const char *end, std::string &s)
+{
+    uint16_t len;
+    if (!get(p, end, len) || end - p < len) {
+        return false;
+    }
+    s.assign(p, len);
+    p += len;
+    return true;
+}
+
+template<typename T>
+inline bool getArray(const char *&p, const char *end, T *values, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!get(p, end, values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+// A record of a log, either a camera info or the fiducials of a frame
+struct DetectionLogRecord {
+    sensor_msgs::CameraInfo::Ptr cameraInfo;
+    fiducial_msgs::FiducialArray::Ptr frame;
+
+    const ros::Time &stamp() const {
+        return cameraInfo ? cameraInfo->header.stamp : frame->header.stamp;
+    }
+};
+
+class DetectionLogWriter {
+    FILE *fp;
+    std::string buf;
+
+    // Write the record in buf. Each record is flushed so that the log is
+    // complete if the node is killed
+    bool flush() {
+        bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size() &&
+                  fflush(fp) == 0;
+        buf.clear();
+        return ok;
+    }
+
+  public:
+    DetectionLogWriter() : fp(NULL) {}
+    ~DetectionLogWriter() { close(); }
+
+    bool open(const std::string &filename) {
+        close();
+        fp = fopen(filename.c_str(), "wb");
+        if (fp == NULL) {
+            return false;
+        }
+        buf.append(detection_log::magic, 4);
+        detection_log::put(buf, detection_log::version);
+        return flush();
+    }
+
+    bool isOpen() const { return fp != NULL; }
+
+    void close() {
+        if (fp != NULL) {
+            fclose(fp);
+            fp = NULL;
+        }
+    }
+
+    bool write(const sensor_msgs::CameraInfo &info) {
+        using namespace detection_log;
+        if (fp == NULL) {
+            return false;
+        }
+
+        put(buf, 'C');
+        put(buf, (uint32_t)info.header.stamp.sec);
+        put(buf, (uint32_t)info.header.stamp.nsec);
+        putString(buf, info.header.frame_id);
+        put(buf, (uint32_t)info.width);
+        put(buf, (uint32_t)info.height);
+        putString(buf, info.distortion_model);
+        put(buf, (uint32_t)info.D.size());
+        for (double d : info.D) {
+            put(buf, d);
+        }
+        for (double k : info.K) {
+            put(buf, k);
+        }
+        for (double r : info.R) {
+            put(buf, r);
+        }
+        for (double p : info.P) {
+            put(buf, p);
+        }
+        return flush();
+    }
+
+    bool write(const fiducial_msgs::FiducialArray &frame) {
+        using namespace detection_log;
+        if (fp == NULL) {
+            return false;
+        }
+
+        put(buf, 'F');
+        put(buf, (uint32_t)frame.header.stamp.sec);
+        put(buf, (uint32_t)frame.header.stamp.nsec);
+        put(buf, (int32_t)frame.image_seq);
+        putString(buf, frame.header.frame_id);
+        put(buf, (uint32_t)frame.fiducials.size());
+        for (const fiducial_msgs::Fiducial &fid : frame.fiducials) {
+            put(buf, (int32_t)fid.fiducial_id);
+            const float corners[8] = {
+                (float)fid.x0, (float)fid.y0, (float)fid.x1, (float)fid.y1,
+                (float)fid.x2, (float)fid.y2, (float)fid.x3, (float)fid.y3
+            };
+            buf.append((const char *)corners, sizeof(corners));
+        }
+        return flush();
+    }
+};
+
+// Read a whole log. Returns false if it cannot be read, or is corrupt
+// before the end. A record cut short at the end, by the node being
+// killed while writing it, is ignored. Records are written whole, so
+// only the last one can be short, and then only if its counts are
+// plausible
+inline bool loadDetectionLog(const std::string &filename,
+                             std::vector<DetectionLogRecord> &records)
+{
+    using namespace detection_log;
+
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    std::string contents;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        contents.append(chunk, n);
+    }
+    fclose(fp);
+
+    const char *p = contents.data();
+    const char *end = p + contents.size();
+
+    char fileMagic[4];
+    uint32_t fileVersion;
+    if (!get(p, end, fileMagic) || memcmp(fileMagic, magic, 4) != 0 ||
+        !get(p, end, fileVersion) || fileVersion != version) {
+        return false;
+    }
+
+    while (p < end) {
+        char type;
+        uint32_t sec, nsec;
+        get(p, end, type);
+        DetectionLogRecord record;
+
+        if (type == 'C') {
+            sensor_msgs::CameraInfo::Ptr info(new sensor_msgs::CameraInfo);
+            uint32_t width, height, numD;
+            if (!get(p, end, sec) || !get(p, end, nsec) ||
+                !getString(p, end, info->header.frame_id) ||
+                !get(p, end, width) || !get(p, end, height) ||
+                !getString(p, end, info->distortion_model) ||
+                !get(p, end, numD)) {
+                return true;
+            }
+            if (numD > maxDistortion) {
+                return false;
+            }
+            if ((size_t)(end - p) < numD * sizeof(double)) {
+                return true;
+            }
+            info->header.stamp = ros::Time(sec, nsec);
+            info->width = width;
+            info->height = height;
+            info->D.resize(numD);
+            getArray(p, end, info->D.data(), numD);
+            if (!getArray(p, end, info->K.data(), 9) ||
+                !getArray(p, end, info->R.data(), 9) ||
+                !getArray(p, end, info->P.data(), 12)) {
+                return true;
+            }
+            record.cameraInfo = info;
+        }
+        else if (type == 'F') {
+            fiducial_msgs::FiducialArray::Ptr frame(new fiducial_msgs::FiducialArray);
+            int32_t imageSeq;
+            uint32_t count;
+            if (!get(p, end, sec) || !get(p, end, nsec) || !get(p, end, imageSeq) ||
+                !getString(p, end, frame->header.frame_id) || !get(p, end, count)) {
+                return true;
+            }
+            if (count > maxFiducials) {
+                return false;
+            }
+            if ((size_t)(end - p) < count * fiducialSize) {
+                return true;
+            }
+            frame->header.stamp = ros::Time(sec, nsec);
+            frame->image_seq = imageSeq;
+
+            frame->fiducials.resize(count);
+            for (fiducial_msgs::Fiducial &fid : frame->fiducials) {
+                int32_t id;
+                float c[8];
+                get(p, end, id);
+                getArray(p, end, c, 8);
+                fid.fiducial_id = id;
+                fid.direction = 0;
+                fid.x0 = c[0];
+                fid.y0 = c[1];
+                fid.x1 = c[2];
+                fid.y1 = c[3];
+                fid.x2 = c[4];
+                fid.y2 = c[5];
+                fid.x3 = c[6];
+                fid.y3 = c[7];
+            }
+            record.frame = frame;
+        }
+        else {
+            return false;
+        }
+
+        records.push_back(record);
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+// Health and throughput of a node that processes a stream of camera
+// frames, reported on /diagnostics. Shared by aruco_detect and
+// fiducial_slam. Rates, times and drops are over the time since the
+// previous report.
+
+#ifndef FIDUCIAL_COMMON_FRAME_DIAGNOSTICS_H
+#define FIDUCIAL_COMMON_FRAME_DIAGNOSTICS_H
+
+#include <ros/ros.h>
+#include <diagnostic_updater/diagnostic_updater.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+// Warning and error levels of a value, read from the parameters
+// name_warn and name_error. A level of 0 is not checked
+struct DiagnosticLimit {
+    double warn;
+    double error;
+
+    void param(ros::NodeHandle &nh, const std::string &name,
+               double defaultWarn, double defaultError) {
+        nh.param<double>(name + "_warn", warn, defaultWarn);
+        nh.param<double>(name + "_error", error, defaultError);
+    }
+
+    // Raise the level of the status if the value is above a level
+    void checkAbove(diagnostic_updater::DiagnosticStatusWrapper &stat,
+                    double value, const std::string &message) const {
+        if (error > 0 && value > error) {
+            stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::ERROR, message);
+        }
+        else if (warn > 0 && value > warn) {
+            stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN, message);
+        }
+    }
+
+    // Raise the level of the status if the value is below a level
+    void checkBelow(diagnostic_updater::DiagnosticStatusWrapper &stat,
+                    double value, const std::string &message) const {
+        if (error > 0 && value < error) {
+            stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::ERROR, message);
+        }
+        else if (warn > 0 && value < warn) {
+            stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN, message);
+        }
+    }
+};
+
+// Diagnostic task for the frames of a node, and the pose age and camera
+// info availability
+class FrameDiagnostics {
+    // Limits, from the diag_ parameters
+    DiagnosticLimit inputRate;
+    DiagnosticLimit dropRate;
+    DiagnosticLimit frameTime;
+    DiagnosticLimit poseAge;
+
+    // Last sequence number of each source, to count frames lost before
+    // they reached the node
+    std::map<std::string, uint32_t> lastSeq;
+
+    ros::Time windowStart;
+    int inputFrames;
+    int outputFrames;
+    int droppedFrames;
+    int skippedFrames;
+    int hintedFrames;
+    int processedFrames;
+    int markers;
+    double totalTime;
+    double maxTime;
+    unsigned long totalDropped;
+
+    ros::Time startTime;
+    ros::Time lastPose;
+
+    // Cameras with intrinsics, and how many are needed
+    int camInfos;
+    int camInfosNeeded;
+
+  public:
+    FrameDiagnostics(ros::NodeHandle &nh) {
+        inputRate.param(nh, "diag_input_rate", 5.0, 1.0);
+        dropRate.param(nh, "diag_drop_rate", 0.1, 0.5);
+        frameTime.param(nh, "diag_frame_time", 0.05, 0.2);
+        poseAge.param(nh, "diag_pose_age", 10.0, 0.0);
+
+        startTime = windowStart = ros::Time::now();
+        inputFrames = outputFrames = droppedFrames = skippedFrames = 0;
+        hintedFrames = 0;
+        processedFrames = markers = 0;
+        totalTime = maxTime = 0.0;
+        totalDropped = 0;
+        camInfos = camInfosNeeded = 0;
+    }
+
+    // A frame has arrived. Gaps in the sequence numbers from a source are
+    // counted as dropped frames, a large jump is taken to be a restart
+    void received(const std::string &source, uint32_t seq) {
+        inputFrames++;
+
+        std::map<std::string, uint32_t>::iterator it = lastSeq.find(source);
+        if (it != lastSeq.end() && seq > it->second && seq - it->second < 1000) {
+            droppedFrames += seq - it->second - 1;
+            totalDropped += seq - it->second - 1;
+        }
+        lastSeq[source] = seq;
+    }
+
+    // A frame has been deliberately not processed
+    void skipped() {
+        skippedFrames++;
+    }
+
+    // A frame has been searched only where the map hinted fiducials are
+    void hinted() {
+        hintedFrames++;
+    }
+
+    // A frame with numMarkers markers in it has been processed, taking the
+    // given time in seconds
+    void processed(double seconds, int numMarkers) {
+        processedFrames++;
+        markers += numMarkers;
+        totalTime += seconds;
+        maxTime = std::max(maxTime, seconds);
+    }
+
+    // A result has been published
+    void published() {
+        outputFrames++;
+    }
+
+    // A pose has been estimated
+    void posed() {
+        lastPose = ros::Time::now();
+    }
+
+    void cameraInfo(int have, int needed) {
+        camInfos = have;
+        camInfosNeeded = needed;
+    }
+
+    void run(diagnostic_updater::DiagnosticStatusWrapper &stat) {
+        ros::Time now = ros::Time::now();
+        double period = (now - windowStart).toSec();
+        windowStart = now;
+
+        double input = period > 0 ? inputFrames / period : 0.0;
+        double output = period > 0 ? outputFrames / period : 0.0;
+        double drops = inputFrames + droppedFrames > 0 ?
+            (double)droppedFrames / (inputFrames + droppedFrames) : 0.0;
+        double meanTime = processedFrames > 0 ? totalTime / processedFrames : 0.0;
+        double age = (now - (lastPose.isZero() ? startTime : lastPose)).toSec();
+
+        stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+        stat.add("Input rate (Hz)", input);
+        stat.add("Output rate (Hz)", output);
+        stat.add("Dropped frames", droppedFrames);
+        stat.add("Total dropped frames", totalDropped);
+        stat.add("Skipped frames", skippedFrames);
+        stat.add("Hinted frames", hintedFrames);
+        stat.add("Mean frame time (ms)", meanTime * 1000.0);
+        stat.add("Max frame time (ms)", maxTime * 1000.0);
+        stat.add("Markers per frame",
+                 processedFrames > 0 ? (double)markers / processedFrames : 0.0);
+        stat.add("Time since last pose (s)", age);
+        stat.addf("Camera info", "%d of %d", camInfos, camInfosNeeded);
+
+        inputRate.checkBelow(stat, input, "Low input rate");
+        dropRate.checkAbove(stat, drops, "Dropping frames");
+        frameTime.checkAbove(stat, meanTime, "Slow frames");
+        poseAge.checkAbove(stat, age, "No recent pose");
+        if (camInfos < camInfosNeeded) {
+            stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::ERROR,
+                              "No camera intrinsics");
+        }
+
+        inputFrames = outputFrames = droppedFrames = skippedFrames = 0;
+        hintedFrames = 0;
+        processedFrames = markers = 0;
+        totalTime = maxTime = 0.0;
+    }
+};
+
+#endif
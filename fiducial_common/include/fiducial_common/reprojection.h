@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+// Reprojection error of points observed by a camera, shared by aruco_detect
+// and fiducial_slam. It is evaluated for every marker and every pose solve,
+// so unlike cv::projectPoints it works on fixed-size types, computes no
+// Jacobians and does not allocate. Distortion models with more than 8
+// coefficients are left to cv::projectPoints.
+
+#ifndef FIDUCIAL_COMMON_REPROJECTION_H
+#define FIDUCIAL_COMMON_REPROJECTION_H
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+#include <math.h>
+
+#include <vector>
+
+// Copy up to count distortion coefficients from a row or column vector of
+// any type, filling the rest with zeros. It is an error to pass more
+// coefficients than the model has
+inline void readDistortion(const cv::Mat &distCoeffs, double *d, int count)
+{
+    const int n = distCoeffs.total();
+    CV_Assert(n <= count && distCoeffs.channels() == 1);
+
+    if (distCoeffs.type() == CV_64F && distCoeffs.isContinuous()) {
+        const double *p = distCoeffs.ptr<double>();
+        for (int i=0; i<count; i++) {
+            d[i] = i < n ? p[i] : 0.0;
+        }
+    }
+    else {
+        cv::Mat converted;
+        distCoeffs.convertTo(converted, CV_64F);
+        for (int i=0; i<count; i++) {
+            d[i] = i < n ? converted.at<double>(i) : 0.0;
+        }
+    }
+}
+
+// No distortion, for points that have already been undistorted
+struct NoDistortion {
+    NoDistortion(const cv::Mat &distCoeffs) {}
+
+    void apply(double &x, double &y) const {}
+};
+
+// The 5 coefficient radial-tangential model, k1 k2 p1 p2 k3, known as
+// plumb_bob in ROS camera info
+struct PlumbBobDistortion {
+    double k1, k2, p1, p2, k3;
+
+    PlumbBobDistortion(const cv::Mat &distCoeffs) {
+        double d[5];
+        readDistortion(distCoeffs, d, 5);
+        k1 = d[0];
+        k2 = d[1];
+        p1 = d[2];
+        p2 = d[3];
+        k3 = d[4];
+    }
+
+    void apply(double &x, double &y) const {
+        double r2 = x*x + y*y;
+        double radial = 1.0 + r2*(k1 + r2*(k2 + r2*k3));
+        double xd = x*radial + 2.0*p1*x*y + p2*(r2 + 2.0*x*x);
+        double yd = y*radial + p1*(r2 + 2.0*y*y) + 2.0*p2*x*y;
+        x = xd;
+        y = yd;
+    }
+};
+
+// The 8 coefficient rational model, k1 k2 p1 p2 k3 k4 k5 k6, known as
+// rational_polynomial in ROS camera info
+struct RationalDistortion {
+    double k1, k2, p1, p2, k3, k4, k5, k6;
+
+    RationalDistortion(const cv::Mat &distCoeffs) {
+        double d[8];
+        readDistortion(distCoeffs, d, 8);
+        k1 = d[0];
+        k2 = d[1];
+        p1 = d[2];
+        p2 = d[3];
+        k3 = d[4];
+        k4 = d[5];
+        k5 = d[6];
+        k6 = d[7];
+    }
+
+    void apply(double &x, double &y) const {
+        double r2 = x*x + y*y;
+        double radial = (1.0 + r2*(k1 + r2*(k2 + r2*k3))) /
+                        (1.0 + r2*(k4 + r2*(k5 + r2*k6)));
+        double xd = x*radial + 2.0*p1*x*y + p2*(r2 + 2.0*x*x);
+        double yd = y*radial + p1*(r2 + 2.0*y*y) + 2.0*p2*x*y;
+        x = xd;
+        y = yd;
+    }
+};
+
+// A camera with intrinsics and a distortion model, observing points in pixels
+template<class Distortion>
+struct CameraProjection {
+    double fx, fy, cx, cy;
+    Distortion distortion;
+
+    CameraProjection(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs)
+        : fx(cameraMatrix.at<double>(0, 0)), fy(cameraMatrix.at<double>(1, 1)),
+          cx(cameraMatrix.at<double>(0, 2)), cy(cameraMatrix.at<double>(1, 2)),
+          distortion(distCoeffs) {}
+
+    // Difference in pixels between the projection of a point in the camera
+    // frame and where it was observed
+    void residual(const cv::Vec3d &p, const cv::Point2f &observed,
+                  double &dx, double &dy) const {
+        double x = p[0] / p[2];
+        double y = p[1] / p[2];
+        distortion.apply(x, y);
+        dx = fx*x + cx - observed.x;
+        dy = fy*y + cy - observed.y;
+    }
+};
+
+// A camera observing points that have been undistorted to normalized image
+// coordinates. Residuals are scaled to pixels by the focal lengths
+struct NormalizedProjection {
+    double fx, fy;
+
+    NormalizedProjection(const cv::Mat &cameraMatrix)
+        : fx(cameraMatrix.at<double>(0, 0)), fy(cameraMatrix.at<double>(1, 1)) {}
+
+    void residual(const cv::Vec3d &p, const cv::Point2f &observed,
+                  double &dx, double &dy) const {
+        dx = (p[0] / p[2] - observed.x) * fx;
+        dy = (p[1] / p[2] - observed.y) * fy;
+    }
+};
+
+// Rotation matrix from a rotation vector, as cv::Rodrigues
+inline cv::Matx33d rotationMatrix(const cv::Vec3d &rvec)
+{
+    double theta = sqrt(rvec.dot(rvec));
+    if (theta < 1e-12) {
+        return cv::Matx33d(1.0, -rvec[2], rvec[1],
+                           rvec[2], 1.0, -rvec[0],
+                           -rvec[1], rvec[0], 1.0);
+    }
+
+    double x = rvec[0] / theta;
+    double y = rvec[1] / theta;
+    double z = rvec[2] / theta;
+    double c = cos(theta);
+    double s = sin(theta);
+    double t = 1.0 - c;
+
+    return cv::Matx33d(c + t*x*x,   t*x*y - s*z, t*x*z + s*y,
+                       t*x*y + s*z, c + t*y*y,   t*y*z - s*x,
+                       t*x*z - s*y, t*y*z + s*x, c + t*z*z);
+}
+
+// Mean squared reprojection error in pixels of n points
+template<class Projection>
+inline double reprojectionError(const Projection &camera, int n,
+                                const cv::Point3f *objectPoints,
+                                const cv::Point2f *imagePoints,
+                                const cv::Vec3d &rvec, const cv::Vec3d &tvec)
+{
+    const cv::Matx33d R = rotationMatrix(rvec);
+
+    double totalError = 0.0;
+    for (int i=0; i<n; i++) {
+        const cv::Point3f &op = objectPoints[i];
+        cv::Vec3d p = R * cv::Vec3d(op.x, op.y, op.z) + tvec;
+
+        double dx, dy;
+        camera.residual(p, imagePoints[i], dx, dy);
+        totalError += dx*dx + dy*dy;
+    }
+    return n > 0 ? totalError / n : 0.0;
+}
+
+// As above for a number of points known at compile time, such as the 4
+// corners of a marker, so the loop can be unrolled
+template<int N, class Projection>
+inline double reprojectionError(const Projection &camera,
+                                const cv::Point3f *objectPoints,
+                                const cv::Point2f *imagePoints,
+                                const cv::Vec3d &rvec, const cv::Vec3d &tvec)
+{
+    return reprojectionError(camera, N, objectPoints, imagePoints, rvec, tvec);
+}
+
+// Mean squared reprojection error in pixels of N points, choosing the
+// distortion model from the number of distortion coefficients. The thin
+// prism and tilted models, with 12 and 14, use cv::projectPoints
+template<int N>
+inline double reprojectionError(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+                                const cv::Point3f *objectPoints,
+                                const cv::Point2f *imagePoints,
+                                const cv::Vec3d &rvec, const cv::Vec3d &tvec)
+{
+    if (distCoeffs.total() > 8) {
+        std::vector<cv::Point3f> points(objectPoints, objectPoints + N);
+        std::vector<cv::Point2f> projected;
+        cv::projectPoints(points, rvec, tvec, cameraMatrix, distCoeffs, projected);
+
+        double totalError = 0.0;
+        for (int i=0; i<N; i++) {
+            double dx = projected[i].x - imagePoints[i].x;
+            double dy = projected[i].y - imagePoints[i].y;
+            totalError += dx*dx + dy*dy;
+        }
+        return N > 0 ? totalError / N : 0.0;
+    }
+    else if (distCoeffs.total() > 5) {
+        CameraProjection<RationalDistortion> camera(cameraMatrix, distCoeffs);
+        return reprojectionError<N>(camera, objectPoints, imagePoints, rvec, tvec);
+    }
+    else {
+        CameraProjection<PlumbBobDistortion> camera(cameraMatrix, distCoeffs);
+        return reprojectionError<N>(camera, objectPoints, imagePoints, rvec, tvec);
+    }
+}
+
+#endif
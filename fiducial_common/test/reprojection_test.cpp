@@ -0,0 +1,146 @@
+/*
+Tests of the reprojection error against cv::projectPoints, as it was
+computed before, for each distortion model and for distortion
+coefficients of other types and layouts
+*/
+
+#include <gtest/gtest.h>
+
+#include <fiducial_common/reprojection.h>
+
+#include <opencv2/calib3d.hpp>
+
+#include <random>
+#include <vector>
+
+
+// The reprojection error as computed before, with cv::projectPoints
+static double projectPointsError(const std::vector<cv::Point3f> &objectPoints,
+                                 const std::vector<cv::Point2f> &imagePoints,
+                                 const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+                                 const cv::Vec3d &rvec, const cv::Vec3d &tvec)
+{
+  std::vector<cv::Point2f> projectedPoints;
+  cv::projectPoints(objectPoints, rvec, tvec, cameraMatrix, distCoeffs,
+                    projectedPoints);
+
+  double totalError = 0.0;
+  for (unsigned int i=0; i<objectPoints.size(); i++) {
+    double dx = imagePoints[i].x - projectedPoints[i].x;
+    double dy = imagePoints[i].y - projectedPoints[i].y;
+    totalError += dx*dx + dy*dy;
+  }
+  return totalError / objectPoints.size();
+}
+
+
+class ReprojectionTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    cameraMatrix = (cv::Mat_<double>(3, 3) << 1006.1, 0.0, 655.9,
+                                              0.0, 1004.0, 490.6,
+                                              0.0, 0.0, 1.0);
+    rvec = cv::Vec3d(0.3, -0.2, 0.1);
+    tvec = cv::Vec3d(0.05, -0.1, 1.5);
+
+    // The corners of a marker, observed with some noise
+    const float half = 0.07;
+    objectPoints = {cv::Point3f(-half, half, 0), cv::Point3f(half, half, 0),
+                    cv::Point3f(half, -half, 0), cv::Point3f(-half, -half, 0)};
+  }
+
+  // Observations of the marker with distortion, with noise added
+  void observe(const cv::Mat &distCoeffs) {
+    std::mt19937 rng(1);
+    std::normal_distribution<double> noise(0.0, 0.5);
+    cv::projectPoints(objectPoints, rvec, tvec, cameraMatrix, distCoeffs, imagePoints);
+    for (cv::Point2f &p : imagePoints) {
+      p.x += noise(rng);
+      p.y += noise(rng);
+    }
+  }
+
+  void expectSameAsProjectPoints(const cv::Mat &distCoeffs) {
+    observe(distCoeffs);
+    double expected = projectPointsError(objectPoints, imagePoints, cameraMatrix,
+                                         distCoeffs, rvec, tvec);
+    double error = reprojectionError<4>(cameraMatrix, distCoeffs, objectPoints.data(),
+                                        imagePoints.data(), rvec, tvec);
+    EXPECT_GT(expected, 0.0);
+    EXPECT_NEAR(expected, error, 1e-3 * expected + 1e-6);
+  }
+
+  cv::Mat cameraMatrix;
+  cv::Vec3d rvec, tvec;
+  std::vector<cv::Point3f> objectPoints;
+  std::vector<cv::Point2f> imagePoints;
+};
+
+
+TEST_F(ReprojectionTest, noDistortion) {
+  expectSameAsProjectPoints(cv::Mat());
+  expectSameAsProjectPoints(cv::Mat::zeros(1, 5, CV_64F));
+}
+
+TEST_F(ReprojectionTest, plumbBob) {
+  expectSameAsProjectPoints((cv::Mat_<double>(1, 5) << 0.135, -0.234, 0.00067, 0.0048, 0.05));
+  expectSameAsProjectPoints((cv::Mat_<double>(1, 4) << 0.135, -0.234, 0.00067, 0.0048));
+}
+
+TEST_F(ReprojectionTest, rational) {
+  expectSameAsProjectPoints((cv::Mat_<double>(1, 8) <<
+                             0.135, -0.234, 0.00067, 0.0048, 0.05, 0.02, -0.01, 0.003));
+}
+
+TEST_F(ReprojectionTest, thinPrismAndTilted) {
+  cv::Mat thinPrism = (cv::Mat_<double>(1, 12) <<
+                       0.135, -0.234, 0.00067, 0.0048, 0.05, 0.02, -0.01, 0.003,
+                       0.001, -0.0005, 0.0008, 0.0002);
+  expectSameAsProjectPoints(thinPrism);
+
+  cv::Mat tilted = cv::Mat::zeros(1, 14, CV_64F);
+  thinPrism.copyTo(tilted.colRange(0, 12));
+  tilted.at<double>(12) = 0.01;
+  tilted.at<double>(13) = -0.02;
+  expectSameAsProjectPoints(tilted);
+}
+
+TEST_F(ReprojectionTest, coefficientTypes) {
+  cv::Mat coeffs = (cv::Mat_<double>(5, 1) << 0.135, -0.234, 0.00067, 0.0048, 0.05);
+
+  // Single precision
+  cv::Mat single;
+  coeffs.convertTo(single, CV_32F);
+  expectSameAsProjectPoints(single);
+
+  // A column of a larger matrix, which is not continuous
+  cv::Mat wide = cv::Mat::zeros(5, 3, CV_64F);
+  coeffs.copyTo(wide.col(1));
+  cv::Mat column = wide.col(1);
+  ASSERT_FALSE(column.isContinuous());
+  expectSameAsProjectPoints(column);
+}
+
+TEST_F(ReprojectionTest, tooManyCoefficients) {
+  cv::Mat coeffs = cv::Mat::zeros(1, 12, CV_64F);
+  EXPECT_THROW(PlumbBobDistortion distortion(coeffs), cv::Exception);
+  EXPECT_THROW(RationalDistortion distortion(coeffs), cv::Exception);
+}
+
+TEST_F(ReprojectionTest, rotationMatrix) {
+  for (const cv::Vec3d &r : {rvec, cv::Vec3d(0, 0, 0), cv::Vec3d(1e-14, 0, 0),
+                             cv::Vec3d(3.0, -0.5, 0.2)}) {
+    cv::Matx33d expected;
+    cv::Rodrigues(r, expected);
+    cv::Matx33d R = rotationMatrix(r);
+    for (int i=0; i<9; i++) {
+      EXPECT_NEAR(expected.val[i], R.val[i], 1e-12);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
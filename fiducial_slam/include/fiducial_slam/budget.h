@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <ros/time.h>
+
+#include <stdint.h>
+
+// Counts of work that was skipped or deferred because a frame ran out
+// of time
+struct BudgetCounters {
+    uint64_t frames;
+    uint64_t overBudget;
+    uint64_t skippedFiducials;
+    uint64_t skippedMulti;
+    uint64_t deferredUpdates;
+    uint64_t droppedUpdates;
+
+    BudgetCounters() : frames(0), overBudget(0), skippedFiducials(0),
+                       skippedMulti(0), deferredUpdates(0), droppedUpdates(0) {}
+};
+
+// Time allowed for processing a frame, measured from when it was
+// received. A limit of 0 means there is no limit
+class FrameBudget {
+    ros::WallTime start;
+    double limit;
+
+  public:
+    BudgetCounters &counters;
+
+    FrameBudget(double limit, BudgetCounters &counters)
+        : start(ros::WallTime::now()), limit(limit), counters(counters) {}
+
+    double elapsed() const {
+        return (ros::WallTime::now() - start).toSec();
+    }
+
+    bool exhausted() const {
+        return limit > 0 && elapsed() > limit;
+    }
+};
+
+#endif
@@ -32,7 +32,8 @@
 #ifndef ESTIMATE_H
 #define ESTIMATE_H
 
-#include <ros/ros.h>
+#include <ros/console.h>
+#include <ros/time.h>
 #include <tf2/LinearMath/Transform.h>
 #include <tf2/LinearMath/Quaternion.h>
 
@@ -50,46 +51,123 @@
 #include <sensor_msgs/CameraInfo.h>
 
 #include "fiducial_slam/map.h"
+#include "fiducial_slam/budget.h"
 
 using namespace std;
 
-class Estimator {
+// Intrinsics of a camera, and the poses of fiducials last seen by it
+// which are used as initial guesses
+class CameraModel {
+  public:
     cv::Mat cameraMatrix;
     cv::Mat distortionCoeffs;
+    string frameId;
 
-    Map &map;
+    std::map<int, cv::Vec3d> rvecHistory;
+    std::map<int, cv::Vec3d> tvecHistory;
+
+    CameraModel() {}
+
+    CameraModel(const sensor_msgs::CameraInfo &msg);
+};
+
+// Object points of a fiducial of the given size, centered on the fiducial
+void getSingleMarkerObjectPoints(float markerLength, vector<Point3f>& objPoints);
+
+// Area in the image of a fiducial with the given 4 corners
+double calcFiducialArea(const cv::Point2f *pts);
+
+// How useful estimating the pose of a fiducial in an image is likely to be
+struct FiducialPriority {
+    int index;
+    bool mapped;
+    bool tracked;
+    double area;
+};
+
+// Statistics of the refinement of multi-fiducial poses
+struct RefineStats {
+    uint64_t solves;
+    uint64_t iterations;
+    uint64_t converged;
+    uint64_t fallbacks;
+    double totalTime;
+    double maxTime;
+
+    RefineStats() : solves(0), iterations(0), converged(0), fallbacks(0),
+                    totalTime(0.0), maxTime(0.0) {}
+};
+
+class Estimator {
+    // Cameras keyed by frame id
+    std::map<string, CameraModel> cameras;
 
-    bool haveCaminfo;
+    Map &map;
 
     double fiducialLen;
     double errorThreshold;
+    int maxRefineIterations;
 
     int frameNum;
-    string frameId;
 
-    std::map<int, cv::Vec3d> rvecHistory;
-    std::map<int, cv::Vec3d> tvecHistory;
+    // corners of the fiducials in the current image, in pixels and
+    // undistorted to normalized image coordinates
+    vector<Point2f> frameCorners;
+    vector<Point2f> frameNormCorners;
 
-    void estimatePose(int fid, const vector<Point3f> &worldPoints,
+    // fiducials in the current image, in the order they are estimated
+    vector<FiducialPriority> order;
+
+    void estimatePose(CameraModel &camera, int fid,
+                      const vector<Point3f> &worldPoints,
                       const vector<Point2f> &imagePoints,
+                      const vector<Point2f> &normPoints,
                       Observation &obs, fiducial_msgs::FiducialTransform &ft,
-                      const ros::Time& stamp, const string& frame);
+                      const ros::Time& stamp);
+
+    void estimateMultiPose(CameraModel &camera,
+                           const vector<Point3f> &worldPoints,
+                           const vector<Point2f> &imagePoints,
+                           const vector<Point2f> &normPoints,
+                           Observation &obs, fiducial_msgs::FiducialTransform &ft,
+                           const ros::Time& stamp);
 
-    double getReprojectionError(const vector<Point3f> &objectPoints,
-                                const vector<Point2f> &imagePoints,
-                                const Vec3d &rvec, const Vec3d &tvec);
+    void makeObservation(CameraModel &camera, int fid,
+                         const vector<Point2f> &imagePoints,
+                         const Vec3d &rvec, const Vec3d &tvec,
+                         double reprojectionError,
+                         Observation &obs, fiducial_msgs::FiducialTransform &ft,
+                         const ros::Time& stamp);
+
+    CameraModel *findCamera(const string &frameId);
 
   public:
+    RefineStats refineStats;
+
+    static double getReprojectionError(const CameraModel &camera,
+                                       const vector<Point3f> &objectPoints,
+                                       const vector<Point2f> &normPoints,
+                                       const Vec3d &rvec, const Vec3d &tvec);
+
     Estimator(Map &fiducialMap);
 
     void camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr& msg);
 
     void estimatePoses(const fiducial_msgs::FiducialArray::ConstPtr& msg,
                        vector<Observation> &observations,
-                       fiducial_msgs::FiducialTransformArray &outMsg);
+                       fiducial_msgs::FiducialTransformArray &outMsg,
+                       FrameBudget &budget);
 
     void setFiducialLen(double fiducialLen) { this->fiducialLen = fiducialLen; };
     void setErrorThreshold(double errorThreshold) { this->errorThreshold = errorThreshold; };
+    void setMaxRefineIterations(int iterations) { this->maxRefineIterations = iterations; };
+
+    // Number of cameras whose intrinsics have been received
+    int numCameraModels() const { return cameras.size(); }
+
+    // Approximate memory used by the poses of fiducials last seen by each
+    // camera and the buffers reused every frame
+    size_t memoryUsage() const;
 };
 
 #endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef HINTS_H
+#define HINTS_H
+
+#include <ros/ros.h>
+#include <sensor_msgs/CameraInfo.h>
+
+#include <fiducial_msgs/DetectionHints.h>
+
+#include <opencv2/core.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "fiducial_slam/map.h"
+
+// Tells aruco_detect which fiducials in the map it should expect to see
+// in the next image from each camera, and where. The map fiducials are
+// projected into the image using the camera pose predicted by the map
+// and the intrinsics from camera_info
+class HintPublisher {
+    struct HintCamera {
+        cv::Mat cameraMatrix;
+        cv::Mat distortionCoeffs;
+        int width;
+        int height;
+    };
+
+    Map &map;
+
+    std::vector<ros::Subscriber> subscribers;
+    ros::Publisher publisher;
+
+    // Cameras keyed by frame id
+    std::map<std::string, HintCamera> cameras;
+
+    double fiducialLen;
+    double margin;
+    int minSize;
+    double maxRange;
+
+    // Reused every frame
+    std::vector<cv::Point3f> objectPoints;
+    std::vector<cv::Point2f> imagePoints;
+    fiducial_msgs::DetectionHints msg;
+
+    void camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg);
+    bool visible(const HintCamera &camera, const tf2::Transform &T_camFid) const;
+
+  public:
+    // Hints for all the cameras are published on /fiducial_hints, with
+    // the frame id of the camera. camera_info is read from each of the
+    // namespaces of the cameras
+    HintPublisher(ros::NodeHandle &nh, Map &map,
+                  const std::vector<std::string> &namespaces);
+
+    // Publish hints for each camera, from the pose of the map at the time
+    // of the last update
+    void publish(const ros::Time &stamp);
+};
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <ros/ros.h>
+
+#include <fiducial_msgs/LatencyTrace.h>
+#include <fiducial_msgs/LatencyStats.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Rolling window of the latencies of one stage of the pipeline
+class LatencyWindow {
+    std::vector<double> samples;
+    size_t next;
+    size_t count;
+
+  public:
+    LatencyWindow(size_t size = 500);
+
+    void add(double latency);
+
+    size_t memoryUsage() const { return samples.capacity() * sizeof(double); }
+
+    void summarize(const std::vector<double> &binEdges,
+                   fiducial_msgs::LatencyHistogram &hist,
+                   std::vector<double> &sorted) const;
+};
+
+// Measures the latency from image capture to the map transform being
+// sent, for each stage of the pipeline. The times of the stages in
+// aruco_detect come from its LatencyTrace messages, which are matched
+// with the images fiducial_slam has processed by frame id and image_seq
+class LatencyTracer {
+  public:
+    enum Stage {
+        CAPTURE,            // capture to receipt by the detector
+        DETECT,             // detection
+        DETECTOR_PUBLISH,   // pose estimation and publishing
+        TRANSPORT,          // detector to fiducial_slam
+        QUEUE,              // waiting for fiducial_slam to spin
+        SLAM,               // pose estimation and fusion
+        TF,                 // pose computed to map transform sent
+        TF_AGE,             // capture to map transform sent
+        NUM_STAGES
+    };
+
+  private:
+    typedef std::pair<std::string, int> ImageKey;
+
+    // An image processed by fiducial_slam
+    struct ImageTimes {
+        ros::Time captured;
+        ros::Time received;
+        ros::Time callback;
+    };
+
+    ros::Subscriber traceSub;
+    ros::Publisher statsPub;
+
+    // Images of the current map update
+    std::vector<std::pair<ImageKey, ImageTimes>> pending;
+
+    // Images that have been processed, and traces of images that have not,
+    // waiting for the other half
+    std::map<ImageKey, ros::Time> processed;
+    std::map<ImageKey, fiducial_msgs::LatencyTrace> traces;
+
+    std::vector<double> binEdges;
+    std::vector<LatencyWindow> windows;
+    std::vector<double> sorted;
+
+    double publishInterval;
+    ros::Time lastPublished;
+
+    void traceCallback(const fiducial_msgs::LatencyTrace::ConstPtr &msg);
+    void addDetectorStages(const fiducial_msgs::LatencyTrace &trace,
+                           const ros::Time &received);
+    void add(Stage stage, const ros::Time &from, const ros::Time &to);
+
+  public:
+    LatencyTracer(ros::NodeHandle &nh);
+
+    // An image has been received, at the given time by the transport and
+    // then by its callback
+    void received(const std_msgs::Header &header, int imageSeq,
+                  const ros::Time &receiptTime);
+
+    // The map has been updated with the images received since the last
+    // update, which started at updateStart. Pose and transform times before
+    // that mean they were not published by this update
+    void updated(const ros::Time &updateStart, const ros::Time &poseTime,
+                 const ros::Time &transformTime);
+
+    // Publish the statistics, if it is time to
+    void publish();
+
+    // Approximate memory used by the images and traces waiting to be
+    // matched, and the windows
+    size_t memoryUsage() const;
+};
+
+#endif
@@ -31,11 +31,11 @@
 #ifndef MAP_H
 #define MAP_H
 
-#include <ros/ros.h>
+#include <ros/console.h>
+#include <ros/time.h>
 #include <tf2/LinearMath/Transform.h>
 #include <tf2/LinearMath/Quaternion.h>
-#include <tf2_ros/transform_broadcaster.h>
-#include <tf2_ros/transform_listener.h>
+#include <tf2/buffer_core.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 #include <visualization_msgs/Marker.h>
 
@@ -46,16 +46,20 @@
 #include <fiducial_msgs/FiducialMapEntry.h>
 #include <fiducial_msgs/FiducialMapEntryArray.h>
 
+#include "fiducial_slam/budget.h"
+
+#include <functional>
+#include <future>
 #include <list>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
 #include <tf2/convert.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
-#include <std_srvs/Empty.h>
-
-
 using namespace std;
 using namespace cv;
 
@@ -113,6 +117,12 @@ class TransformWithVariance {
 // Weighted average of 2 transforms, variances computed using Alexey Method
 TransformWithVariance averageTransforms(const TransformWithVariance& t1, const TransformWithVariance& t2);
 
+// Variance of the combination of two gaussians, taking into account
+// the degree of overlap
+double updateVarianceDavid(const tf2::Vector3 &newMean,
+                           const tf2::Vector3 &mean1, double var1,
+                           const tf2::Vector3 &mean2, double var2);
+
 inline geometry_msgs::PoseWithCovarianceStamped toPose(const tf2::Stamped<TransformWithVariance>& in)
 {
     geometry_msgs::PoseWithCovarianceStamped msg;
@@ -163,38 +173,164 @@ class Observation {
                 double ierr, double oerr);
 };
 
+// An edge of the co-visibility graph: another fiducial that has been
+// seen in the same image as this one. The relative pose is the pose of
+// the other fiducial in the frame of this one, averaged over all the
+// images in which both were seen
+class Link {
+  public:
+    int id;
+    int count;
+    ros::Time lastSeen;
+
+    tf2::Vector3 meanOffset;
+    double offsetM2;
+    tf2::Quaternion meanRotation;
+
+    Link() {}
+
+    Link(int id);
+
+    void update(const tf2::Transform &T_fidOther, const ros::Time &time);
+
+    // Variance of the relative position
+    double offsetVariance() const {
+        return count > 1 ? offsetM2 / count : 0.0;
+    }
+};
+
 // A single fiducial that is in the map
 class Fiducial {
   public:
     int id;
     int numObs;
     bool visible;
-    map<int,int> links;
+
+    // Links to other fiducials, sorted by id
+    vector<Link> links;
 
     tf2::Stamped<TransformWithVariance> pose;
     ros::Time lastPublished;
 
+    // Zero if loaded from a map file and not seen since
+    ros::Time lastSeen;
+
     void update(const tf2::Stamped<TransformWithVariance>& newPose);
 
+    // Update links from the observations of a frame, sorted by fid
+    void updateLinks(const Observation &self,
+                     const vector<const Observation*> &frameObs,
+                     const ros::Time &time, vector<Link> &scratch);
+
+    const Link *findLink(int id) const;
+    void addLink(int id);
+    void removeLink(int id);
+
     Fiducial() {}
 
     Fiducial(int id, const tf2::Stamped<TransformWithVariance>& pose);
 };
 
+// Summary of a fiducial used to decide whether it should be
+// removed when the map is compacted
+struct CompactionCandidate {
+    int id;
+    int numObs;
+    double variance;
+    double lastSeen;
+    size_t bytes;
+};
+
+// Criteria for removing fiducials from the map
+struct CompactionParams {
+    int minObs;
+    double maxVariance;
+    double gracePeriod;
+    double maxAge;
+    size_t memoryBudget;
+};
+
+// Choose the candidates to remove: those not seen for maxAge seconds, and
+// those with too few observations or too large a variance once the grace
+// period has passed. Then the fewest observed and least recently seen are
+// removed until the remaining fiducials and protectedBytes are within the
+// memory budget. A lastSeen of zero exempts a candidate from the age rules
+vector<int> selectForCompaction(const vector<CompactionCandidate> candidates,
+                                size_t protectedBytes,
+                                const CompactionParams params,
+                                double now);
+
+class PoseSmoother;
+
+// Destination of everything a map publishes. The map itself does not
+// depend on ROS communication, MapNode implements this with topics and TF
+class MapOutput {
+  public:
+    virtual ~MapOutput() {}
+
+    virtual void publishPose(const geometry_msgs::PoseWithCovarianceStamped &pose) = 0;
+    virtual void publishTransforms(const vector<geometry_msgs::TransformStamped> &transforms) = 0;
+    virtual void publishMap(const fiducial_msgs::FiducialMapEntryArray &fmea) = 0;
+    virtual void publishMarker(const visualization_msgs::Marker &marker) = 0;
+};
+
 // Class containing map data
 class Map {
   public:
-    tf2_ros::TransformBroadcaster broadcaster;
-    tf2_ros::Buffer tfBuffer;
-    unique_ptr<tf2_ros::TransformListener> listener;
-
-    ros::Publisher markerPub;
-    ros::Publisher mapPub;
-    ros::Publisher posePub;
+    // Transforms from other sources, such as odometry and the poses of
+    // the cameras on the robot
+    tf2::BufferCore tfBuffer;
+
+    // Where the outputs go, nothing is published if this is null
+    MapOutput *output;
+
+    // The current time, used to stamp fiducials read from a map and to
+    // throttle markers. The map does not read the ROS clock itself, by
+    // default this is the time of the latest update
+    std::function<ros::Time()> clock;
+    ros::Time latestTime;
+
+    // Clear the map and enable auto initialization
+    void clear();
+
+    // Replace the whole map. The new map is built in the background
+    // and swapped in at the start of the next update
+    bool initialize(const vector<fiducial_msgs::FiducialMapEntry> &entries);
+    std::future<map<int, Fiducial>> pendingMap;
+    void installPendingMap();
+
+    // Load the map file in the background. Until it is installed the map
+    // is not updated, and the pose is estimated from the single best
+    // fiducial whose pose has been read, from loadedPoses
+    bool isLoadingMap;
+    ros::WallTime loadStarted;
+    std::shared_ptr<const vector<pair<int, TransformWithVariance>>> loadedPoses;
+    bool loadMapAsync(const std::string &filename);
+    void finishLoading();
+    int  updatePoseFromLoadedPoses(vector<Observation> &obs,
+                                   tf2::Stamped<TransformWithVariance>& cameraPose);
+
+    // Time from the map being created to the first pose being published,
+    // negative until then
+    ros::WallTime startTime;
+    double timeToFirstPose;
+
+    // Background compaction, to bound the size of the map when mapping
+    // for long periods. Fiducials are selected for removal in a
+    // background thread and archived to a file
+    double compactInterval;
+    CompactionParams compactionParams;
+    string archiveFilename;
+    ros::Time lastCompaction;
+    std::future<vector<int>> pendingCompaction;
+    std::future<void> compactionCleanup;
+    void startCompaction(const ros::Time &time);
+    void finishCompaction();
+    size_t memoryUsage() const;
+
+    // Optional fixed-lag smoothing of the robot pose
+    unique_ptr<PoseSmoother> smoother;
 
-    ros::ServiceServer clearSrv;
-    bool clearCallback(std_srvs::Empty::Request &req,
-                       std_srvs::Empty::Response &res);
     string mapFilename;
     string mapFrame;
     string odomFrame;
@@ -211,14 +347,38 @@ class Map {
 
     map<int, Fiducial> fiducials;
 
-    Map(ros::NodeHandle &nh);
-    void update(vector<Observation> &obs, const ros::Time &time);
+    // fiducials that were visible in the last frame
+    vector<int> visibleFids;
+
+    // Map update put off when a frame runs out of time, it is done when
+    // the node is next idle
+    bool haveDeferredUpdate;
+    vector<Observation> deferredObs;
+    tf2::Stamped<TransformWithVariance> deferredPose;
+    ros::Time deferredTime;
+    void processDeferredUpdate();
+
+    // buffers reused by updateMap to avoid allocating every frame
+    vector<const Observation*> frameObs;
+    vector<Link> linkScratch;
+
+    Map();
+    ~Map();
+    void update(vector<Observation> &obs, const ros::Time &time,
+                FrameBudget &budget);
     void autoInit(const vector<Observation> &obs, const ros::Time &time);
     int  updatePose(vector<Observation> &obs, const ros::Time &time,
                     tf2::Stamped<TransformWithVariance>& cameraPose);
+    void publishRobotPose(const tf2::Stamped<TransformWithVariance>& cameraPose);
     void updateMap(const vector<Observation> &obs, const ros::Time &time,
                    const tf2::Stamped<TransformWithVariance>& cameraPose);
 
+    // Co-visibility queries. Neighbours are ordered by the number of
+    // images in which they were seen with the fiducial
+    void getNeighbours(int fid, int minCount, vector<int> &neighbours) const;
+    void getNeighbourhood(const vector<int> &fids, int depth, int minCount,
+                          vector<int> &neighbourhood) const;
+
     bool loadMap();
     bool loadMap(std::string filename);
     bool saveMap();
@@ -227,10 +387,25 @@ class Map {
     void publishMap();
     void publishMarker(Fiducial &fid);
     void publishMarkers();
+    void deleteMarker(int fid);
     void drawLine(const tf2::Vector3 &p0, const tf2::Vector3 &p1);
 
     bool lookupTransform(const std::string &from, const std::string &to,
                          const ros::Time &time, tf2::Transform &T) const;
+
+    // Last estimate of the robot pose, with the odometry at that time if
+    // available, used to predict the camera pose in the next frame
+    bool havePose;
+    ros::Time lastPoseTime;
+    tf2::Transform lastPose;
+    bool lastPoseHaveOdom;
+    tf2::Transform lastPoseOdom;
+    bool predictCameraPose(const string &frame, const ros::Time &time,
+                           tf2::Transform &T_mapCam) const;
+
+    // Transforms from the base frame to each camera frame
+    map<string, tf2::Transform> cameraExtrinsics;
+    void toBaseFrame(vector<Observation> &obs, const ros::Time &time);
 };
 
 #endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef MAP_FILE_H
+#define MAP_FILE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Reading and writing of fiducial map files. This is shared by the
+// fiducial_slam node and the fiducial_map_tool utility, and has no ROS
+// dependencies so that large maps can be processed offline.
+
+// A single fiducial as stored in a map file
+struct MapEntry {
+    int id;
+
+    // position in the map frame in meters
+    double tx, ty, tz;
+
+    // orientation as roll, pitch and yaw in degrees
+    double rx, ry, rz;
+
+    double variance;
+    int numObs;
+
+    // ids of fiducials that have been observed together with this one
+    std::vector<int> links;
+};
+
+// Supported on-disk formats, chosen from the filename extension:
+//   .csv          comma separated, with a header line
+//   .fmap         compact binary
+//   anything else the original space separated text format
+enum MapFormat {
+    MAP_FORMAT_TEXT,
+    MAP_FORMAT_CSV,
+    MAP_FORMAT_BINARY
+};
+
+MapFormat mapFormatFromFilename(const std::string &filename);
+
+// Called while a map file is parsed with the entries read so far
+typedef std::function<void(const std::vector<MapEntry> &entries)> MapLoadProgress;
+
+// Load a map file. Lines that cannot be parsed are skipped, and if
+// invalidLines is given they are appended to it. If progress is given it
+// is called after the first few thousand entries are read, and then each
+// time the number read doubles. Returns false if the file could not be
+// opened or is corrupt.
+bool loadMapFile(const std::string &filename, std::vector<MapEntry> &entries,
+                 std::vector<std::string> *invalidLines = nullptr,
+                 const MapLoadProgress &progress = nullptr);
+
+// Save a map file, returns false if the file could not be written
+bool saveMapFile(const std::string &filename,
+                 const std::vector<MapEntry> &entries);
+
+// Add entries to the end of a map file, creating it if needed. Returns
+// false if the file could not be written, or is a binary map that could
+// not be read
+bool appendMapFile(const std::string &filename,
+                   const std::vector<MapEntry> &entries);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef MAP_NODE_H
+#define MAP_NODE_H
+
+#include <ros/ros.h>
+#include <tf2_ros/transform_broadcaster.h>
+#include <tf2_ros/transform_listener.h>
+
+#include <fiducial_msgs/InitializeMap.h>
+#include <std_srvs/Empty.h>
+
+#include "fiducial_slam/map.h"
+
+// ROS interface of a map. Reads its parameters, publishes its outputs on
+// topics and TF, feeds it transforms and provides its services
+class MapNode : public MapOutput {
+    Map &map;
+
+    tf2_ros::TransformBroadcaster broadcaster;
+    unique_ptr<tf2_ros::TransformListener> listener;
+
+    ros::Publisher markerPub;
+    ros::Publisher mapPub;
+    ros::Publisher posePub;
+
+    ros::ServiceServer clearSrv;
+    bool clearCallback(std_srvs::Empty::Request &req,
+                       std_srvs::Empty::Response &res);
+
+    // Service to replace the whole map at run time
+    ros::ServiceServer initializeSrv;
+    bool initializeMapCallback(fiducial_msgs::InitializeMap::Request &req,
+                               fiducial_msgs::InitializeMap::Response &res);
+
+  public:
+    // Times at which the last pose and map transform were published
+    ros::Time poseTime;
+    ros::Time transformTime;
+
+    MapNode(ros::NodeHandle &nh, Map &map);
+    ~MapNode();
+
+    void publishPose(const geometry_msgs::PoseWithCovarianceStamped &pose) override;
+    void publishTransforms(const vector<geometry_msgs::TransformStamped> &transforms) override;
+    void publishMap(const fiducial_msgs::FiducialMapEntryArray &fmea) override;
+    void publishMarker(const visualization_msgs::Marker &marker) override;
+};
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <tf2/buffer_core.h>
+
+#include <fiducial_msgs/MemoryStats.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Approximate overhead of a node of a std::map or std::list, in addition
+// to the value it holds
+static const size_t treeNodeOverhead = 32;
+static const size_t listNodeOverhead = 16;
+
+template <class K, class V>
+size_t mapBytes(const std::map<K, V> &m)
+{
+    return m.size() * (sizeof(typename std::map<K, V>::value_type) + treeNodeOverhead);
+}
+
+template <class T>
+size_t vectorBytes(const std::vector<T> &v)
+{
+    return v.capacity() * sizeof(T);
+}
+
+// Estimated memory used by the transforms stored in a TF buffer, from
+// the rate and length of the buffer of each frame
+size_t tfBufferBytes(const tf2::BufferCore &buffer);
+
+// Live and peak memory used by each part of a node. Sizes are sampled
+// when they are set, so a peak between samples is missed
+class MemoryAccounts {
+    std::vector<fiducial_msgs::MemoryUsage> accounts;
+    uint64_t peakTotal;
+
+  public:
+    MemoryAccounts() : peakTotal(0) {}
+
+    void set(const std::string &name, size_t bytes);
+
+    void fill(fiducial_msgs::MemoryStats &msg) const;
+
+    // Human readable table of the accounts
+    std::string report() const;
+};
+
+#endif
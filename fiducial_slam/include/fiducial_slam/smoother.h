@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef SMOOTHER_H
+#define SMOOTHER_H
+
+#include <ros/time.h>
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/LinearMath/Quaternion.h>
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+#include "fiducial_slam/map.h"
+
+using namespace std;
+
+// Fixed-lag smoother for the pose of the robot in the map.
+//
+// It keeps the poses estimated from fiducials in the last N frames, and
+// the odometry pose at each of them if available. Consecutive poses are
+// constrained by the odometry motion between them, or by a random walk
+// without odometry. Every frame the poses in the window are re-solved
+// and the estimate of the newest pose is returned. The fiducial
+// observations of each frame are not kept, they are summarised by the
+// pose the estimator fused from them and its variance.
+//
+// Poses are parameterised as a translation and a rotation vector relative
+// to the newest measurement. As the variances of TransformWithVariance are
+// scalar, the normal equations are the same tridiagonal system for each of
+// the 6 components, which is solved in O(N) with no allocation.
+
+class PoseSmoother {
+    struct Frame {
+        ros::Time stamp;
+        tf2::Transform measured;
+        double variance;
+        bool haveOdom;
+        tf2::Transform odom;
+        tf2::Transform estimate;
+    };
+
+    int window;
+    double motionVariance;
+    double odomVariance;
+    double maxGap;
+
+    // ring buffer of the frames in the window
+    vector<Frame> frames;
+    int first;
+    int count;
+
+    // work space for the solve, sized for the window
+    vector<cv::Vec6d> z;
+    vector<cv::Vec6d> d;
+    vector<cv::Vec6d> rhs;
+    vector<double> w;
+    vector<double> u;
+    vector<double> diag;
+
+    Frame &frame(int i) { return frames[(first + i) % window]; }
+
+    static cv::Vec6d toVector(const tf2::Quaternion &qRefInv, const tf2::Transform &T);
+    static tf2::Transform fromVector(const tf2::Quaternion &qRef, const cv::Vec6d &v);
+
+  public:
+    PoseSmoother(int window, double motionVariance, double odomVariance, double maxGap);
+
+    void reset();
+
+    // Memory used by the window and the work space
+    size_t memoryUsage() const;
+
+    // Add the pose measured in a frame and return the smoothed pose.
+    // odom is the pose of the robot in the odometry frame at the same
+    // time, or null if it is not available
+    void update(const tf2::Stamped<TransformWithVariance> &measured,
+                const tf2::Transform *odom,
+                tf2::Stamped<TransformWithVariance> &smoothed);
+};
+
+#endif
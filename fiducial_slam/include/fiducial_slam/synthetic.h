@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <ros/time.h>
+#include <tf2/LinearMath/Transform.h>
+
+#include <fiducial_msgs/FiducialArray.h>
+#include <fiducial_msgs/FiducialTransformArray.h>
+#include <sensor_msgs/CameraInfo.h>
+
+#include <opencv2/aruco.hpp>
+
+#include "fiducial_slam/map_file.h"
+
+#include <random>
+#include <vector>
+
+// Synthetic sites for testing at scale. A site is a grid of square rooms,
+// each with fiducials on a grid on the ceiling and along the walls. A robot
+// with an upward facing camera drives through the rooms, and only the
+// fiducials in the room it is in can be seen
+
+struct SiteParams {
+    int numFiducials;
+    double roomSize;
+    double spacing;
+    double ceilingHeight;
+    double wallHeight;
+    double fiducialLen;
+
+    // Camera, which is at the origin of the robot pointing up
+    double cameraHeight;
+    double fov;
+    double maxRange;
+    int imageWidth;
+    int imageHeight;
+
+    // Robot motion
+    int framesPerRoom;
+    double frameInterval;
+
+    // Noise, position noise is proportional to distance
+    double positionNoise;
+    double angleNoise;
+    double pixelNoise;
+
+    // Standard deviation of the noise in rendered images, in grey levels
+    double imageNoise;
+
+    unsigned int seed;
+
+    SiteParams() : numFiducials(1000), roomSize(8.0), spacing(2.0),
+                   ceilingHeight(3.0), wallHeight(2.0), fiducialLen(0.14),
+                   cameraHeight(0.3), fov(120.0), maxRange(6.0),
+                   imageWidth(1280), imageHeight(960),
+                   framesPerRoom(20), frameInterval(0.1),
+                   positionNoise(0.01), angleNoise(0.01), pixelNoise(0.5),
+                   imageNoise(2.0), seed(1) {}
+};
+
+class SyntheticSite {
+    SiteParams params;
+
+    int perRoom;
+    int roomsPerSide;
+    int numRooms;
+
+    // Poses of the fiducials in the map frame, fiducial ids start at 1
+    // and fiducial id is at index id - 1. Each room's fiducials are
+    // contiguous
+    std::vector<tf2::Transform> poses;
+
+    std::mt19937 rng;
+
+    tf2::Vector3 roomCenter(int room) const;
+    int roomAt(const tf2::Vector3 &position) const;
+
+    // Indexes of the fiducials in view, and the positions in the image
+    // of their corners, 4 for each fiducial in the order used by aruco,
+    // scaled about the center of the fiducial by scale
+    void visible(int frame, double scale, std::vector<int> &indexes,
+                 std::vector<cv::Point2f> &corners) const;
+
+  public:
+    SyntheticSite(const SiteParams &params);
+
+    const SiteParams &getParams() const { return params; }
+    int numFiducials() const { return poses.size(); }
+    const tf2::Transform &fiducialPose(int id) const { return poses[id - 1]; }
+
+    // Frames visit every room once, in a serpentine through the site
+    int numFrames() const;
+    ros::Time frameTime(int frame) const;
+
+    // True pose of the camera, which is also the robot, in the map frame
+    tf2::Transform cameraPose(int frame) const;
+
+    // Intrinsics of the camera, without distortion
+    void cameraInfo(sensor_msgs::CameraInfo &info) const;
+
+    // Noisy observations of the visible fiducials, as fiducial_slam and
+    // aruco_detect would produce them. The frame ids are frameId
+    void observe(int frame, const std::string &frameId,
+                 fiducial_msgs::FiducialTransformArray &transforms,
+                 fiducial_msgs::FiducialArray &vertices);
+
+    // Grey image of the visible fiducials, printed from the dictionary
+    // with a white margin on a grey ceiling. Fiducials whose ids are not
+    // in the dictionary are not drawn
+    void render(int frame, const cv::Ptr<cv::aruco::Dictionary> &dictionary,
+                cv::Mat &image) const;
+
+    // The true map, with the given variance for every fiducial. A variance
+    // of 0 makes the fiducials fixed when loaded. With a room count, only
+    // the fiducials in the first rooms are included
+    void groundTruthMap(std::vector<MapEntry> &entries, double variance,
+                        int rooms = -1) const;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#!/usr/bin/python
+
+"""
+Accuracy and speed regression test of the detector and fiducial_slam.
+
+Runs fiducial_slam_replay over the datasets in a configuration file, the
+test bags and synthetic sites generated by fiducial_slam_synthetic, and
+compares the errors of the map and robot poses against the ground truth,
+the time per frame and the CPU time with a stored baseline. Exits with 1
+if any metric is worse than the baseline by more than its tolerance.
+
+Timings depend on the machine, so the baseline should be recorded with
+--update-baseline on the machine that runs the comparison.
+"""
+
+from __future__ import print_function
+
+import argparse
+import fnmatch
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import rospkg
+import yaml
+
+
+def run(cmd):
+    print(" ".join(cmd))
+    with open(os.devnull, "w") as devnull:
+        return subprocess.call(cmd, stdout=devnull) == 0
+
+
+def readStats(filename):
+    stats = {}
+    with open(filename) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 2:
+                stats[fields[0]] = float(fields[1])
+    return stats
+
+
+def runDataset(name, dataset, configDir, workDir):
+    """ Run a dataset and return its statistics, or None if it failed """
+    prefix = os.path.join(workDir, name)
+    path = lambda f: os.path.join(configDir, f)
+
+    if "synthetic" in dataset:
+        cmd = ["rosrun", "fiducial_slam", "fiducial_slam_synthetic"]
+        cmd += [str(o) for o in dataset["synthetic"]] + [prefix]
+        if not run(cmd):
+            return None
+        bag = prefix + ".bag"
+        initialMap = prefix + "_initial.txt"
+        truthMap = prefix + "_truth.txt"
+    else:
+        bag = path(dataset["bag"])
+        initialMap = path(dataset["initial_map"]) if "initial_map" in dataset else None
+        truthMap = path(dataset["truth_map"]) if "truth_map" in dataset else None
+
+    cmd = ["rosrun", "fiducial_slam", "fiducial_slam_replay",
+           "--map", prefix + "_map.txt", "--stats", prefix + "_stats.txt"]
+    if initialMap:
+        cmd += ["--initial-map", initialMap]
+    if truthMap:
+        cmd += ["--truth-map", truthMap]
+    cmd += [str(o) for o in dataset.get("options", [])] + [bag]
+    if not run(cmd):
+        return None
+
+    return readStats(prefix + "_stats.txt")
+
+
+def tolerance(metric, tolerances):
+    for t in tolerances:
+        if fnmatch.fnmatch(metric, t["metric"]):
+            return t
+    return None
+
+
+def compare(name, stats, baseline, tolerances):
+    """ Print the metrics of a dataset next to the baseline, and return
+        the number that are worse than it by more than their tolerance """
+    regressions = 0
+
+    print("\n%s" % name)
+    print("  %-24s %12s %12s %9s" % ("metric", "baseline", "value", "change"))
+    for metric in sorted(stats):
+        value = stats[metric]
+        base = baseline.get(metric)
+        t = tolerance(metric, tolerances)
+
+        if base is None:
+            print("  %-24s %12s %12.3f" % (metric, "-", value))
+            continue
+
+        change = value - base
+        status = ""
+        if t is not None:
+            worse = -change if t.get("higher_is_better", False) else change
+            allowed = max(t.get("abs", 0.0), t.get("rel", 0.0) * abs(base))
+            if worse > allowed:
+                status = "REGRESSION"
+                regressions += 1
+            elif worse < -allowed:
+                status = "improved"
+
+        print("  %-24s %12.3f %12.3f %+9.3f %s" % (metric, base, value, change, status))
+
+    return regressions
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("config", nargs="?",
+        default=os.path.join(rospkg.RosPack().get_path("fiducial_slam"),
+                             "test", "regression.yaml"),
+        help="datasets and tolerances (test/regression.yaml)")
+    parser.add_argument("--baseline",
+        default=os.path.expanduser("~/.ros/slam/regression_baseline.yaml"),
+        help="baseline to compare with (~/.ros/slam/regression_baseline.yaml)")
+    parser.add_argument("--update-baseline", action="store_true",
+        help="write the results as the new baseline instead of comparing")
+    parser.add_argument("--dataset", action="append",
+        help="run only this dataset, may be repeated")
+    parser.add_argument("--work-dir",
+        help="keep the generated bags, maps and statistics here")
+    args = parser.parse_args()
+
+    with open(args.config) as f:
+        config = yaml.safe_load(f)
+    configDir = os.path.dirname(os.path.abspath(args.config))
+    datasets = config["datasets"]
+    tolerances = config.get("tolerances", [])
+
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = yaml.safe_load(f) or {}
+    elif not args.update_baseline:
+        print("No baseline %s, run with --update-baseline to record one" %
+              args.baseline)
+
+    workDir = args.work_dir or tempfile.mkdtemp(prefix="slam_regression")
+    if not os.path.isdir(workDir):
+        os.makedirs(workDir)
+
+    results = {}
+    failed = []
+    regressions = 0
+    for name in sorted(datasets):
+        if args.dataset and name not in args.dataset:
+            continue
+        stats = runDataset(name, datasets[name], configDir, workDir)
+        if stats is None:
+            failed.append(name)
+            continue
+        results[name] = stats
+        regressions += compare(name, stats, baseline.get(name, {}), tolerances)
+
+    if not args.work_dir:
+        shutil.rmtree(workDir)
+
+    if args.update_baseline:
+        baseline.update(results)
+        directory = os.path.dirname(os.path.abspath(args.baseline))
+        if not os.path.isdir(directory):
+            os.makedirs(directory)
+        with open(args.baseline, "w") as f:
+            yaml.safe_dump(baseline, f, default_flow_style=False)
+        print("\nWrote baseline %s" % args.baseline)
+
+    if failed:
+        print("\nFailed to run: %s" % ", ".join(failed))
+    if regressions:
+        print("\n%d regressions" % regressions)
+    if failed or (regressions and not args.update_baseline):
+        sys.exit(1)
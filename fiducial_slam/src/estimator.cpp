@@ -33,10 +33,17 @@
 #include "fiducial_slam/map.h"
 #include "fiducial_slam/estimator.h"
 
+#include "fiducial_slam/refine.h"
+#include "fiducial_slam/memory.h"
+
+#include <fiducial_common/reprojection.h>
+
+#include <algorithm>
+
 /**
   * @brief Return object points for the system centered in a single marker, given the marker length
   */
-static void getSingleMarkerObjectPoints(float markerLength, vector<Point3f>& objPoints) {
+void getSingleMarkerObjectPoints(float markerLength, vector<Point3f>& objPoints) {
 
     CV_Assert(markerLength > 0);
 
@@ -63,12 +70,12 @@ static double dist(const cv::Point2f &p1, const cv::Point2f &p2)
 
 // Compute area in image of a fiducial, using Heron's formula
 // to find the area of two triangles
-static double calcFiducialArea(const std::vector<cv::Point2f> &pts)
+double calcFiducialArea(const cv::Point2f *pts)
 {
-    const Point2f &p0 = pts.at(0);
-    const Point2f &p1 = pts.at(1);
-    const Point2f &p2 = pts.at(2);
-    const Point2f &p3 = pts.at(3);
+    const Point2f &p0 = pts[0];
+    const Point2f &p1 = pts[1];
+    const Point2f &p2 = pts[2];
+    const Point2f &p3 = pts[3];
 
     double a1 = dist(p0, p1);
     double b1 = dist(p0, p3);
@@ -86,46 +93,61 @@ static double calcFiducialArea(const std::vector<cv::Point2f> &pts)
     return a1+a2;
 }
 
-// estimate reprojection error
-double Estimator::getReprojectionError(const vector<Point3f> &objectPoints,
-                            const vector<Point2f> &imagePoints,
+// estimate reprojection error. The image points are in normalized image
+// coordinates, and the error is converted to pixels using the focal lengths
+double Estimator::getReprojectionError(const CameraModel &camera,
+                            const vector<Point3f> &objectPoints,
+                            const vector<Point2f> &normPoints,
                             const Vec3d &rvec, const Vec3d &tvec) {
 
-    vector<Point2f> projectedPoints;
+    NormalizedProjection projection(camera.cameraMatrix);
 
-    cv::projectPoints(objectPoints, rvec, tvec, cameraMatrix,
-                      distortionCoeffs, projectedPoints);
-
-    // calculate RMS image error
-    double totalError = 0.0;
-    for (unsigned int i=0; i<objectPoints.size(); i++) {
-        double error = dist(imagePoints[i], projectedPoints[i]);
-        totalError += error*error;
+    if (objectPoints.size() == 4) {
+        return reprojectionError<4>(projection, objectPoints.data(),
+                                    normPoints.data(), rvec, tvec);
     }
-    double rerror = totalError/objectPoints.size();
-    return rerror;
+    return reprojectionError(projection, objectPoints.size(), objectPoints.data(),
+                             normPoints.data(), rvec, tvec);
 }
 
 
-void Estimator::estimatePose(int fid, const vector<Point3f> &worldPoints,
+void Estimator::estimatePose(CameraModel &camera, int fid,
+                              const vector<Point3f> &worldPoints,
                               const vector<Point2f> &imagePoints,
+                              const vector<Point2f> &normPoints,
                               Observation &obs, fiducial_msgs::FiducialTransform &ft,
-                              const ros::Time& stamp, const string& frame)
+                              const ros::Time& stamp)
 {
     Vec3d rvec, tvec;
     bool haveHistory = false;
 
-    if (rvecHistory.find(fid) != rvecHistory.end()) {
-        rvec = rvecHistory[fid];
-        tvec = tvecHistory[fid];
+    if (camera.rvecHistory.find(fid) != camera.rvecHistory.end()) {
+        rvec = camera.rvecHistory[fid];
+        tvec = camera.tvecHistory[fid];
         haveHistory = true;
     }
 
-    cv::solvePnP(worldPoints, imagePoints, cameraMatrix, distortionCoeffs, rvec, tvec, haveHistory);
+    // The points are already undistorted, so use an ideal pinhole camera
+    cv::solvePnP(worldPoints, normPoints, Matx33d::eye(), noArray(),
+                 rvec, tvec, haveHistory);
 
     double reprojectionError =
-          getReprojectionError(worldPoints, imagePoints, rvec, tvec);
+          getReprojectionError(camera, worldPoints, normPoints, rvec, tvec);
 
+    makeObservation(camera, fid, imagePoints, rvec, tvec, reprojectionError,
+                    obs, ft, stamp);
+}
+
+
+// Fill in the observation and transform message for an estimated pose
+
+void Estimator::makeObservation(CameraModel &camera, int fid,
+                                const vector<Point2f> &imagePoints,
+                                const Vec3d &rvec, const Vec3d &tvec,
+                                double reprojectionError,
+                                Observation &obs, fiducial_msgs::FiducialTransform &ft,
+                                const ros::Time& stamp)
+{
     ROS_INFO("Detected id %d T %.2f %.2f %.2f R %.2f %.2f %.2f", fid,
               tvec[0], tvec[1], tvec[2], rvec[0], rvec[1], rvec[2]);
 
@@ -145,13 +167,13 @@ void Estimator::estimatePose(int fid, const vector<Point3f> &worldPoints,
 
     obs = Observation(fid,
                       tf2::Stamped<TransformWithVariance>(TransformWithVariance(
-                      T, objectError), stamp, frame),
+                      T, objectError), stamp, camera.frameId),
                       reprojectionError,
                       objectError);
 
     if (reprojectionError < errorThreshold) {
-        rvecHistory[fid] = rvec;
-        tvecHistory[fid] = tvec;
+        camera.rvecHistory[fid] = rvec;
+        camera.tvecHistory[fid] = tvec;
     }
 
     ft.fiducial_id = fid;
@@ -165,76 +187,217 @@ void Estimator::estimatePose(int fid, const vector<Point3f> &worldPoints,
     ft.transform.rotation.y = q.y();
     ft.transform.rotation.z = q.z();
 
-    ft.fiducial_area = calcFiducialArea(imagePoints);
+    ft.fiducial_area = calcFiducialArea(imagePoints.data());
     ft.image_error = reprojectionError;
     ft.object_error = objectError;
 }
 
 
-Estimator::Estimator(Map &fiducialMap): map(fiducialMap)
+// Create a camera model from a camera info message
+CameraModel::CameraModel(const sensor_msgs::CameraInfo &msg)
 {
-    haveCaminfo = false;
-
     // Camera intrinsics
     cameraMatrix = cv::Mat::zeros(3, 3, CV_64F);
 
-    // distortion coefficients
-    distortionCoeffs = cv::Mat::zeros(1, 5, CV_64F);
+    // distortion coefficients, at least 5 of them
+    distortionCoeffs = cv::Mat::zeros(1, std::max(5, (int)msg.D.size()), CV_64F);
+
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            cameraMatrix.at<double>(i, j) = msg.K[i*3+j];
+        }
+    }
+
+    for (int i=0; i<msg.D.size(); i++) {
+        distortionCoeffs.at<double>(0,i) = msg.D[i];
+    }
+
+    frameId = msg.header.frame_id;
+}
+
+
+// Estimate the pose of the camera from all the fiducials in the map that
+// are in view. When the pose can be predicted from the last one and
+// odometry, a few iterations of refinement from the prediction are
+// enough. Otherwise, or if refinement does not give a good fit, fall back
+// to solvePnP
+
+void Estimator::estimateMultiPose(CameraModel &camera,
+                                  const vector<Point3f> &worldPoints,
+                                  const vector<Point2f> &imagePoints,
+                                  const vector<Point2f> &normPoints,
+                                  Observation &obs, fiducial_msgs::FiducialTransform &ft,
+                                  const ros::Time& stamp)
+{
+    tf2::Transform T_mapCam;
+
+    if (maxRefineIterations > 0 &&
+        map.predictCameraPose(camera.frameId, stamp, T_mapCam)) {
+        // solvePnP convention, the transform from the map to the camera
+        tf2::Transform T_camMap = T_mapCam.inverse();
+        tf2::Quaternion q = T_camMap.getRotation();
+        tf2::Vector3 axis = q.getAxis();
+        double angle = q.getAngle();
+        tf2::Vector3 t = T_camMap.getOrigin();
+
+        Vec3d rvec(axis.x() * angle, axis.y() * angle, axis.z() * angle);
+        Vec3d tvec(t.x(), t.y(), t.z());
+
+        ros::WallTime start = ros::WallTime::now();
+        RefineResult result = refinePose(worldPoints.data(), normPoints.data(),
+                                         worldPoints.size(), rvec, tvec,
+                                         maxRefineIterations);
+        double elapsed = (ros::WallTime::now() - start).toSec();
+
+        double reprojectionError =
+            getReprojectionError(camera, worldPoints, normPoints, rvec, tvec);
+
+        refineStats.solves++;
+        refineStats.iterations += result.iterations;
+        if (result.converged) {
+            refineStats.converged++;
+        }
+        refineStats.totalTime += elapsed;
+        refineStats.maxTime = std::max(refineStats.maxTime, elapsed);
+
+        ROS_DEBUG("Refined multi-fiducial pose from %d points in %d iterations %s "
+                  "%.3f ms, error %f. Mean %.1f iterations %.3f ms",
+                  (int)worldPoints.size(), result.iterations,
+                  result.converged ? "converged" : "not converged",
+                  elapsed * 1000.0, reprojectionError,
+                  (double)refineStats.iterations / refineStats.solves,
+                  refineStats.totalTime * 1000.0 / refineStats.solves);
+
+        if (reprojectionError < errorThreshold) {
+            makeObservation(camera, 0, imagePoints, rvec, tvec, reprojectionError,
+                            obs, ft, stamp);
+            return;
+        }
+        refineStats.fallbacks++;
+    }
+
+    estimatePose(camera, 0, worldPoints, imagePoints, normPoints, obs, ft, stamp);
 }
 
 
+Estimator::Estimator(Map &fiducialMap): map(fiducialMap)
+{
+    frameNum = 0;
+    maxRefineIterations = 0;
+}
+
+
+// Store the intrinsics of each camera the first time its camera info is seen
+
 void Estimator::camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr& msg)
 {
-    if (haveCaminfo) {
+    if (cameras.find(msg->header.frame_id) != cameras.end()) {
         return;
     }
 
-    for (int i=0; i<3; i++) {
-        for (int j=0; j<3; j++) {
-            cameraMatrix.at<double>(i, j) = msg->K[i*3+j];
-        }
+    ROS_INFO("Got camera info for %s", msg->header.frame_id.c_str());
+    cameras[msg->header.frame_id] = CameraModel(*msg);
+}
+
+
+size_t Estimator::memoryUsage() const
+{
+    size_t bytes = mapBytes(cameras);
+    for (const auto &it : cameras) {
+        bytes += mapBytes(it.second.rvecHistory) + mapBytes(it.second.tvecHistory);
     }
 
-    for (int i=0; i<msg->D.size(); i++) {
-        distortionCoeffs.at<double>(0,i) = msg->D[i];
+    return bytes + vectorBytes(frameCorners) + vectorBytes(frameNormCorners) +
+           vectorBytes(order);
+}
+
+
+// Find the camera that produced an image. With a single camera, it is used
+// regardless of the frame id for compatibility with older detectors
+
+CameraModel *Estimator::findCamera(const string &frameId)
+{
+    std::map<string, CameraModel>::iterator it = cameras.find(frameId);
+    if (it != cameras.end()) {
+        return &it->second;
+    }
+    if (cameras.size() == 1) {
+        return &cameras.begin()->second;
     }
+    return nullptr;
+}
 
-    haveCaminfo = true;
-    frameId = msg->header.frame_id;
+
+// Order in which fiducials are estimated when time is short. Fiducials in
+// the map are needed for localization so come first, then those with a
+// good previous estimate, then the closest, which are largest in the image
+static bool higherPriority(const FiducialPriority &a, const FiducialPriority &b)
+{
+    if (a.mapped != b.mapped) {
+        return a.mapped;
+    }
+    if (a.tracked != b.tracked) {
+        return a.tracked;
+    }
+    return a.area > b.area;
 }
 
 
 void Estimator::estimatePoses(const fiducial_msgs::FiducialArray::ConstPtr& msg,
                               vector<Observation> &observations,
-                              fiducial_msgs::FiducialTransformArray &outMsg)
+                              fiducial_msgs::FiducialTransformArray &outMsg,
+                              FrameBudget &budget)
 {
-    if (!haveCaminfo) {
-        if (frameNum > 5) {
-            ROS_ERROR("No camera intrinsics");
+    CameraModel *camera = findCamera(msg->header.frame_id);
+    if (camera == nullptr) {
+        if (frameNum++ > 5) {
+            ROS_ERROR("No camera intrinsics for %s", msg->header.frame_id.c_str());
         }
         return;
     }
 
+    outMsg.header.stamp = msg->header.stamp;
+    outMsg.header.frame_id = camera->frameId;
+
     vector<Point3f> markerObjPoints;
     getSingleMarkerObjectPoints(fiducialLen, markerObjPoints);
 
+    // Undistort all the corners in the image at once. All the poses are
+    // then estimated with a pinhole model in normalized image coordinates
+    frameCorners.clear();
+    for (int i=0; i<msg->fiducials.size(); i++) {
+        const fiducial_msgs::Fiducial& fid = msg->fiducials[i];
+        frameCorners.push_back(Point2f(fid.x0, fid.y0));
+        frameCorners.push_back(Point2f(fid.x1, fid.y1));
+        frameCorners.push_back(Point2f(fid.x2, fid.y2));
+        frameCorners.push_back(Point2f(fid.x3, fid.y3));
+    }
+
+    if (frameCorners.empty()) {
+        return;
+    }
+
+    cv::undistortPoints(frameCorners, frameNormCorners, camera->cameraMatrix,
+                        camera->distortionCoeffs);
+
     vector<Point3f> allWorldPoints;
     vector<Point2f> allImagePoints;
+    vector<Point2f> allNormPoints;
+
+    order.clear();
 
     for (int i=0; i<msg->fiducials.size(); i++) {
 
         const fiducial_msgs::Fiducial& fid = msg->fiducials[i];
 
-        vector<Point2f > corners;
-        corners.push_back(Point2f(fid.x0, fid.y0));
-        corners.push_back(Point2f(fid.x1, fid.y1));
-        corners.push_back(Point2f(fid.x2, fid.y2));
-        corners.push_back(Point2f(fid.x3, fid.y3));
-
-        Vec3d rvec, tvec;
-        double reprojectionError;
+        FiducialPriority p;
+        p.index = i;
+        p.mapped = map.fiducials.find(fid.fiducial_id) != map.fiducials.end();
+        p.tracked = camera->rvecHistory.find(fid.fiducial_id) != camera->rvecHistory.end();
+        p.area = calcFiducialArea(&frameCorners[i*4]);
+        order.push_back(p);
 
-        if (map.fiducials.find(fid.fiducial_id) != map.fiducials.end()) {
+        if (p.mapped) {
             const tf2::Transform&  fiducialTransform =
                 map.fiducials[fid.fiducial_id].pose.transform;
 
@@ -245,25 +408,47 @@ void Estimator::estimatePoses(const fiducial_msgs::FiducialArray::ConstPtr& msg,
                 // vertex in world coordinates
                 tf2::Vector3 worldPoint = fiducialTransform * vertex2;
                 allWorldPoints.push_back(Point3f(worldPoint.x(), worldPoint.y(), worldPoint.z()));
-                allImagePoints.push_back(corners[j]);
+                allImagePoints.push_back(frameCorners[i*4 + j]);
+                allNormPoints.push_back(frameNormCorners[i*4 + j]);
             }
         }
+    }
+
+    sort(order.begin(), order.end(), higherPriority);
+
+    for (const FiducialPriority &p : order) {
+        if (budget.exhausted()) {
+            budget.counters.skippedFiducials++;
+            continue;
+        }
+
+        const fiducial_msgs::Fiducial& fid = msg->fiducials[p.index];
+
+        vector<Point2f> corners(frameCorners.begin() + p.index*4,
+                                frameCorners.begin() + p.index*4 + 4);
+        vector<Point2f> normCorners(frameNormCorners.begin() + p.index*4,
+                                    frameNormCorners.begin() + p.index*4 + 4);
 
         Observation obs;
         fiducial_msgs::FiducialTransform ft;
-        estimatePose(fid.fiducial_id, markerObjPoints, corners, obs, ft,
-           msg->header.stamp, frameId);
+        estimatePose(*camera, fid.fiducial_id, markerObjPoints, corners, normCorners,
+           obs, ft, msg->header.stamp);
 
         observations.push_back(obs);
         outMsg.transforms.push_back(ft);
     }
 
     if (allWorldPoints.size() > 0) {
+        if (budget.exhausted()) {
+            budget.counters.skippedMulti++;
+            return;
+        }
+
         Observation obs;
         fiducial_msgs::FiducialTransform ft;
 
-        estimatePose(0, allWorldPoints, allImagePoints, obs, ft,
-           msg->header.stamp, frameId);
+        estimateMultiPose(*camera, allWorldPoints, allImagePoints, allNormPoints,
+           obs, ft, msg->header.stamp);
 
         observations.push_back(obs);
         outMsg.transforms.push_back(ft);
@@ -51,13 +51,21 @@
 #include "fiducial_msgs/FiducialTransformArray.h"
 
 #include "fiducial_slam/map.h"
+#include "fiducial_slam/map_node.h"
 #include "fiducial_slam/estimator.h"
+#include "fiducial_slam/hints.h"
+#include "fiducial_slam/latency.h"
+#include "fiducial_slam/memory.h"
+#include "fiducial_slam/smoother.h"
+
+#include <fiducial_common/frame_diagnostics.h>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/calib3d.hpp>
 
 
 #include <list>
+#include <set>
 #include <string>
 
 using namespace std;
@@ -65,31 +73,305 @@ using namespace cv;
 
 
 class FiducialSlam {
-  private:
-    ros::Subscriber ft_sub;
+  public:
+    // The map, and its ROS interface
+    Map fiducialMap;
+    MapNode mapNode;
 
-    ros::Subscriber verticesSub;
-    ros::Subscriber cameraInfoSub;
+  private:
+    // Subscribers for each camera
+    vector<ros::Subscriber> subscribers;
     ros::Publisher ftPub;
 
-    void transformCallback(const fiducial_msgs::FiducialTransformArray::ConstPtr &msg);
+    void transformCallback(const ros::MessageEvent<const fiducial_msgs::FiducialTransformArray> &event);
 
-    void verticesCallback(const fiducial_msgs::FiducialArray::ConstPtr &msg);
+    void verticesCallback(const ros::MessageEvent<const fiducial_msgs::FiducialArray> &event);
     void camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg);
 
     Estimator estimator;
+    bool doPoseEstimation;
+
+    // Time allowed for processing each frame, 0 for no limit
+    double frameBudget;
+    BudgetCounters budgetCounters;
+    void finishFrame(const FrameBudget &budget, int numMarkers);
+
+    // Observations from all cameras at approximately the same time are
+    // combined into a single map update
+    int numCameras;
+    double syncTolerance;
+    vector<Observation> groupObs;
+    set<string> groupFrames;
+    ros::Time groupStart;
+    ros::Time groupStamp;
+    ros::WallTime groupOpened;
+
+    void addToGroup(const string &frame, const ros::Time &stamp,
+                    const vector<Observation> &observations,
+                    FrameBudget &budget);
+    void flushGroup(FrameBudget &budget);
+
+    // Fiducials expected in the next image, sent to the detectors if
+    // publish_hints is set
+    unique_ptr<HintPublisher> hints;
+
+    // Latency through the pipeline, if trace_latency is set
+    unique_ptr<LatencyTracer> tracer;
+
+    // Memory used by each part of the node. Message queues are sampled
+    // every frame, the rest when the statistics are published
+    MemoryAccounts memory;
+    ros::Publisher memoryPub;
+    double memoryInterval;
+    ros::Time memoryPublished;
+    size_t inputBytes;
+    void updateQueueMemory();
+    void updateMemory();
+
+    // Health and throughput, published on /diagnostics
+    diagnostic_updater::Updater updater;
+    FrameDiagnostics diagnostics;
+    void mapDiagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat);
+    void refineDiagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat);
 
   public:
-    Map fiducialMap;
     FiducialSlam(ros::NodeHandle &nh);
+
+    void checkGroupTimeout();
+    void publishLatency();
+    void publishMemory();
+    void dumpMemory();
+    void updateDiagnostics();
 };
 
 
-void FiducialSlam::transformCallback(const fiducial_msgs::FiducialTransformArray::ConstPtr& msg)
+// Add the observations from one camera to the current group. The group
+// is complete when every camera has been heard from, otherwise it is
+// ended by a message too far from it in time, or by a second message
+// from the same camera
+
+void FiducialSlam::addToGroup(const string &frame, const ros::Time &stamp,
+                              const vector<Observation> &observations,
+                              FrameBudget &budget)
+{
+    if (!groupFrames.empty() &&
+        (groupFrames.count(frame) > 0 ||
+         fabs((stamp - groupStart).toSec()) > syncTolerance)) {
+        flushGroup(budget);
+    }
+
+    if (groupFrames.empty()) {
+        groupStart = stamp;
+        groupStamp = stamp;
+        groupOpened = ros::WallTime::now();
+    }
+    else if (stamp > groupStamp) {
+        groupStamp = stamp;
+    }
+
+    groupObs.insert(groupObs.end(), observations.begin(), observations.end());
+    groupFrames.insert(frame);
+
+    if ((int)groupFrames.size() >= numCameras) {
+        flushGroup(budget);
+    }
+}
+
+
+// Update the map with the current group
+
+void FiducialSlam::flushGroup(FrameBudget &budget)
+{
+    if (groupFrames.empty()) {
+        return;
+    }
+
+    ros::Time updateStart = ros::Time::now();
+    fiducialMap.update(groupObs, groupStamp, budget);
+
+    if (tracer) {
+        tracer->updated(updateStart, mapNode.poseTime, mapNode.transformTime);
+    }
+    if (mapNode.poseTime >= updateStart) {
+        diagnostics.published();
+        diagnostics.posed();
+
+        if (hints) {
+            hints->publish(ros::Time::now());
+        }
+    }
+
+    groupObs.clear();
+    groupFrames.clear();
+}
+
+
+// Don't wait any longer for cameras that have not produced an image
+
+void FiducialSlam::checkGroupTimeout()
+{
+    if (!groupFrames.empty() &&
+        (ros::WallTime::now() - groupOpened).toSec() > syncTolerance) {
+        FrameBudget budget(frameBudget, budgetCounters);
+        flushGroup(budget);
+    }
+}
+
+
+// Publish latency statistics periodically
+
+void FiducialSlam::publishLatency()
+{
+    if (tracer) {
+        tracer->publish();
+    }
+}
+
+
+// Messages waiting to be used: the largest received on each subscription,
+// which queue one each, the current group, a deferred update, and the
+// latency traces
+
+void FiducialSlam::updateQueueMemory()
+{
+    size_t bytes = subscribers.size() * inputBytes +
+                   vectorBytes(groupObs) + vectorBytes(fiducialMap.deferredObs);
+    if (tracer) {
+        bytes += tracer->memoryUsage();
+    }
+    memory.set("message_queues", bytes);
+}
+
+
+void FiducialSlam::updateMemory()
+{
+    memory.set("map", fiducialMap.memoryUsage());
+
+    size_t history = estimator.memoryUsage();
+    if (fiducialMap.smoother) {
+        history += fiducialMap.smoother->memoryUsage();
+    }
+    memory.set("pose_history", history);
+    memory.set("tf_buffer", tfBufferBytes(fiducialMap.tfBuffer));
+    updateQueueMemory();
+}
+
+
+// Publish memory statistics periodically
+
+void FiducialSlam::publishMemory()
 {
+    ros::Time now = ros::Time::now();
+    if (memoryInterval <= 0 || (now - memoryPublished).toSec() < memoryInterval) {
+        return;
+    }
+    memoryPublished = now;
+
+    updateMemory();
+
+    fiducial_msgs::MemoryStats stats;
+    stats.header.stamp = now;
+    stats.node = ros::this_node::getName();
+    memory.fill(stats);
+    memoryPub.publish(stats);
+}
+
+
+void FiducialSlam::dumpMemory()
+{
+    updateMemory();
+    ROS_INFO("Memory usage:\n%s", memory.report().c_str());
+}
+
+
+// Size and state of the map, and the work skipped to stay within the
+// frame budget
+
+void FiducialSlam::mapDiagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    if (fiducialMap.isLoadingMap) {
+        stat.summary(diagnostic_msgs::DiagnosticStatus::WARN, "Loading map");
+    }
+    else {
+        stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+    }
+
+    stat.add("Fiducials", fiducialMap.fiducials.size());
+    stat.add("Frames over budget", budgetCounters.overBudget);
+    stat.add("Skipped fiducials", budgetCounters.skippedFiducials);
+    stat.add("Deferred updates", budgetCounters.deferredUpdates);
+    stat.add("Dropped updates", budgetCounters.droppedUpdates);
+}
+
+
+// Multi-fiducial pose refinement since startup
+
+void FiducialSlam::refineDiagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    const RefineStats &stats = estimator.refineStats;
+
+    if (stats.solves == 0) {
+        stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "No refinements");
+    }
+    else {
+        stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+    }
+
+    double solves = std::max(stats.solves, (uint64_t)1);
+    stat.add("Refinements", stats.solves);
+    stat.add("Converged", stats.converged);
+    stat.add("Fallbacks to solvePnP", stats.fallbacks);
+    stat.add("Mean iterations", stats.iterations / solves);
+    stat.add("Mean time (ms)", stats.totalTime * 1000.0 / solves);
+    stat.add("Max time (ms)", stats.maxTime * 1000.0);
+}
+
+
+void FiducialSlam::updateDiagnostics()
+{
+    diagnostics.cameraInfo(estimator.numCameraModels(),
+                           doPoseEstimation ? numCameras : 0);
+    updater.update();
+}
+
+
+// Record whether a frame was processed within its budget
+
+void FiducialSlam::finishFrame(const FrameBudget &budget, int numMarkers)
+{
+    budgetCounters.frames++;
+    diagnostics.processed(budget.elapsed(), numMarkers);
+    updateQueueMemory();
+
+    if (budget.exhausted()) {
+        budgetCounters.overBudget++;
+
+        ROS_WARN_THROTTLE(10.0, "Frame took %.1f ms. %lu of %lu frames over budget, "
+                          "skipped %lu fiducials and %lu multi-fiducial estimates, "
+                          "deferred %lu and dropped %lu map updates",
+                          budget.elapsed() * 1000.0,
+                          (unsigned long)budgetCounters.overBudget,
+                          (unsigned long)budgetCounters.frames,
+                          (unsigned long)budgetCounters.skippedFiducials,
+                          (unsigned long)budgetCounters.skippedMulti,
+                          (unsigned long)budgetCounters.deferredUpdates,
+                          (unsigned long)budgetCounters.droppedUpdates);
+    }
+}
 
+
+void FiducialSlam::transformCallback(const ros::MessageEvent<const fiducial_msgs::FiducialTransformArray> &event)
+{
+    const fiducial_msgs::FiducialTransformArray::ConstPtr &msg = event.getConstMessage();
+    FrameBudget budget(frameBudget, budgetCounters);
     vector<Observation> observations;
 
+    if (tracer) {
+        tracer->received(msg->header, msg->image_seq, event.getReceiptTime());
+    }
+    inputBytes = max(inputBytes, (size_t)ros::serialization::serializationLength(*msg));
+    diagnostics.received(msg->header.frame_id, msg->image_seq);
+
     for (int i=0; i<msg->transforms.size(); i++) {
         const fiducial_msgs::FiducialTransform &ft = msg->transforms[i];
 
@@ -110,7 +392,8 @@ void FiducialSlam::transformCallback(const fiducial_msgs::FiducialTransformArray
         observations.push_back(obs);
     }
 
-    fiducialMap.update(observations, msg->header.stamp);
+    addToGroup(msg->header.frame_id, msg->header.stamp, observations, budget);
+    finishFrame(budget, msg->transforms.size());
 }
 
 
@@ -120,45 +403,93 @@ void FiducialSlam::camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg)
 }
 
 
-void FiducialSlam::verticesCallback(const fiducial_msgs::FiducialArray::ConstPtr& msg)
+void FiducialSlam::verticesCallback(const ros::MessageEvent<const fiducial_msgs::FiducialArray> &event)
 {
+    const fiducial_msgs::FiducialArray::ConstPtr &msg = event.getConstMessage();
+    FrameBudget budget(frameBudget, budgetCounters);
     vector<Observation> observations;
     fiducial_msgs::FiducialTransformArray fta;
 
-    estimator.estimatePoses(msg, observations, fta);
+    if (tracer) {
+        tracer->received(msg->header, msg->image_seq, event.getReceiptTime());
+    }
+    inputBytes = max(inputBytes, (size_t)ros::serialization::serializationLength(*msg));
+    diagnostics.received(msg->header.frame_id, msg->image_seq);
+
+    estimator.estimatePoses(msg, observations, fta, budget);
 
-    fiducialMap.update(observations, msg->header.stamp);
+    addToGroup(msg->header.frame_id, msg->header.stamp, observations, budget);
     ftPub.publish(fta);
+    finishFrame(budget, msg->fiducials.size());
 }
 
 
-FiducialSlam::FiducialSlam(ros::NodeHandle &nh) : fiducialMap(nh),
-    estimator(fiducialMap)
+FiducialSlam::FiducialSlam(ros::NodeHandle &nh) : mapNode(nh, fiducialMap),
+    estimator(fiducialMap), diagnostics(nh)
 {
-    bool doPoseEstimation;
-
     nh.param("do_pose_estimation", doPoseEstimation, false);
 
+    // Namespaces of the topics for each camera. By default there is one
+    // camera using the topics in the root namespace
+    vector<string> cameras;
+    nh.getParam("cameras", cameras);
+    if (cameras.empty()) {
+        cameras.push_back("");
+    }
+    numCameras = cameras.size();
+
+    nh.param<double>("sync_tolerance", syncTolerance, 0.05);
+    nh.param<double>("frame_budget", frameBudget, 0.0);
+
+    bool traceLatency;
+    nh.param<bool>("trace_latency", traceLatency, false);
+    if (traceLatency) {
+        tracer = make_unique<LatencyTracer>(nh);
+    }
+
+    bool publishHints;
+    nh.param<bool>("publish_hints", publishHints, false);
+    if (publishHints) {
+        hints = make_unique<HintPublisher>(nh, fiducialMap, cameras);
+    }
+
+    inputBytes = 0;
+    nh.param<double>("memory_stats_interval", memoryInterval, 1.0);
+    memoryPub = nh.advertise<fiducial_msgs::MemoryStats>("/fiducial_memory", 1);
+    memoryPublished = ros::Time::now();
+
+    updater.setHardwareID("none");
+    updater.add("SLAM", &diagnostics, &FrameDiagnostics::run);
+    updater.add("Map", this, &FiducialSlam::mapDiagnostics);
+    updater.add("Refinement", this, &FiducialSlam::refineDiagnostics);
+
     if (doPoseEstimation) {
         double fiducialLen, errorThreshold;
+        int refineIterations;
         nh.param<double>("fiducial_len", fiducialLen, 0.14);
         nh.param<double>("pose_error_theshold", errorThreshold, 1.0);
+        nh.param<int>("multi_refine_iterations", refineIterations, 5);
 
         estimator.setFiducialLen(fiducialLen);
         estimator.setErrorThreshold(errorThreshold);
+        estimator.setMaxRefineIterations(refineIterations);
 
-        verticesSub = nh.subscribe("/fiducial_vertices", 1,
-                             &FiducialSlam::verticesCallback, this); 
+        for (const string &ns : cameras) {
+            subscribers.push_back(nh.subscribe(ns + "/fiducial_vertices", 1,
+                                  &FiducialSlam::verticesCallback, this));
 
-        cameraInfoSub = nh.subscribe("/camera_info", 1,
-                              &FiducialSlam::camInfoCallback, this);
+            subscribers.push_back(nh.subscribe(ns + "/camera_info", 1,
+                                  &FiducialSlam::camInfoCallback, this));
+        }
 
         ftPub = ros::Publisher(nh.advertise
            <fiducial_msgs::FiducialTransformArray>("/fiducial_transforms", 1));
     }
     else {
-        ft_sub = nh.subscribe("/fiducial_transforms", 1,
-                              &FiducialSlam::transformCallback, this);
+        for (const string &ns : cameras) {
+            subscribers.push_back(nh.subscribe(ns + "/fiducial_transforms", 1,
+                                  &FiducialSlam::transformCallback, this));
+        }
     }
 
     ROS_INFO("Fiducial Slam ready");
@@ -174,16 +505,35 @@ void mySigintHandler(int sig)
     ros::shutdown();
 }
 
+// Set by SIGUSR1, the memory usage is logged from the main loop
+volatile sig_atomic_t memoryDumpRequested = 0;
+
+void mySigusr1Handler(int sig)
+{
+    memoryDumpRequested = 1;
+}
+
 int main(int argc, char ** argv) {
     ros::init(argc, argv, "fiducial_slam", ros::init_options::NoSigintHandler);
     ros::NodeHandle nh("~");
 
     node = make_unique<FiducialSlam>(nh);
     signal(SIGINT, mySigintHandler);
+    signal(SIGUSR1, mySigusr1Handler);
 
     ros::Rate r(20);
     while (ros::ok()) {
         ros::spinOnce(); 
+        node->checkGroupTimeout();
+        node->fiducialMap.finishLoading();
+        node->fiducialMap.processDeferredUpdate();
+        node->publishLatency();
+        node->publishMemory();
+        node->updateDiagnostics();
+        if (memoryDumpRequested) {
+            memoryDumpRequested = 0;
+            node->dumpMemory();
+        }
         r.sleep();
         node->fiducialMap.publishMarkers();
     }
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/hints.h>
+
+#include <opencv2/calib3d.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+HintPublisher::HintPublisher(ros::NodeHandle &nh, Map &map,
+                             const vector<string> &namespaces) : map(map)
+{
+    nh.param<double>("fiducial_len", fiducialLen, 0.14);
+    nh.param<double>("hint_margin", margin, 0.5);
+    nh.param<int>("hint_min_size", minSize, 32);
+    nh.param<double>("hint_max_range", maxRange, 0.0);
+
+    // One topic for all the cameras, each detector keeps the hints with
+    // the frame id of its camera
+    publisher = nh.advertise<fiducial_msgs::DetectionHints>("/fiducial_hints",
+                                                            namespaces.size());
+
+    for (const string &ns : namespaces) {
+        subscribers.push_back(nh.subscribe(ns + "/camera_info", 1,
+                                           &HintPublisher::camInfoCallback, this));
+    }
+}
+
+
+void HintPublisher::camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg)
+{
+    if (cameras.find(msg->header.frame_id) != cameras.end()) {
+        return;
+    }
+
+    HintCamera &camera = cameras[msg->header.frame_id];
+    camera.cameraMatrix = cv::Mat::zeros(3, 3, CV_64F);
+    for (int i = 0; i < 9; i++) {
+        camera.cameraMatrix.at<double>(i / 3, i % 3) = msg->K[i];
+    }
+    camera.distortionCoeffs = cv::Mat::zeros(1, max(5, (int)msg->D.size()), CV_64F);
+    for (int i = 0; i < msg->D.size(); i++) {
+        camera.distortionCoeffs.at<double>(0, i) = msg->D[i];
+    }
+    camera.width = msg->width;
+    camera.height = msg->height;
+
+    ROS_INFO("Publishing detection hints for camera %s",
+             msg->header.frame_id.c_str());
+}
+
+
+// Whether a fiducial at T_camFid can be seen by the camera: in range,
+// facing the camera and with its bounding sphere inside the frustum of
+// the undistorted image, grown by the size of the sphere to allow for
+// distortion. This is cheaper than projecting its corners
+
+bool HintPublisher::visible(const HintCamera &camera,
+                            const tf2::Transform &T_camFid) const
+{
+    const tf2::Vector3 &centre = T_camFid.getOrigin();
+    if (centre.z() <= 0 || (maxRange > 0 && centre.length() > maxRange)) {
+        return false;
+    }
+
+    // The fiducial's z axis points out of its face
+    if (T_camFid.getBasis().getColumn(2).dot(centre) >= 0) {
+        return false;
+    }
+
+    const double fx = camera.cameraMatrix.at<double>(0, 0);
+    const double fy = camera.cameraMatrix.at<double>(1, 1);
+    const double cx = camera.cameraMatrix.at<double>(0, 2);
+    const double cy = camera.cameraMatrix.at<double>(1, 2);
+    // Twice the radius of the sphere, at unit depth
+    const double extent = M_SQRT2 * fiducialLen / centre.z();
+
+    double u = cx + fx * centre.x() / centre.z();
+    double v = cy + fy * centre.y() / centre.z();
+    return u + fx * extent >= 0 && u - fx * extent < camera.width &&
+           v + fy * extent >= 0 && v - fy * extent < camera.height;
+}
+
+
+// Clamp a coordinate to [0, limit] before converting it to an int
+static inline int clampToImage(float x, int limit)
+{
+    if (!(x > 0)) {
+        return 0;
+    }
+    return x < limit ? (int)x : limit;
+}
+
+
+// Project the corners of each visible map fiducial into the image, and
+// send the box around them, grown by the margin and clipped to the image
+
+void HintPublisher::publish(const ros::Time &stamp)
+{
+    if (publisher.getNumSubscribers() == 0) {
+        return;
+    }
+
+    const float half = fiducialLen / 2.0;
+    const tf2::Vector3 corners[4] = {
+        tf2::Vector3(-half, half, 0), tf2::Vector3(half, half, 0),
+        tf2::Vector3(half, -half, 0), tf2::Vector3(-half, -half, 0)
+    };
+
+    for (std::map<string, HintCamera>::iterator it = cameras.begin();
+         it != cameras.end(); ++it) {
+        const HintCamera &camera = it->second;
+
+        tf2::Transform T_mapCam;
+        if (!map.predictCameraPose(it->first, stamp, T_mapCam)) {
+            continue;
+        }
+        tf2::Transform T_camMap = T_mapCam.inverse();
+
+        vector<int> ids;
+        objectPoints.clear();
+        for (const pair<const int, Fiducial> &f : map.fiducials) {
+            tf2::Transform T_camFid = T_camMap * f.second.pose.transform;
+            if (!visible(camera, T_camFid)) {
+                continue;
+            }
+
+            bool inFront = true;
+            for (int i = 0; i < 4; i++) {
+                tf2::Vector3 p = T_camFid * corners[i];
+                inFront = inFront && p.z() > 0;
+                objectPoints.push_back(cv::Point3f(p.x(), p.y(), p.z()));
+            }
+            if (inFront) {
+                ids.push_back(f.first);
+            }
+            else {
+                objectPoints.resize(objectPoints.size() - 4);
+            }
+        }
+
+        msg.header.stamp = stamp;
+        msg.header.frame_id = it->first;
+        msg.hints.clear();
+
+        if (!objectPoints.empty()) {
+            cv::projectPoints(objectPoints, cv::Vec3d(0, 0, 0), cv::Vec3d(0, 0, 0),
+                              camera.cameraMatrix, camera.distortionCoeffs,
+                              imagePoints);
+        }
+
+        for (int i = 0; i < ids.size(); i++) {
+            const cv::Point2f *pts = &imagePoints[i * 4];
+            float minX = min(min(pts[0].x, pts[1].x), min(pts[2].x, pts[3].x));
+            float maxX = max(max(pts[0].x, pts[1].x), max(pts[2].x, pts[3].x));
+            float minY = min(min(pts[0].y, pts[1].y), min(pts[2].y, pts[3].y));
+            float maxY = max(max(pts[0].y, pts[1].y), max(pts[2].y, pts[3].y));
+
+            float size = max(maxX - minX, maxY - minY);
+            float grow = max((float)margin * size, (minSize - size) / 2.0f);
+
+            cv::Rect box(cv::Point(clampToImage(minX - grow, camera.width),
+                                   clampToImage(minY - grow, camera.height)),
+                         cv::Point(clampToImage(maxX + grow + 1, camera.width),
+                                   clampToImage(maxY + grow + 1, camera.height)));
+            if (box.empty()) {
+                continue;
+            }
+
+            fiducial_msgs::FiducialHint hint;
+            hint.fiducial_id = ids[i];
+            hint.x = box.x;
+            hint.y = box.y;
+            hint.width = box.width;
+            hint.height = box.height;
+            msg.hints.push_back(hint);
+        }
+
+        publisher.publish(msg);
+    }
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/latency.h>
+#include <fiducial_slam/memory.h>
+
+#include <algorithm>
+
+using namespace std;
+
+static const char *stageNames[LatencyTracer::NUM_STAGES] = {
+    "capture", "detect", "detector_publish", "transport",
+    "queue", "slam", "tf", "tf_age"
+};
+
+// Images and traces are discarded if the other half has not arrived
+// within this many seconds
+static const double maxWait = 5.0;
+
+
+LatencyWindow::LatencyWindow(size_t size) : samples(max(size, (size_t)1))
+{
+    next = 0;
+    count = 0;
+}
+
+
+void LatencyWindow::add(double latency)
+{
+    samples[next] = latency;
+    next = (next + 1) % samples.size();
+    if (count < samples.size()) {
+        count++;
+    }
+}
+
+
+// Statistics and histogram of the latencies in the window. Each bin
+// counts latencies up to its edge
+
+void LatencyWindow::summarize(const vector<double> &binEdges,
+                              fiducial_msgs::LatencyHistogram &hist,
+                              vector<double> &sorted) const
+{
+    sorted.assign(samples.begin(), samples.begin() + count);
+    sort(sorted.begin(), sorted.end());
+
+    hist.samples = count;
+    hist.counts.assign(binEdges.size() + 1, 0);
+    hist.mean = 0.0;
+    hist.median = 0.0;
+    hist.p95 = 0.0;
+    hist.max = 0.0;
+
+    if (count == 0) {
+        return;
+    }
+
+    double total = 0.0;
+    for (double latency : sorted) {
+        total += latency;
+        size_t bin = lower_bound(binEdges.begin(), binEdges.end(), latency) -
+                     binEdges.begin();
+        hist.counts[bin]++;
+    }
+
+    hist.mean = total / count;
+    hist.median = sorted[count / 2];
+    hist.p95 = sorted[min(count - 1, (size_t)(0.95 * count))];
+    hist.max = sorted.back();
+}
+
+
+LatencyTracer::LatencyTracer(ros::NodeHandle &nh)
+{
+    int window;
+    nh.param<int>("latency_window", window, 500);
+    nh.param<double>("latency_publish_interval", publishInterval, 1.0);
+
+    binEdges = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0};
+    windows.assign(NUM_STAGES, LatencyWindow(window));
+    lastPublished = ros::Time::now();
+
+    traceSub = nh.subscribe("/fiducial_trace", 10,
+                            &LatencyTracer::traceCallback, this);
+    statsPub = nh.advertise<fiducial_msgs::LatencyStats>("/fiducial_latency", 1);
+}
+
+
+void LatencyTracer::add(Stage stage, const ros::Time &from, const ros::Time &to)
+{
+    if (from.isZero() || to.isZero()) {
+        return;
+    }
+    windows[stage].add((to - from).toSec());
+}
+
+
+void LatencyTracer::addDetectorStages(const fiducial_msgs::LatencyTrace &trace,
+                                      const ros::Time &received)
+{
+    add(CAPTURE, trace.header.stamp, trace.received);
+    add(DETECT, trace.received, trace.detected);
+    add(DETECTOR_PUBLISH, trace.detected, trace.published);
+    add(TRANSPORT, trace.published, received);
+}
+
+
+void LatencyTracer::traceCallback(const fiducial_msgs::LatencyTrace::ConstPtr &msg)
+{
+    ImageKey key(msg->header.frame_id, msg->image_seq);
+
+    map<ImageKey, ros::Time>::iterator it = processed.find(key);
+    if (it != processed.end()) {
+        addDetectorStages(*msg, it->second);
+        processed.erase(it);
+    }
+    else {
+        traces[key] = *msg;
+    }
+}
+
+
+void LatencyTracer::received(const std_msgs::Header &header, int imageSeq,
+                             const ros::Time &receiptTime)
+{
+    ImageTimes times;
+    times.captured = header.stamp;
+    times.received = receiptTime;
+    times.callback = ros::Time::now();
+
+    pending.push_back(make_pair(ImageKey(header.frame_id, imageSeq), times));
+}
+
+
+void LatencyTracer::updated(const ros::Time &updateStart, const ros::Time &poseTime,
+                            const ros::Time &transformTime)
+{
+    bool havePose = poseTime >= updateStart;
+    bool haveTransform = transformTime >= updateStart;
+
+    if (havePose && haveTransform && !pending.empty()) {
+        add(TF, poseTime, transformTime);
+    }
+
+    for (const pair<ImageKey, ImageTimes> &p : pending) {
+        const ImageTimes &times = p.second;
+
+        add(QUEUE, times.received, times.callback);
+        if (havePose) {
+            add(SLAM, times.callback, poseTime);
+        }
+        if (haveTransform) {
+            add(TF_AGE, times.captured, transformTime);
+        }
+
+        map<ImageKey, fiducial_msgs::LatencyTrace>::iterator it = traces.find(p.first);
+        if (it != traces.end()) {
+            addDetectorStages(it->second, times.received);
+            traces.erase(it);
+        }
+        else {
+            processed[p.first] = times.received;
+        }
+    }
+
+    pending.clear();
+}
+
+
+size_t LatencyTracer::memoryUsage() const
+{
+    size_t bytes = vectorBytes(pending) + mapBytes(processed) + mapBytes(traces) +
+                   vectorBytes(windows);
+    for (const LatencyWindow &w : windows) {
+        bytes += w.memoryUsage();
+    }
+    return bytes;
+}
+
+
+void LatencyTracer::publish()
+{
+    ros::Time now = ros::Time::now();
+    if ((now - lastPublished).toSec() < publishInterval) {
+        return;
+    }
+    lastPublished = now;
+
+    // Forget images whose trace never arrived, from a detector that does
+    // not trace, and traces of images that were not used
+    for (map<ImageKey, ros::Time>::iterator it = processed.begin();
+         it != processed.end(); ) {
+        if ((now - it->second).toSec() > maxWait) {
+            it = processed.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    for (map<ImageKey, fiducial_msgs::LatencyTrace>::iterator it = traces.begin();
+         it != traces.end(); ) {
+        if ((now - it->second.published).toSec() > maxWait) {
+            it = traces.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    if (statsPub.getNumSubscribers() == 0) {
+        return;
+    }
+
+    fiducial_msgs::LatencyStats stats;
+    stats.header.stamp = now;
+    stats.bin_edges = binEdges;
+    stats.stages.resize(NUM_STAGES);
+
+    for (int i = 0; i < NUM_STAGES; i++) {
+        stats.stages[i].name = stageNames[i];
+        windows[i].summarize(binEdges, stats.stages[i], sorted);
+    }
+
+    statsPub.publish(stats);
+}
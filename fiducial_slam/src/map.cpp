@@ -30,7 +30,10 @@
  */
 
 #include <fiducial_slam/map.h>
+#include <fiducial_slam/map_file.h>
+#include <fiducial_slam/smoother.h>
 #include <fiducial_slam/helpers.h>
+#include <fiducial_slam/memory.h>
 
 #include <string>
 #include <tf2/LinearMath/Vector3.h>
@@ -44,8 +47,24 @@
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
 #include <visualization_msgs/Marker.h>
 
-#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include <thread>
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+
+// Check if the result of a background task is available
+
+template<typename T>
+static bool futureReady(const std::future<T> &f)
+{
+    return f.valid() &&
+           f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
 
 // Update the variance of a gaussian that has been combined with another
 // Does not Take into account the degree of overlap of observations
@@ -58,9 +77,9 @@ static bool useAlexey = false;
 
 // Update the variance of a gaussian that has been combined with another
 // Taking into account the degree of overlap
-static double updateVarianceDavid(const tf2::Vector3 &newMean,
-                                  const tf2::Vector3 &mean1, double var1,
-                                  const tf2::Vector3 &mean2, double var2) {
+double updateVarianceDavid(const tf2::Vector3 &newMean,
+                           const tf2::Vector3 &mean1, double var1,
+                           const tf2::Vector3 &mean2, double var2) {
     if (useAlexey) {
        return updateVarianceAlexey(var1, var2);
     }
@@ -137,11 +156,6 @@ Observation::Observation(int fid, const tf2::Stamped<TransformWithVariance>& cam
 
     this->poseError = 0.0;
 
-    tf2_ros::TransformBroadcaster broadcaster;
-    geometry_msgs::TransformStamped ts = toMsg(camFid);
-    ts.child_frame_id = "fid" + to_string(fid);
-    broadcaster.sendTransform(ts);
-
     T_camFid = camFid;
     T_fidCam = T_camFid;
     T_fidCam.transform  = T_camFid.transform.inverse();
@@ -160,72 +174,214 @@ Fiducial::Fiducial(int id, const tf2::Stamped<TransformWithVariance>& pose) {
     this->id = id;
     this->pose = pose;
     this->lastPublished = ros::Time(0);
+    this->lastSeen = pose.stamp_;
     this->numObs = 0;
     this->visible = false;
 }
 
 
-// Constructor for map
+// Create a link to another fiducial that has not yet been seen with this one
+Link::Link(int id) {
+    this->id = id;
+    this->count = 0;
+    this->lastSeen = ros::Time(0);
+    this->meanOffset = tf2::Vector3(0, 0, 0);
+    this->offsetM2 = 0.0;
+    this->meanRotation = tf2::Quaternion::getIdentity();
+}
 
-Map::Map(ros::NodeHandle &nh) : tfBuffer(ros::Duration(30.0)){
-    frameNum = 0;
-    initialFrameNum = 0;
-    originFid = -1;
-    isInitializingMap = false;
 
-    listener = make_unique<tf2_ros::TransformListener>(tfBuffer);
+// Add an observation of the relative pose of the linked fiducial. The
+// position statistics use Welford's method, the rotation is a running
+// slerp average
+void Link::update(const tf2::Transform &T_fidOther, const ros::Time &time) {
+    count++;
+    lastSeen = time;
 
-    posePub = ros::Publisher(
-          nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("/fiducial_pose", 1));
-    markerPub = ros::Publisher(
-          nh.advertise<visualization_msgs::Marker>("/fiducials", 100));
-    mapPub = ros::Publisher(
-          nh.advertise<fiducial_msgs::FiducialMapEntryArray>("/fiducial_map",
-          1));
+    tf2::Vector3 offset = T_fidOther.getOrigin();
+    tf2::Vector3 delta = offset - meanOffset;
+    meanOffset += delta / count;
+    offsetM2 += delta.dot(offset - meanOffset);
+
+    if (count == 1) {
+        meanRotation = T_fidOther.getRotation();
+    }
+    else {
+        meanRotation = meanRotation.slerp(T_fidOther.getRotation(), 1.0 / count).normalized();
+    }
+}
 
-    clearSrv = nh.advertiseService("clear_map", &Map::clearCallback, this);
 
-    nh.param<std::string>("map_frame", mapFrame, "map");
-    nh.param<std::string>("odom_frame", odomFrame, "odom");
-    nh.param<std::string>("base_frame", baseFrame, "base_link");
+// Update the links of a fiducial with the other fiducials seen in the same
+// frame. Both lists are sorted by id so this is a single merge, linear in
+// the number of links and observations
+void Fiducial::updateLinks(const Observation &self,
+                           const vector<const Observation*> &frameObs,
+                           const ros::Time &time, vector<Link> &scratch)
+{
+    scratch.clear();
+    size_t i = 0, j = 0;
 
-    nh.param<double>("future_date_transforms", future_date_transforms, 0.1);
-    nh.param<bool>("publish_6dof_pose", publish_6dof_pose, false);
+    while (i < links.size() || j < frameObs.size()) {
+        if (j < frameObs.size() && frameObs[j]->fid == id) {
+            j++;
+        }
+        else if (j == frameObs.size() ||
+                 (i < links.size() && links[i].id < frameObs[j]->fid)) {
+            scratch.push_back(links[i++]);
+        }
+        else {
+            const Observation &o = *frameObs[j++];
+            if (i < links.size() && links[i].id == o.fid) {
+                scratch.push_back(links[i++]);
+            }
+            else {
+                scratch.push_back(Link(o.fid));
+            }
+            scratch.back().update(self.T_fidCam.transform * o.T_camFid.transform, time);
+        }
+    }
 
-    // threshold of object error for using multi-fidicial pose
-    // set -ve to never use
-    nh.param<double>("multi_error_theshold", multiErrorThreshold, 0.1);
+    // Copying back reuses the capacity of links, so only allocates
+    // when the fiducial gains neighbours
+    links.assign(scratch.begin(), scratch.end());
+}
 
-    nh.param<std::string>("map_file", mapFilename,
-        string(getenv("HOME")) + "/.ros/slam/map.txt");
 
-    boost::filesystem::path mapPath(mapFilename);
-    boost::filesystem::path dir = mapPath.parent_path();
-    boost::filesystem::create_directories(dir);
+static bool linkLess(const Link &link, int id) {
+    return link.id < id;
+}
 
-    std::string initialMap;
-    nh.param<std::string>("initial_map_file", initialMap, "");
+const Link *Fiducial::findLink(int id) const {
+    vector<Link>::const_iterator it = lower_bound(links.begin(), links.end(), id, linkLess);
+    if (it == links.end() || it->id != id) {
+        return nullptr;
+    }
+    return &*it;
+}
 
-    if (!initialMap.empty()) {
-        loadMap(initialMap);
+void Fiducial::addLink(int id) {
+    vector<Link>::iterator it = lower_bound(links.begin(), links.end(), id, linkLess);
+    if (it == links.end() || it->id != id) {
+        links.insert(it, Link(id));
     }
-    else {
-        loadMap();
+}
+
+void Fiducial::removeLink(int id) {
+    vector<Link>::iterator it = lower_bound(links.begin(), links.end(), id, linkLess);
+    if (it != links.end() && it->id == id) {
+        links.erase(it);
     }
+}
 
-    publishMarkers();
+
+// Constructor for map, with the default settings. It is not connected to
+// anything: outputs go to output if it is set, and the only transforms
+// known are those added to tfBuffer
+
+Map::Map() : tfBuffer(ros::Duration(30.0)) {
+    output = nullptr;
+    clock = [this]() { return latestTime; };
+
+    frameNum = 0;
+    initialFrameNum = 0;
+    originFid = -1;
+    isInitializingMap = false;
+    haveDeferredUpdate = false;
+    havePose = false;
+
+    mapFrame = "map";
+    odomFrame = "odom";
+    baseFrame = "base_link";
+    future_date_transforms = 0.1;
+    publish_6dof_pose = false;
+    multiErrorThreshold = 0.1;
+
+    compactInterval = 0.0;
+    compactionParams = {3, 1.0, 600.0, 0.0, 0};
+    lastCompaction = ros::Time(0);
+
+    isLoadingMap = false;
+    startTime = ros::WallTime::now();
+    timeToFirstPose = -1.0;
+}
+
+
+// Destructor for map, defined here as PoseSmoother is incomplete in the header.
+// Background tasks write to members such as loadedPoses, so they are waited
+// for before any member is destroyed
+
+Map::~Map() {
+    if (pendingMap.valid()) {
+        pendingMap.wait();
+    }
+    if (pendingCompaction.valid()) {
+        pendingCompaction.wait();
+    }
+    if (compactionCleanup.valid()) {
+        compactionCleanup.wait();
+    }
 }
 
 
 // Update map with a set of observations
 
-void Map::update(vector<Observation>& obs, const ros::Time &time)
+void Map::update(vector<Observation>& obs, const ros::Time &time,
+                 FrameBudget &budget)
 {
     ROS_INFO("Updating map with %d observations. Map has %d fiducials",
         (int)obs.size(), (int)fiducials.size());
 
     frameNum++;
 
+    // There was no idle time to do the last deferred update
+    if (haveDeferredUpdate) {
+        budget.counters.droppedUpdates++;
+        haveDeferredUpdate = false;
+    }
+
+    // Publish the observed fiducials, in the camera frames
+    if (output) {
+        vector<geometry_msgs::TransformStamped> fidTransforms;
+        fidTransforms.reserve(obs.size());
+        for (const Observation &o : obs) {
+            fidTransforms.push_back(toMsg(o.T_camFid));
+            fidTransforms.back().child_frame_id = "fid" + to_string(o.fid);
+        }
+        output->publishTransforms(fidTransforms);
+    }
+
+    toBaseFrame(obs, time);
+
+    if (futureReady(pendingMap)) {
+        installPendingMap();
+    }
+
+    // Localize from single fiducials until the map has loaded
+    if (isLoadingMap) {
+        tf2::Stamped<TransformWithVariance> T_mapCam;
+        T_mapCam.frame_id_ = mapFrame;
+        updatePoseFromLoadedPoses(obs, T_mapCam);
+        return;
+    }
+
+    latestTime = time;
+
+    // Compaction intervals are timed from the first frame, in frame time
+    if (lastCompaction.isZero()) {
+        lastCompaction = time;
+    }
+
+    if (futureReady(pendingCompaction)) {
+        finishCompaction();
+    }
+    else if (compactInterval > 0 && !isInitializingMap && !isLoadingMap &&
+             !pendingCompaction.valid() &&
+             (!compactionCleanup.valid() || futureReady(compactionCleanup)) &&
+             (time - lastCompaction).toSec() > compactInterval) {
+        startCompaction(time);
+    }
+
     if (obs.size() > 0 && fiducials.size() == 0) {
         isInitializingMap = true;
     }
@@ -238,6 +394,15 @@ void Map::update(vector<Observation>& obs, const ros::Time &time)
         T_mapCam.frame_id_ = mapFrame;
 
         if (updatePose(obs, time, T_mapCam) > 0 && obs.size() > 1) {
+            // The pose has been published, updating the map can wait
+            if (budget.exhausted()) {
+                deferredObs = obs;
+                deferredPose = T_mapCam;
+                deferredTime = time;
+                haveDeferredUpdate = true;
+                budget.counters.deferredUpdates++;
+                return;
+            }
             updateMap(obs, time, T_mapCam);
         }
     }
@@ -246,18 +411,54 @@ void Map::update(vector<Observation>& obs, const ros::Time &time)
 }
 
 
+// Do a map update that was deferred from a frame that ran out of time
+
+void Map::processDeferredUpdate()
+{
+    if (!haveDeferredUpdate) {
+        return;
+    }
+    haveDeferredUpdate = false;
+
+    updateMap(deferredObs, deferredTime, deferredPose);
+    publishMap();
+}
+
+
 // update estimates of observed fiducials from previously estimated
 // camera pose
 
 void Map::updateMap(const vector<Observation>& obs, const ros::Time &time,
                     const tf2::Stamped<TransformWithVariance>& T_mapCam)
 {
-    map<int, Fiducial>::iterator fit;
-
-    for (fit = fiducials.begin(); fit != fiducials.end(); fit++) {
-        Fiducial &f = fit->second;
-        f.visible = false;
+    // Only the fiducials seen in the last frame need to be reset
+    for (int id : visibleFids) {
+        map<int, Fiducial>::iterator fit = fiducials.find(id);
+        if (fit != fiducials.end()) {
+            fit->second.visible = false;
+        }
     }
+    visibleFids.clear();
+
+    // Observations of real fiducials sorted by id, for updating links.
+    // A fiducial seen by more than one camera is linked using its lowest
+    // variance observation, so that each link is updated once a frame
+    frameObs.clear();
+    for (const Observation &o : obs) {
+        if (o.fid != 0 && !std::isnan(o.T_camFid.transform.getOrigin().x())) {
+            frameObs.push_back(&o);
+        }
+    }
+    sort(frameObs.begin(), frameObs.end(),
+         [](const Observation *a, const Observation *b) {
+             return a->fid < b->fid ||
+                    (a->fid == b->fid && a->T_camFid.variance < b->T_camFid.variance);
+         });
+    frameObs.erase(unique(frameObs.begin(), frameObs.end(),
+                          [](const Observation *a, const Observation *b) {
+                              return a->fid == b->fid;
+                          }),
+                   frameObs.end());
 
     for (int i=0; i<obs.size(); i++) {
         const Observation &o = obs[i];
@@ -291,22 +492,172 @@ void Map::updateMap(const vector<Observation>& obs, const ros::Time &time,
         }
         Fiducial &f = fiducials[o.fid];
         f.visible = true;
+        f.lastSeen = time;
+        visibleFids.push_back(f.id);
         if (f.pose.variance != 0) {
            f.update(T_mapFid);
            f.numObs++;
         }
 
-        for (int j=0; j<obs.size(); j++) {
-            int fid = obs[j].fid;
-            if (f.id != fid) {
-                f.links[fid] = 1;
-            }
+        vector<const Observation*>::const_iterator self =
+            lower_bound(frameObs.begin(), frameObs.end(), o.fid,
+                        [](const Observation *a, int fid) { return a->fid < fid; });
+        if (self != frameObs.end() && *self == &o) {
+            f.updateLinks(o, frameObs, time, linkScratch);
         }
         publishMarker(fiducials[o.fid]);
     }
 }
 
 
+// Get the fiducials that have been seen with a fiducial in at least
+// minCount images, most frequently seen first
+
+void Map::getNeighbours(int fid, int minCount, vector<int> &neighbours) const
+{
+    neighbours.clear();
+
+    map<int, Fiducial>::const_iterator it = fiducials.find(fid);
+    if (it == fiducials.end()) {
+        return;
+    }
+
+    vector<const Link*> strong;
+    for (const Link &link : it->second.links) {
+        if (link.count >= minCount) {
+            strong.push_back(&link);
+        }
+    }
+    stable_sort(strong.begin(), strong.end(),
+                [](const Link *a, const Link *b) { return a->count > b->count; });
+
+    neighbours.reserve(strong.size());
+    for (const Link *link : strong) {
+        neighbours.push_back(link->id);
+    }
+}
+
+
+// Get the fiducials within depth links of any of the given fiducials,
+// following only links seen in at least minCount images. The result
+// includes the given fiducials and is sorted by id
+
+void Map::getNeighbourhood(const vector<int> &fids, int depth, int minCount,
+                           vector<int> &neighbourhood) const
+{
+    neighbourhood.clear();
+
+    vector<int> frontier;
+    for (int fid : fids) {
+        if (fiducials.find(fid) != fiducials.end()) {
+            frontier.push_back(fid);
+        }
+    }
+    sort(frontier.begin(), frontier.end());
+    frontier.erase(unique(frontier.begin(), frontier.end()), frontier.end());
+    neighbourhood = frontier;
+
+    vector<int> next, merged;
+    for (int d=0; d<depth && !frontier.empty(); d++) {
+        next.clear();
+        for (int fid : frontier) {
+            const Fiducial &f = fiducials.find(fid)->second;
+            for (const Link &link : f.links) {
+                if (link.count >= minCount && fiducials.find(link.id) != fiducials.end()) {
+                    next.push_back(link.id);
+                }
+            }
+        }
+        sort(next.begin(), next.end());
+        next.erase(unique(next.begin(), next.end()), next.end());
+
+        // Only fiducials not already in the neighbourhood are expanded
+        frontier.clear();
+        set_difference(next.begin(), next.end(), neighbourhood.begin(), neighbourhood.end(),
+                       back_inserter(frontier));
+
+        merged.clear();
+        merge(neighbourhood.begin(), neighbourhood.end(), frontier.begin(), frontier.end(),
+              back_inserter(merged));
+        neighbourhood.swap(merged);
+    }
+}
+
+
+// Express observations in the base frame, so that those from different
+// cameras can be combined. If the transform from a camera is not
+// available the last one seen is used, or failing that the camera
+// pose is used as the robot pose
+
+void Map::toBaseFrame(vector<Observation> &obs, const ros::Time &time)
+{
+    string lastFrame;
+    tf2::Transform T_baseCam;
+
+    for (Observation &o : obs) {
+        const string frame = o.T_camFid.frame_id_;
+        if (frame.empty() || frame == baseFrame) {
+            continue;
+        }
+
+        if (frame != lastFrame) {
+            if (lookupTransform(baseFrame, frame, time, T_baseCam)) {
+                cameraExtrinsics[frame] = T_baseCam;
+            }
+            else {
+                map<string, tf2::Transform>::const_iterator it =
+                    cameraExtrinsics.find(frame);
+                if (it != cameraExtrinsics.end()) {
+                    T_baseCam = it->second;
+                }
+                else {
+                    T_baseCam.setIdentity();
+                }
+            }
+            lastFrame = frame;
+        }
+
+        o.T_camFid.transform = T_baseCam * o.T_camFid.transform;
+        o.T_camFid.frame_id_ = baseFrame;
+        o.T_fidCam = o.T_camFid;
+        o.T_fidCam.transform = o.T_camFid.transform.inverse();
+    }
+}
+
+
+// Predict the pose of a camera at a time from the last robot pose, moved by
+// the odometry since then if possible. Returns false if there is no recent
+// pose to predict from
+
+bool Map::predictCameraPose(const string &frame, const ros::Time &time,
+                            tf2::Transform &T_mapCam) const
+{
+    if (!havePose || fabs((time - lastPoseTime).toSec()) > 1.0) {
+        return false;
+    }
+
+    tf2::Transform T_mapBase = lastPose;
+
+    tf2::Transform odomNow;
+    if (lastPoseHaveOdom && tfBuffer.canTransform(odomFrame, baseFrame, time) &&
+        lookupTransform(odomFrame, baseFrame, time, odomNow)) {
+        T_mapBase = lastPose * (lastPoseOdom.inverse() * odomNow);
+    }
+
+    // As in toBaseFrame, a camera with no known transform is taken to be
+    // at the base
+    tf2::Transform T_baseCam;
+    T_baseCam.setIdentity();
+    map<string, tf2::Transform>::const_iterator it = cameraExtrinsics.find(frame);
+    if (it != cameraExtrinsics.end()) {
+        T_baseCam = it->second;
+    }
+
+    T_mapCam = T_mapBase * T_baseCam;
+    return true;
+}
+
+
 // lookup specified transform
 
 bool Map::lookupTransform(const std::string &from, const std::string &to,
@@ -340,17 +691,23 @@ int Map::updatePose(vector<Observation>& obs, const ros::Time &time,
 
         if (o.fid == 0) {
             // virtual fiducial 0 is at the origin
-            T_fid0Cam = o.T_fidCam;
-
-            tf2::Vector3 t = T_fid0Cam.transform.getOrigin();
+            tf2::Vector3 t = o.T_fidCam.transform.getOrigin();
             double r, p, y;
-            T_fid0Cam.transform.getBasis().getRPY(r, p, y);
+            o.T_fidCam.transform.getBasis().getRPY(r, p, y);
 
             ROS_INFO("Pose MUL %lf %lf %lf %lf %lf %lf %lf",
-              t.x(), t.y(), t.z(), r, p, y, T_fid0Cam.variance);
-
-            if (T_fid0Cam.variance < multiErrorThreshold) {
-                useMulti = true;
+              t.x(), t.y(), t.z(), r, p, y, o.T_fidCam.variance);
+
+            // With several cameras there is one of these from each,
+            // combine those that are good enough
+            if (o.T_fidCam.variance < multiErrorThreshold) {
+                if (!useMulti) {
+                    T_fid0Cam = o.T_fidCam;
+                    useMulti = true;
+                }
+                else {
+                    T_fid0Cam.setData(averageTransforms(T_fid0Cam, o.T_fidCam));
+                }
             }
         }
         else if (fiducials.find(o.fid) != fiducials.end()) {
@@ -415,28 +772,51 @@ int Map::updatePose(vector<Observation>& obs, const ros::Time &time,
         T_mapCam = T_fid0Cam; 
     }
 
-    // Determine transform from camera to robot
-    tf2::Transform T_camBase;
-    // Use robotPose instead of camera pose to hold map to robot
-    tf2::Stamped<TransformWithVariance> basePose = T_mapCam;
+    publishRobotPose(T_mapCam);
 
-    if (lookupTransform(obs[0].T_camFid.frame_id_, baseFrame, time, T_camBase)) {
-        basePose.setData(T_mapCam * T_camBase);
-        //basePose.setData(cameraTransform * cameraPose);
+    ROS_INFO("Finished frame\n");
+    return numEsts;
+}
 
-        // New scope for logging vars
-        {
-            tf2::Vector3 c = T_mapCam.transform.getOrigin();
-            ROS_INFO("camera   %lf %lf %lf %f",
-                     c.x(), c.y(), c.z(), T_mapCam.variance);
+// Publish the pose of the robot, and the transform from the map to the
+// odometry frame
 
-            tf2::Vector3 trans = basePose.transform.getOrigin();
-            ROS_INFO("Pose b_l %lf %lf %lf %f",
-                     trans.x(), trans.y(), trans.z(), basePose.variance);
-        }
-     }
+void Map::publishRobotPose(const tf2::Stamped<TransformWithVariance>& T_mapCam)
+{
+    if (timeToFirstPose < 0) {
+        timeToFirstPose = (ros::WallTime::now() - startTime).toSec();
+        ROS_INFO("Time to first pose %.3f s%s", timeToFirstPose,
+                 isLoadingMap ? ", map still loading" : "");
+    }
+
+    // The observations were transformed to the base frame by toBaseFrame,
+    // so this is the pose of the robot
+    tf2::Stamped<TransformWithVariance> basePose = T_mapCam;
     basePose.frame_id_ = mapFrame;
-    posePub.publish(toPose(basePose));
+
+    tf2::Transform odomTransform;
+    bool haveOdom = !odomFrame.empty() &&
+        lookupTransform(odomFrame, baseFrame, basePose.stamp_, odomTransform);
+
+    if (smoother) {
+        smoother->update(basePose, haveOdom ? &odomTransform : nullptr, basePose);
+
+        tf2::Vector3 trans = basePose.transform.getOrigin();
+        ROS_INFO("Pose smoothed %lf %lf %lf %f",
+                 trans.x(), trans.y(), trans.z(), basePose.variance);
+    }
+
+    if (output) {
+        output->publishPose(toPose(basePose));
+    }
+
+    havePose = true;
+    lastPoseTime = basePose.stamp_;
+    lastPose = basePose.transform;
+    lastPoseHaveOdom = haveOdom;
+    if (haveOdom) {
+        lastPoseOdom = odomTransform;
+    }
 
     tf2::Stamped<TransformWithVariance> outPose = basePose;
     outPose.frame_id_ = mapFrame;
@@ -444,8 +824,7 @@ int Map::updatePose(vector<Observation>& obs, const ros::Time &time,
 
     if (!odomFrame.empty()) {
          outFrame=odomFrame;
-         tf2::Transform odomTransform;
-         if (lookupTransform(odomFrame, baseFrame, outPose.stamp_, odomTransform)) {
+         if (haveOdom) {
 
              outPose.setData(basePose * odomTransform.inverse());
              outFrame = odomFrame;
@@ -470,10 +849,60 @@ int Map::updatePose(vector<Observation>& obs, const ros::Time &time,
     geometry_msgs::TransformStamped ts = toMsg(outPose);
     ts.child_frame_id = outFrame;
     ts.header.stamp += ros::Duration(future_date_transforms);
-    broadcaster.sendTransform(ts);
+    if (output) {
+        output->publishTransforms(vector<geometry_msgs::TransformStamped>(1, ts));
+    }
+}
 
-    ROS_INFO("Finished frame\n");
-    return numEsts;
+
+// Estimate the pose while the map is loading, from the single fiducial
+// with the smallest variance whose pose has been read
+
+int Map::updatePoseFromLoadedPoses(vector<Observation>& obs,
+                                   tf2::Stamped<TransformWithVariance>& T_mapCam)
+{
+    std::shared_ptr<const vector<pair<int, TransformWithVariance>>> poses =
+        std::atomic_load(&loadedPoses);
+    if (!poses) {
+        ROS_INFO("Finished frame - map is loading\n");
+        return 0;
+    }
+
+    int bestFid = -1;
+    for (const Observation &o : obs) {
+        auto it = lower_bound(poses->begin(), poses->end(), o.fid,
+            [](const pair<int, TransformWithVariance> &p, int fid) {
+                return p.first < fid;
+            });
+        if (it == poses->end() || it->first != o.fid) {
+            continue;
+        }
+
+        TransformWithVariance p = it->second * o.T_fidCam;
+        tf2::Vector3 position = p.transform.getOrigin();
+        if (std::isnan(position.x()) || std::isnan(position.y()) ||
+            std::isnan(position.z())) {
+            continue;
+        }
+
+        if (bestFid == -1 || p.variance < T_mapCam.variance) {
+            T_mapCam.setData(p);
+            T_mapCam.stamp_ = o.T_fidCam.stamp_;
+            bestFid = o.fid;
+        }
+    }
+
+    if (bestFid == -1) {
+        ROS_INFO("Finished frame - no estimates while map is loading\n");
+        return 0;
+    }
+
+    tf2::Vector3 trans = T_mapCam.transform.getOrigin();
+    ROS_INFO("Pose from %d while map is loading %lf %lf %lf %f", bestFid,
+             trans.x(), trans.y(), trans.z(), T_mapCam.variance);
+
+    publishRobotPose(T_mapCam);
+    return 1;
 }
 
 
@@ -558,6 +987,33 @@ void Map::autoInit(const vector<Observation>& obs, const ros::Time &time) {
 }
 
 
+// Convert a fiducial to the form stored in map files
+
+static MapEntry toMapEntry(const Fiducial &f)
+{
+    tf2::Vector3 trans = f.pose.transform.getOrigin();
+    double rx, ry, rz;
+    f.pose.transform.getBasis().getRPY(rx, ry, rz);
+
+    MapEntry e;
+    e.id = f.id;
+    e.tx = trans.x();
+    e.ty = trans.y();
+    e.tz = trans.z();
+    e.rx = rad2deg(rx);
+    e.ry = rad2deg(ry);
+    e.rz = rad2deg(rz);
+    e.variance = f.pose.variance;
+    e.numObs = f.numObs;
+
+    e.links.reserve(f.links.size());
+    for (const Link &link : f.links) {
+        e.links.push_back(link.id);
+    }
+    return e;
+}
+
+
 // save map to file
 
 bool Map::saveMap() {
@@ -566,36 +1022,102 @@ bool Map::saveMap() {
 
 bool Map::saveMap(std::string filename)
 {
+    // Saving before the map has loaded would lose it
+    if (isLoadingMap) {
+        ROS_INFO("Waiting for the map to load before saving");
+        installPendingMap();
+    }
+
     ROS_INFO("Saving map with %d fiducials to file %s\n",
          (int)fiducials.size(), filename.c_str());
 
-    FILE *fp = fopen(filename.c_str(), "w");
-    if (fp == NULL) {
+    vector<MapEntry> entries;
+    entries.reserve(fiducials.size());
+
+    map<int, Fiducial>::iterator it;
+
+    for (it = fiducials.begin(); it != fiducials.end(); it++) {
+        entries.push_back(toMapEntry(it->second));
+    }
+
+    if (!saveMapFile(filename, entries)) {
         ROS_WARN("Could not open %s for write\n", filename.c_str());
         return false;
     }
+    return true;
+}
 
-    map<int, Fiducial>::iterator it;
-    map<int, int>::iterator lit;
 
-    for (it = fiducials.begin(); it != fiducials.end(); it++) {
-        Fiducial &f = it->second;
-        tf2::Vector3 trans = f.pose.transform.getOrigin();
-        double rx, ry, rz;
-        f.pose.transform.getBasis().getRPY(rx, ry, rz);
+// Read a map file, returning the number of entries read or -1 if it could
+// not be read. If poses is given, the poses of the fiducials are stored
+// there, sorted by id, in chunks as they are parsed and before the
+// fiducials are built, so that they can be used while this runs in a
+// background thread. The fiducials are stamped with now
+
+static int readMap(const std::string filename, const string mapFrame,
+                   const ros::Time &now, map<int, Fiducial> &fiducials,
+                    std::shared_ptr<const vector<pair<int, TransformWithVariance>>> *poses)
+{
+    vector<MapEntry> entries;
+    vector<string> invalidLines;
+    vector<pair<int, TransformWithVariance>> entryPoses;
+
+    // Convert the entries read since the last call, and publish the
+    // poses of all of them so far
+    auto addPoses = [&entryPoses, poses](const vector<MapEntry> &entries) {
+        for (size_t i=entryPoses.size(); i<entries.size(); i++) {
+            const MapEntry &e = entries[i];
+            tf2::Vector3 tvec(e.tx, e.ty, e.tz);
+            tf2::Quaternion q;
+            q.setRPY(deg2rad(e.rx), deg2rad(e.ry), deg2rad(e.rz));
+            entryPoses.push_back(make_pair(e.id, TransformWithVariance(tvec, q, e.variance)));
+        }
+
+        if (poses) {
+            auto sorted = std::make_shared<vector<pair<int, TransformWithVariance>>>(entryPoses);
+            stable_sort(sorted->begin(), sorted->end(),
+                [](const pair<int, TransformWithVariance> &a,
+                   const pair<int, TransformWithVariance> &b) {
+                    return a.first < b.first;
+                });
+            std::atomic_store(poses,
+                std::shared_ptr<const vector<pair<int, TransformWithVariance>>>(sorted));
+        }
+    };
+
+    if (!loadMapFile(filename, entries, &invalidLines, addPoses)) {
+        ROS_WARN("Could not open %s for read\n", filename.c_str());
+        return -1;
+    }
+    addPoses(entries);
 
-        fprintf(fp, "%d %lf %lf %lf %lf %lf %lf %lf %d", f.id,
-                 trans.x(), trans.y(), trans.z(),
-                 rad2deg(rx), rad2deg(ry), rad2deg(rz), 
-                 f.pose.variance, f.numObs);
+    for (const string &line : invalidLines) {
+        ROS_WARN("Invalid line: %s", line.c_str());
+    }
+
+    for (size_t i=0; i<entries.size(); i++) {
+        const MapEntry &e = entries[i];
+
+        // TODO: figure out what the timestamp in Fiducial should be
+        Fiducial f = Fiducial(e.id, tf2::Stamped<TransformWithVariance>(
+                                  entryPoses[i].second, now, mapFrame));
+        f.numObs = e.numObs;
 
-        for (lit = f.links.begin(); lit != f.links.end(); lit++) {
-            fprintf(fp, " %d", lit->first);
+        // Map files do not record when fiducials were last seen. A zero
+        // time exempts them from age based compaction until they are seen
+        f.lastSeen = ros::Time(0);
+
+        // Only the ids of links are saved, their statistics start
+        // again when the fiducials are next seen together
+        for (int link : e.links) {
+            if (link != e.id) {
+                f.addLink(link);
+            }
         }
-        fprintf(fp, "\n");
+        fiducials[e.id] = f;
     }
-    fclose(fp);
-    return true;
+
+    return entries.size();
 }
 
 
@@ -607,66 +1129,62 @@ bool Map::loadMap() {
 
 bool Map::loadMap(std::string filename)
 {
-    int numRead = 0;
-
     ROS_INFO("Load map %s", filename.c_str());
 
-    FILE *fp = fopen(filename.c_str(), "r");
-    if (fp == NULL) {
-        ROS_WARN("Could not open %s for read\n", filename.c_str());
+    int numRead = readMap(filename, mapFrame, clock(), fiducials, nullptr);
+    if (numRead < 0) {
         return false;
     }
 
-    const int BUFSIZE = 2048;
-    char linebuf[BUFSIZE];
-    char linkbuf[BUFSIZE];
-
-    while (!feof(fp)) {
-        if (fgets(linebuf, BUFSIZE - 1, fp) == NULL)
-            break;
-
-        int id;
-        double tx, ty, tz, rx, ry, rz, var;
-        int numObs = 0;
-
-        linkbuf[0] = '\0';
-        int nElems = sscanf(linebuf, "%d %lf %lf %lf %lf %lf %lf %lf %d%[^\t\n]*s",
-                            &id, &tx, &ty, &tz, &rx, &ry, &rz, &var, &numObs, linkbuf);
-        if (nElems == 9 || nElems == 10) {
-             tf2::Vector3 tvec(tx, ty, tz);
-             tf2::Quaternion q;
-             q.setRPY(deg2rad(rx), deg2rad(ry), deg2rad(rz));
-
-             auto twv = TransformWithVariance(tvec, q, var);
-             // TODO: figure out what the timestamp in Fiducial should be
-             Fiducial f = Fiducial(id, tf2::Stamped<TransformWithVariance>(twv, ros::Time::now(), mapFrame));
-             f.numObs = numObs;
-
-             istringstream ss(linkbuf);
-             string s;
-             while (getline(ss, s, ' ')) {
-                 if (!s.empty()) {
-                     f.links[stoi(s)] = 1;
-                 }
-             }
-             fiducials[id] = f;
-             numRead++;
-        }
-        else {
-             ROS_WARN("Invalid line: %s", linebuf);
-        }
+    ROS_INFO("Load map %s read %d entries", filename.c_str(), numRead);
+    return true;
+}
+
+
+// Load a map in the background, it is installed by finishLoading or the
+// next update once it has been read
+
+bool Map::loadMapAsync(const std::string &filename)
+{
+    if (pendingMap.valid()) {
+        ROS_WARN("Map initialization already in progress");
+        return false;
     }
 
-    fclose(fp);
-    ROS_INFO("Load map %s read %d entries", filename.c_str(), numRead);
+    ROS_INFO("Loading map %s in the background", filename.c_str());
+
+    isLoadingMap = true;
+    loadStarted = ros::WallTime::now();
+    std::atomic_store(&loadedPoses,
+        std::shared_ptr<const vector<pair<int, TransformWithVariance>>>());
+
+    std::shared_ptr<const vector<pair<int, TransformWithVariance>>> *poses = &loadedPoses;
+    string frame = mapFrame;
+    ros::Time now = clock();
+    pendingMap = std::async(std::launch::async, [filename, frame, now, poses]() {
+        map<int, Fiducial> loaded;
+        readMap(filename, frame, now, loaded, poses);
+        return loaded;
+    });
     return true;
 }
 
+void Map::finishLoading()
+{
+    if (isLoadingMap && futureReady(pendingMap)) {
+        installPendingMap();
+    }
+}
+
 
 // Publish the map
 
 void Map::publishMap()
 {
+    if (!output) {
+        return;
+    }
+
     fiducial_msgs::FiducialMapEntryArray fmea;
     map<int, Fiducial>::iterator it;
 
@@ -693,7 +1211,7 @@ void Map::publishMap()
         fmea.fiducials.push_back(fme);
     }
 
-    mapPub.publish(fmea);
+    output->publishMap(fmea);
 }
 
 
@@ -702,7 +1220,11 @@ void Map::publishMap()
 
 void Map::publishMarkers()
 {
-    ros::Time now = ros::Time::now();
+    if (!output) {
+        return;
+    }
+
+    ros::Time now = clock();
     map<int, Fiducial>::iterator it;
 
     for (it = fiducials.begin(); it != fiducials.end(); it++) {
@@ -718,7 +1240,11 @@ void Map::publishMarkers()
 
 void Map::publishMarker(Fiducial &fid)
 {
-    fid.lastPublished = ros::Time::now();
+    if (!output) {
+        return;
+    }
+
+    fid.lastPublished = clock();
 
     // Flattened cube
     visualization_msgs::Marker marker;
@@ -744,7 +1270,7 @@ void Map::publishMarker(Fiducial &fid)
     marker.id = fid.id;
     marker.ns = "fiducial";
     marker.header.frame_id = "/map";
-    markerPub.publish(marker);
+    output->publishMarker(marker);
 
     // cylinder scaled by stddev
     visualization_msgs::Marker cylinder;
@@ -763,7 +1289,7 @@ void Map::publishMarker(Fiducial &fid)
     cylinder.pose.position.y = marker.pose.position.y;
     cylinder.pose.position.z = marker.pose.position.z;
     cylinder.pose.position.z += (marker.scale.z/2.0) + 0.05;
-    markerPub.publish(cylinder);
+    output->publishMarker(cylinder);
 
     // Text
     visualization_msgs::Marker text;
@@ -780,7 +1306,7 @@ void Map::publishMarker(Fiducial &fid)
     text.id = fid.id + 30000;
     text.ns = "text";
     text.text = std::to_string(fid.id);
-    markerPub.publish(text);
+    output->publishMarker(text);
 
     // Links
     visualization_msgs::Marker links;
@@ -804,9 +1330,8 @@ void Map::publishMarker(Fiducial &fid)
     gp0.y = p0.y();
     gp0.z = p0.z();
 
-    map<int, int>::iterator lit;
-    for (lit = fid.links.begin(); lit != fid.links.end(); lit++) {
-        int ofid = lit->first;
+    for (const Link &link : fid.links) {
+        int ofid = link.id;
         // only draw links in one direction
         if (fid.id < ofid) {
             if (fiducials.find(ofid) != fiducials.end()) {
@@ -820,7 +1345,30 @@ void Map::publishMarker(Fiducial &fid)
         }
     }
 
-    markerPub.publish(links);
+    output->publishMarker(links);
+}
+
+
+// Remove the visualization messages for a fiducial
+
+void Map::deleteMarker(int fid)
+{
+    if (!output) {
+        return;
+    }
+
+    visualization_msgs::Marker marker;
+    marker.action = visualization_msgs::Marker::DELETE;
+    marker.header.frame_id = "/map";
+
+    const char *ns[] = {"fiducial", "sigma", "text", "links"};
+    const int ids[] = {fid, fid, fid + 30000, fid + 40000};
+
+    for (int i=0; i<4; i++) {
+        marker.ns = ns[i];
+        marker.id = ids[i];
+        output->publishMarker(marker);
+    }
 }
 
 
@@ -828,6 +1376,10 @@ void Map::publishMarker(Fiducial &fid)
 
 void Map::drawLine(const tf2::Vector3 &p0, const tf2::Vector3 &p1)
 {
+    if (!output) {
+        return;
+    }
+
     static int lid = 60000;
     visualization_msgs::Marker line;
     line.type = visualization_msgs::Marker::LINE_LIST;
@@ -852,19 +1404,306 @@ void Map::drawLine(const tf2::Vector3 &p0, const tf2::Vector3 &p1)
     line.points.push_back(gp0);
     line.points.push_back(gp1);
 
-    markerPub.publish(line);
+    output->publishMarker(line);
 }
 
-// Service to clear the map and enable auto initialization
+// Clear the map and enable auto initialization
 
-bool Map::clearCallback(std_srvs::Empty::Request &req,
-                         std_srvs::Empty::Response &res)
+void Map::clear()
 {
-    ROS_INFO("Clearing fiducial map from service call");
+    ROS_INFO("Clearing fiducial map");
 
     fiducials.clear();
     initialFrameNum = frameNum;
     originFid = -1;
+    havePose = false;
+    haveDeferredUpdate = false;
+    if (smoother) {
+        smoother->reset();
+    }
+}
+
 
+// Build a map from a set of map entries, this runs in a background thread
+
+static map<int, Fiducial> buildMap(const vector<fiducial_msgs::FiducialMapEntry> entries,
+                                   const string mapFrame, const ros::Time now)
+{
+    map<int, Fiducial> fiducials;
+
+    for (const fiducial_msgs::FiducialMapEntry &fme : entries) {
+        tf2::Vector3 tvec(fme.x, fme.y, fme.z);
+        tf2::Quaternion q;
+        q.setRPY(fme.rx, fme.ry, fme.rz);
+
+        // Map entries do not carry a variance, so they are treated as
+        // surveyed positions, which are not updated by observations
+        auto twv = TransformWithVariance(tvec, q, 0.0);
+        Fiducial f = Fiducial(fme.fiducial_id,
+                              tf2::Stamped<TransformWithVariance>(twv, now, mapFrame));
+        f.numObs = 1;
+        fiducials[fme.fiducial_id] = f;
+    }
+
+    return fiducials;
+}
+
+
+// Replace the map with the one supplied
+
+bool Map::initialize(const vector<fiducial_msgs::FiducialMapEntry> &entries)
+{
+    if (pendingMap.valid()) {
+        ROS_WARN("Map initialization already in progress");
+        return false;
+    }
+
+    ROS_INFO("Initializing map with %d fiducials", (int)entries.size());
+
+    pendingMap = std::async(std::launch::async, buildMap, entries, mapFrame, clock());
     return true;
 }
+
+
+// Swap in a map built by initialize
+
+void Map::installPendingMap()
+{
+    map<int, Fiducial> newMap = pendingMap.get();
+
+    if (isLoadingMap) {
+        ROS_INFO("Map loaded in %.3f s", (ros::WallTime::now() - loadStarted).toSec());
+        isLoadingMap = false;
+        std::atomic_store(&loadedPoses,
+            std::shared_ptr<const vector<pair<int, TransformWithVariance>>>());
+    }
+
+    ROS_INFO("Installing new map with %d fiducials", (int)newMap.size());
+
+    // A compaction in progress refers to the old map
+    if (pendingCompaction.valid()) {
+        pendingCompaction.get();
+    }
+
+    fiducials.swap(newMap);
+    isInitializingMap = false;
+    initialFrameNum = frameNum;
+    originFid = -1;
+    havePose = false;
+    haveDeferredUpdate = false;
+    if (smoother) {
+        smoother->reset();
+    }
+
+    // newMap now holds the old fiducials, free them without blocking
+    std::thread([](map<int, Fiducial> old) {}, std::move(newMap)).detach();
+
+    if (output) {
+        visualization_msgs::Marker marker;
+        marker.action = visualization_msgs::Marker::DELETEALL;
+        output->publishMarker(marker);
+    }
+    publishMarkers();
+}
+
+
+// Approximate memory used by a fiducial, including the overhead of
+// the map node that holds it and the array of its links
+
+static size_t fiducialBytes(const Fiducial &f)
+{
+    return sizeof(pair<const int, Fiducial>) + treeNodeOverhead +
+           f.links.capacity() * sizeof(Link);
+}
+
+size_t Map::memoryUsage() const
+{
+    size_t bytes = 0;
+    for (const auto &it : fiducials) {
+        bytes += fiducialBytes(it.second);
+    }
+    return bytes;
+}
+
+
+// Choose fiducials to remove from the map, this runs in a background thread
+
+vector<int> selectForCompaction(const vector<CompactionCandidate> candidates,
+                                size_t protectedBytes,
+                                const CompactionParams params,
+                                double now)
+{
+    vector<int> remove;
+    vector<CompactionCandidate> keep;
+    size_t bytes = protectedBytes;
+
+    for (const CompactionCandidate &c : candidates) {
+        double age = now - c.lastSeen;
+
+        // Loaded from the map file and not seen since, so its age is
+        // unknown and only the memory budget applies
+        if (c.lastSeen == 0.0) {
+            keep.push_back(c);
+            bytes += c.bytes;
+        }
+        else if (params.maxAge > 0 && age > params.maxAge) {
+            remove.push_back(c.id);
+        }
+        else if (age > params.gracePeriod &&
+                 (c.numObs < params.minObs ||
+                  (params.maxVariance > 0 && c.variance > params.maxVariance))) {
+            remove.push_back(c.id);
+        }
+        else {
+            keep.push_back(c);
+            bytes += c.bytes;
+        }
+    }
+
+    if (params.memoryBudget > 0 && bytes > params.memoryBudget) {
+        // Over budget, remove the fiducials with the fewest observations,
+        // and then the ones that were seen least recently
+        sort(keep.begin(), keep.end(),
+             [](const CompactionCandidate &a, const CompactionCandidate &b) {
+                 if (a.numObs != b.numObs) {
+                     return a.numObs < b.numObs;
+                 }
+                 return a.lastSeen < b.lastSeen;
+             });
+
+        for (const CompactionCandidate &c : keep) {
+            if (bytes <= params.memoryBudget) {
+                break;
+            }
+            remove.push_back(c.id);
+            bytes -= c.bytes;
+        }
+    }
+
+    return remove;
+}
+
+
+// Save removed fiducials to the archive file and release their memory,
+// and that of the nodes of the map they were removed from. This runs in a
+// background thread
+
+static void archiveFiducials(vector<Fiducial> removed, map<int, Fiducial> oldMap,
+                             const string filename)
+{
+    if (!filename.empty()) {
+        vector<MapEntry> entries;
+        entries.reserve(removed.size());
+        for (const Fiducial &f : removed) {
+            entries.push_back(toMapEntry(f));
+        }
+        if (!appendMapFile(filename, entries)) {
+            ROS_WARN("Could not write map archive %s", filename.c_str());
+        }
+    }
+
+    removed.clear();
+    removed.shrink_to_fit();
+    oldMap.clear();
+
+#ifdef __GLIBC__
+    // Return freed memory to the operating system
+    malloc_trim(0);
+#endif
+}
+
+
+// Start selecting fiducials to remove from the map in the background
+
+void Map::startCompaction(const ros::Time &time)
+{
+    vector<CompactionCandidate> candidates;
+    candidates.reserve(fiducials.size());
+    size_t protectedBytes = 0;
+
+    for (const auto &it : fiducials) {
+        const Fiducial &f = it.second;
+        size_t bytes = fiducialBytes(f);
+
+        // Never remove fixed fiducials, the origin or any that are in view
+        if (f.pose.variance == 0.0 || f.id == originFid || f.visible) {
+            protectedBytes += bytes;
+            continue;
+        }
+
+        CompactionCandidate c;
+        c.id = f.id;
+        c.numObs = f.numObs;
+        c.variance = f.pose.variance;
+        c.lastSeen = f.lastSeen.toSec();
+        c.bytes = bytes;
+        candidates.push_back(c);
+    }
+
+    lastCompaction = time;
+    pendingCompaction = std::async(std::launch::async, selectForCompaction,
+                                   std::move(candidates), protectedBytes,
+                                   compactionParams, time.toSec());
+}
+
+
+// Remove the fiducials selected by the background compaction
+
+void Map::finishCompaction()
+{
+    vector<int> ids = pendingCompaction.get();
+    if (ids.empty()) {
+        return;
+    }
+
+    vector<Fiducial> removed;
+    removed.reserve(ids.size());
+
+    for (int id : ids) {
+        map<int, Fiducial>::iterator it = fiducials.find(id);
+
+        // Keep fiducials that have been seen since compaction started
+        if (it == fiducials.end() || it->second.lastSeen >= lastCompaction) {
+            continue;
+        }
+        removed.push_back(std::move(it->second));
+        fiducials.erase(it);
+    }
+
+    if (removed.empty()) {
+        return;
+    }
+
+    set<int> unlinked;
+    for (const Fiducial &f : removed) {
+        for (const Link &link : f.links) {
+            map<int, Fiducial>::iterator it = fiducials.find(link.id);
+            if (it != fiducials.end()) {
+                it->second.removeLink(f.id);
+                unlinked.insert(link.id);
+            }
+        }
+        deleteMarker(f.id);
+    }
+
+    // Rebuild the map so that the nodes of the remaining fiducials are
+    // allocated together rather than among the holes left by the removed
+    // ones, and trim the arrays of links that have shrunk. The old nodes
+    // are freed in the background
+    map<int, Fiducial> oldMap;
+    oldMap.swap(fiducials);
+    for (auto &it : oldMap) {
+        map<int, Fiducial>::iterator added =
+            fiducials.emplace_hint(fiducials.end(), it.first, std::move(it.second));
+        if (unlinked.count(it.first)) {
+            added->second.links.shrink_to_fit();
+        }
+    }
+
+    ROS_INFO("Map compaction removed %d fiducials, map has %d fiducials using %d kB",
+             (int)removed.size(), (int)fiducials.size(), (int)(memoryUsage() / 1024));
+
+    compactionCleanup = std::async(std::launch::async, archiveFiducials,
+                                   std::move(removed), std::move(oldMap),
+                                   archiveFilename);
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/map_file.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static const char binaryMagic[4] = {'F', 'M', 'A', 'P'};
+static const uint32_t binaryVersion = 1;
+
+static const char *csvHeader = "id,x,y,z,roll,pitch,yaw,variance,num_obs,links";
+
+// Progress is first reported after this many entries, and then each time
+// the number read doubles, so that a caller copying the entries read so
+// far does linear work overall
+static const size_t progressChunk = 4096;
+
+
+// Choose the file format from the extension of filename
+
+MapFormat mapFormatFromFilename(const std::string &filename)
+{
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) {
+        return MAP_FORMAT_TEXT;
+    }
+
+    std::string ext = filename.substr(dot);
+    if (ext == ".csv") {
+        return MAP_FORMAT_CSV;
+    }
+    if (ext == ".fmap") {
+        return MAP_FORMAT_BINARY;
+    }
+    return MAP_FORMAT_TEXT;
+}
+
+
+// Read a whole file into memory
+
+static bool readFile(const std::string &filename, std::string &contents)
+{
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    contents.clear();
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        contents.append(buf, n);
+    }
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+
+// Skip white space and at most one field separator
+
+static const char *skipSeparator(const char *p, char sep)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    if (sep != ' ' && *p == sep) {
+        p++;
+        while (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        }
+    }
+    return p;
+}
+
+static bool parseInt(const char *&p, char sep, int &value)
+{
+    const char *start = skipSeparator(p, sep);
+    char *end;
+    long v = strtol(start, &end, 10);
+    if (end == start) {
+        return false;
+    }
+    value = (int)v;
+    p = end;
+    return true;
+}
+
+static bool parseDouble(const char *&p, char sep, double &value)
+{
+    const char *start = skipSeparator(p, sep);
+    char *end;
+    double v = strtod(start, &end);
+    if (end == start) {
+        return false;
+    }
+    value = v;
+    p = end;
+    return true;
+}
+
+
+// Parse one line of the text or CSV formats:
+// id x y z roll pitch yaw variance numObs [link ...]
+// In the CSV format the links are space separated within the last field
+
+static bool parseLine(const char *line, char sep, MapEntry &e)
+{
+    const char *p = line;
+
+    if (!parseInt(p, sep, e.id) ||
+        !parseDouble(p, sep, e.tx) ||
+        !parseDouble(p, sep, e.ty) ||
+        !parseDouble(p, sep, e.tz) ||
+        !parseDouble(p, sep, e.rx) ||
+        !parseDouble(p, sep, e.ry) ||
+        !parseDouble(p, sep, e.rz) ||
+        !parseDouble(p, sep, e.variance) ||
+        !parseInt(p, sep, e.numObs)) {
+        return false;
+    }
+
+    e.links.clear();
+    if (sep != ' ') {
+        p = skipSeparator(p, sep);
+    }
+
+    int link;
+    while (parseInt(p, ' ', link)) {
+        e.links.push_back(link);
+    }
+
+    return true;
+}
+
+
+static bool loadTextMap(const std::string &filename, char sep,
+                        std::vector<MapEntry> &entries,
+                        std::vector<std::string> *invalidLines,
+                        const MapLoadProgress &progress)
+{
+    std::string contents;
+    if (!readFile(filename, contents)) {
+        return false;
+    }
+
+    char *line = &contents[0];
+    char *end = line + contents.size();
+    bool first = true;
+    size_t nextProgress = entries.size() + progressChunk;
+
+    while (line < end) {
+        char *nl = (char *)memchr(line, '\n', end - line);
+        if (nl == NULL) {
+            nl = end;
+        }
+        *nl = '\0';
+
+        // Skip the CSV header
+        if (first && sep == ',' && strncmp(line, "id,", 3) == 0) {
+            line = nl + 1;
+            first = false;
+            continue;
+        }
+        first = false;
+
+        MapEntry e;
+        if (parseLine(line, sep, e)) {
+            entries.push_back(e);
+            if (progress && entries.size() >= nextProgress) {
+                progress(entries);
+                nextProgress = 2 * entries.size();
+            }
+        }
+        else if (invalidLines != nullptr) {
+            invalidLines->push_back(line);
+        }
+
+        line = nl + 1;
+    }
+
+    return true;
+}
+
+
+static bool saveTextMap(const std::string &filename, char sep,
+                        const std::vector<MapEntry> &entries,
+                        bool append = false)
+{
+    FILE *fp = fopen(filename.c_str(), append ? "a" : "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    // Use a large buffer, as maps can have many thousands of entries
+    char buf[1 << 16];
+    setvbuf(fp, buf, _IOFBF, sizeof(buf));
+
+    const char *fmt = "%d %lf %lf %lf %lf %lf %lf %lf %d";
+    if (sep == ',') {
+        // Only new files get a header
+        fseek(fp, 0, SEEK_END);
+        if (ftell(fp) == 0) {
+            fprintf(fp, "%s\n", csvHeader);
+        }
+        fmt = "%d,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%d,";
+    }
+
+    for (const MapEntry &e : entries) {
+        fprintf(fp, fmt, e.id, e.tx, e.ty, e.tz, e.rx, e.ry, e.rz,
+                e.variance, e.numObs);
+
+        for (size_t i=0; i<e.links.size(); i++) {
+            if (sep == ',' && i == 0) {
+                fprintf(fp, "%d", e.links[i]);
+            }
+            else {
+                fprintf(fp, " %d", e.links[i]);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+
+// Binary format, all values in host byte order:
+//   "FMAP" version:u32 count:u32
+//   count * { id:i32 x y z roll pitch yaw variance:f64 numObs:i32
+//             numLinks:u32 links:i32[numLinks] }
+
+template<typename T>
+static void put(std::string &buf, const T &value)
+{
+    buf.append((const char *)&value, sizeof(T));
+}
+
+template<typename T>
+static bool get(const char *&p, const char *end, T &value)
+{
+    if (end - p < (ptrdiff_t)sizeof(T)) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+static bool loadBinaryMap(const std::string &filename,
+                          std::vector<MapEntry> &entries,
+                          const MapLoadProgress &progress = nullptr)
+{
+    std::string contents;
+    if (!readFile(filename, contents)) {
+        return false;
+    }
+
+    const char *p = contents.data();
+    const char *end = p + contents.size();
+
+    char magic[4];
+    uint32_t version, count;
+    if (!get(p, end, magic) || memcmp(magic, binaryMagic, 4) != 0 ||
+        !get(p, end, version) || version != binaryVersion ||
+        !get(p, end, count)) {
+        return false;
+    }
+
+    // Every entry takes at least this many bytes, so a corrupt count is
+    // found before memory is reserved for it
+    const size_t minEntrySize = 2 * sizeof(int32_t) + 7 * sizeof(double) +
+                                sizeof(uint32_t);
+    if (count > (size_t)(end - p) / minEntrySize) {
+        return false;
+    }
+    entries.reserve(entries.size() + count);
+    size_t nextProgress = entries.size() + progressChunk;
+
+    for (uint32_t i=0; i<count; i++) {
+        MapEntry e;
+        int32_t id, numObs;
+        uint32_t numLinks;
+
+        if (!get(p, end, id) ||
+            !get(p, end, e.tx) || !get(p, end, e.ty) || !get(p, end, e.tz) ||
+            !get(p, end, e.rx) || !get(p, end, e.ry) || !get(p, end, e.rz) ||
+            !get(p, end, e.variance) || !get(p, end, numObs) ||
+            !get(p, end, numLinks) ||
+            (size_t)(end - p) < numLinks * sizeof(int32_t)) {
+            return false;
+        }
+        e.id = id;
+        e.numObs = numObs;
+
+        e.links.resize(numLinks);
+        for (uint32_t j=0; j<numLinks; j++) {
+            int32_t link;
+            get(p, end, link);
+            e.links[j] = link;
+        }
+        entries.push_back(e);
+        if (progress && entries.size() >= nextProgress) {
+            progress(entries);
+            nextProgress = 2 * entries.size();
+        }
+    }
+
+    return true;
+}
+
+static bool saveBinaryMap(const std::string &filename,
+                          const std::vector<MapEntry> &entries)
+{
+    std::string buf;
+    buf.append(binaryMagic, 4);
+    put(buf, binaryVersion);
+    put(buf, (uint32_t)entries.size());
+
+    for (const MapEntry &e : entries) {
+        put(buf, (int32_t)e.id);
+        put(buf, e.tx);
+        put(buf, e.ty);
+        put(buf, e.tz);
+        put(buf, e.rx);
+        put(buf, e.ry);
+        put(buf, e.rz);
+        put(buf, e.variance);
+        put(buf, (int32_t)e.numObs);
+        put(buf, (uint32_t)e.links.size());
+        for (int link : e.links) {
+            put(buf, (int32_t)link);
+        }
+    }
+
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+
+bool loadMapFile(const std::string &filename, std::vector<MapEntry> &entries,
+                 std::vector<std::string> *invalidLines,
+                 const MapLoadProgress &progress)
+{
+    switch (mapFormatFromFilename(filename)) {
+        case MAP_FORMAT_BINARY:
+            return loadBinaryMap(filename, entries, progress);
+        case MAP_FORMAT_CSV:
+            return loadTextMap(filename, ',', entries, invalidLines, progress);
+        default:
+            return loadTextMap(filename, ' ', entries, invalidLines, progress);
+    }
+}
+
+
+bool saveMapFile(const std::string &filename,
+                 const std::vector<MapEntry> &entries)
+{
+    switch (mapFormatFromFilename(filename)) {
+        case MAP_FORMAT_BINARY:
+            return saveBinaryMap(filename, entries);
+        case MAP_FORMAT_CSV:
+            return saveTextMap(filename, ',', entries);
+        default:
+            return saveTextMap(filename, ' ', entries);
+    }
+}
+
+
+bool appendMapFile(const std::string &filename,
+                   const std::vector<MapEntry> &entries)
+{
+    switch (mapFormatFromFilename(filename)) {
+        case MAP_FORMAT_BINARY: {
+            // The binary format has a count in its header, so is rewritten.
+            // A file that exists but cannot be read is left alone
+            std::vector<MapEntry> all;
+            FILE *fp = fopen(filename.c_str(), "rb");
+            if (fp != NULL) {
+                fclose(fp);
+                if (!loadBinaryMap(filename, all)) {
+                    return false;
+                }
+            }
+            all.insert(all.end(), entries.begin(), entries.end());
+            return saveBinaryMap(filename, all);
+        }
+        case MAP_FORMAT_CSV:
+            return saveTextMap(filename, ',', entries, true);
+        default:
+            return saveTextMap(filename, ' ', entries, true);
+    }
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/map_node.h>
+#include <fiducial_slam/smoother.h>
+#include <fiducial_slam/helpers.h>
+
+#include <boost/filesystem.hpp>
+
+#include <string>
+
+
+// Constructor for the ROS interface of a map, which sets up the map from
+// the parameters and loads it
+
+MapNode::MapNode(ros::NodeHandle &nh, Map &map) : map(map)
+{
+    posePub = ros::Publisher(
+          nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("/fiducial_pose", 1));
+    markerPub = ros::Publisher(
+          nh.advertise<visualization_msgs::Marker>("/fiducials", 100));
+    mapPub = ros::Publisher(
+          nh.advertise<fiducial_msgs::FiducialMapEntryArray>("/fiducial_map",
+          1));
+
+    clearSrv = nh.advertiseService("clear_map", &MapNode::clearCallback, this);
+    initializeSrv = nh.advertiseService("initialize_map",
+                                        &MapNode::initializeMapCallback, this);
+
+    nh.param<std::string>("map_frame", map.mapFrame, "map");
+    nh.param<std::string>("odom_frame", map.odomFrame, "odom");
+    nh.param<std::string>("base_frame", map.baseFrame, "base_link");
+
+    nh.param<double>("future_date_transforms", map.future_date_transforms, 0.1);
+    nh.param<bool>("publish_6dof_pose", map.publish_6dof_pose, false);
+
+    // threshold of object error for using multi-fidicial pose
+    // set -ve to never use
+    nh.param<double>("multi_error_theshold", map.multiErrorThreshold, 0.1);
+
+    nh.param<std::string>("map_file", map.mapFilename,
+        string(getenv("HOME")) + "/.ros/slam/map.txt");
+
+    boost::filesystem::path mapPath(map.mapFilename);
+    boost::filesystem::path dir = mapPath.parent_path();
+    boost::filesystem::create_directories(dir);
+
+    std::string initialMap;
+    nh.param<std::string>("initial_map_file", initialMap, "");
+
+    // Map compaction, disabled unless compact_interval is set
+    CompactionParams &compaction = map.compactionParams;
+    nh.param<double>("compact_interval", map.compactInterval, 0.0);
+    nh.param<int>("compact_min_obs", compaction.minObs, 3);
+    nh.param<double>("compact_max_variance", compaction.maxVariance, 1.0);
+    nh.param<double>("compact_grace_period", compaction.gracePeriod, 600.0);
+    nh.param<double>("compact_max_age", compaction.maxAge, 0.0);
+
+    double memoryBudget;
+    nh.param<double>("compact_memory_budget", memoryBudget, 0.0);
+    compaction.memoryBudget = memoryBudget * 1024 * 1024;
+
+    nh.param<std::string>("map_archive_file", map.archiveFilename,
+                          map.mapFilename + ".archive");
+
+    // Smoothing of the robot pose over the last smoother_window frames,
+    // disabled if it is less than 2
+    int smootherWindow;
+    double motionVariance, odomVariance, maxGap;
+    nh.param<int>("smoother_window", smootherWindow, 0);
+    nh.param<double>("smoother_motion_variance", motionVariance, 0.5);
+    nh.param<double>("smoother_odom_variance", odomVariance, 0.01);
+    nh.param<double>("smoother_max_gap", maxGap, 1.0);
+    if (smootherWindow > 1) {
+        map.smoother = make_unique<PoseSmoother>(smootherWindow, motionVariance,
+                                                 odomVariance, maxGap);
+    }
+
+    // With fast_start, the map is loaded in the background while the
+    // node localizes from single fiducials
+    bool fastStart;
+    nh.param<bool>("fast_start", fastStart, false);
+
+    listener = make_unique<tf2_ros::TransformListener>(map.tfBuffer);
+    map.output = this;
+    map.clock = []() { return ros::Time::now(); };
+
+    const string &filename = initialMap.empty() ? map.mapFilename : initialMap;
+    if (fastStart) {
+        map.loadMapAsync(filename);
+    }
+    else {
+        map.loadMap(filename);
+        map.publishMarkers();
+    }
+}
+
+
+MapNode::~MapNode()
+{
+    map.output = nullptr;
+}
+
+
+void MapNode::publishPose(const geometry_msgs::PoseWithCovarianceStamped &pose)
+{
+    poseTime = ros::Time::now();
+    posePub.publish(pose);
+}
+
+
+void MapNode::publishTransforms(const vector<geometry_msgs::TransformStamped> &transforms)
+{
+    broadcaster.sendTransform(transforms);
+
+    if (!transforms.empty() && transforms[0].header.frame_id == map.mapFrame) {
+        transformTime = ros::Time::now();
+    }
+}
+
+
+void MapNode::publishMap(const fiducial_msgs::FiducialMapEntryArray &fmea)
+{
+    mapPub.publish(fmea);
+}
+
+
+void MapNode::publishMarker(const visualization_msgs::Marker &marker)
+{
+    markerPub.publish(marker);
+}
+
+
+// Service to clear the map and enable auto initialization
+
+bool MapNode::clearCallback(std_srvs::Empty::Request &req,
+                            std_srvs::Empty::Response &res)
+{
+    ROS_INFO("Clearing fiducial map from service call");
+
+    map.clear();
+    return true;
+}
+
+
+// Service to replace the map with the one supplied. The new map is built
+// in the background and swapped in at the start of the next update
+
+bool MapNode::initializeMapCallback(fiducial_msgs::InitializeMap::Request &req,
+                                    fiducial_msgs::InitializeMap::Response &res)
+{
+    ROS_INFO("Initializing map from service call");
+
+    return map.initialize(req.fiducials.fiducials);
+}
@@ -0,0 +1,764 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+/*
+ * fiducial_map_tool: command line utility to manipulate map files
+ * created by fiducial_slam. Run without arguments for usage.
+ */
+
+#include <fiducial_slam/map_file.h>
+#include <fiducial_slam/helpers.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2/LinearMath/Matrix3x3.h>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+"Usage: %s command [arguments]\n"
+"\n"
+"Commands:\n"
+"  init fiducial_id out_map\n"
+"      create a map with a single ceiling fiducial at the origin\n"
+"  transform in_map out_map x y z [roll pitch yaw]\n"
+"      apply a rigid transform to every fiducial, angles in degrees\n"
+"  reorigin in_map out_map fiducial_id [x y z roll pitch yaw]\n"
+"      move the map so that the fiducial is at the given pose. By default\n"
+"      the fiducial is moved to the origin keeping its orientation\n"
+"  subset in_map out_map [--ids list] [--box xmin ymin zmin xmax ymax zmax]\n"
+"      keep fiducials with ids in list (eg 1,5,100-199) and/or inside box\n"
+"  stats map\n"
+"      print statistics about a map\n"
+"  validate map\n"
+"      check a map for errors, exits with non zero status if any are found\n"
+"  diff map_a map_b [position_tolerance [angle_tolerance]]\n"
+"      compare two maps, tolerances in meters and degrees\n"
+"  convert in_map out_map\n"
+"      convert between formats\n"
+"  merge in_map in_map [in_map ...] out_map\n"
+"      combine maps, such as a map and its compaction archive. Fiducials\n"
+"      in more than one map are taken from the first\n"
+"\n"
+"The format of a map is determined by its extension: .csv for comma\n"
+"separated text, .fmap for binary, anything else for the text format\n"
+"used by fiducial_slam.\n", prog);
+}
+
+
+// Time since start in milliseconds
+
+static double elapsedMs(const chrono::steady_clock::time_point &start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+
+static bool loadMap(const string &filename, vector<MapEntry> &entries)
+{
+    vector<string> invalidLines;
+
+    if (!loadMapFile(filename, entries, &invalidLines)) {
+        fprintf(stderr, "Could not read map %s\n", filename.c_str());
+        return false;
+    }
+
+    for (const string &line : invalidLines) {
+        fprintf(stderr, "Invalid line: %s\n", line.c_str());
+    }
+    return true;
+}
+
+
+static bool saveMap(const string &filename, const vector<MapEntry> &entries)
+{
+    if (!saveMapFile(filename, entries)) {
+        fprintf(stderr, "Could not write map %s\n", filename.c_str());
+        return false;
+    }
+
+    printf("Wrote %d fiducials to %s\n", (int)entries.size(), filename.c_str());
+    return true;
+}
+
+
+static bool parseDouble(const char *s, double &value)
+{
+    char *end;
+    value = strtod(s, &end);
+    return end != s && *end == '\0';
+}
+
+static bool parseInt(const char *s, int &value)
+{
+    char *end;
+    value = (int)strtol(s, &end, 10);
+    return end != s && *end == '\0';
+}
+
+static bool parseDoubles(char **args, int n, double *values)
+{
+    for (int i=0; i<n; i++) {
+        if (!parseDouble(args[i], values[i])) {
+            fprintf(stderr, "Invalid number: %s\n", args[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Parse a list of ids and id ranges, such as 1,5,100-199
+
+static bool parseIdList(const char *s, vector<pair<int, int>> &ranges)
+{
+    const char *p = s;
+
+    while (*p) {
+        char *end;
+        int lo = (int)strtol(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        int hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = (int)strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+            p = end;
+        }
+        ranges.push_back(make_pair(lo, hi));
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static tf2::Transform entryTransform(const MapEntry &e)
+{
+    tf2::Quaternion q;
+    q.setRPY(deg2rad(e.rx), deg2rad(e.ry), deg2rad(e.rz));
+    return tf2::Transform(q, tf2::Vector3(e.tx, e.ty, e.tz));
+}
+
+static void setEntryTransform(MapEntry &e, const tf2::Transform &T)
+{
+    const tf2::Vector3 &t = T.getOrigin();
+    e.tx = t.x();
+    e.ty = t.y();
+    e.tz = t.z();
+
+    double rx, ry, rz;
+    T.getBasis().getRPY(rx, ry, rz);
+    e.rx = rad2deg(rx);
+    e.ry = rad2deg(ry);
+    e.rz = rad2deg(rz);
+}
+
+// Transform from x y z roll pitch yaw, with angles in degrees
+static tf2::Transform makeTransform(const double *v)
+{
+    tf2::Quaternion q;
+    q.setRPY(deg2rad(v[3]), deg2rad(v[4]), deg2rad(v[5]));
+    return tf2::Transform(q, tf2::Vector3(v[0], v[1], v[2]));
+}
+
+// Apply T to every fiducial in the map
+static void transformMap(vector<MapEntry> &entries, const tf2::Transform &T)
+{
+    for (MapEntry &e : entries) {
+        setEntryTransform(e, T * entryTransform(e));
+    }
+}
+
+
+static const MapEntry *findEntry(const vector<MapEntry> &entries, int id)
+{
+    for (const MapEntry &e : entries) {
+        if (e.id == id) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+
+// Sorted list of ids in the map, for fast lookups
+
+static vector<int> sortedIds(const vector<MapEntry> &entries)
+{
+    vector<int> ids;
+    ids.reserve(entries.size());
+    for (const MapEntry &e : entries) {
+        ids.push_back(e.id);
+    }
+    sort(ids.begin(), ids.end());
+    return ids;
+}
+
+
+static int cmdInit(int argc, char **argv)
+{
+    int fid;
+    if (argc != 2 || !parseInt(argv[0], fid)) {
+        return -1;
+    }
+    string filename = argv[1];
+
+    boost::filesystem::path mapPath(filename);
+    if (boost::filesystem::exists(mapPath)) {
+        fprintf(stderr, "File %s already exists, remove or rename it first\n",
+                filename.c_str());
+        return 1;
+    }
+    boost::filesystem::path dir = mapPath.parent_path();
+    if (!dir.empty()) {
+        boost::filesystem::create_directories(dir);
+    }
+
+    // A ceiling fiducial, rotated so that it is in the co-ordinate
+    // system of the floor
+    MapEntry e;
+    e.id = fid;
+    e.tx = e.ty = e.tz = 0.0;
+    e.rx = 180.0;
+    e.ry = 0.0;
+    e.rz = 180.0;
+    e.variance = 0.0;
+    e.numObs = 1;
+
+    return saveMap(filename, vector<MapEntry>(1, e)) ? 0 : 1;
+}
+
+
+static int cmdTransform(int argc, char **argv)
+{
+    if (argc != 5 && argc != 8) {
+        return -1;
+    }
+
+    double v[6] = {0, 0, 0, 0, 0, 0};
+    if (!parseDoubles(argv + 2, argc - 2, v)) {
+        return 1;
+    }
+
+    vector<MapEntry> entries;
+    if (!loadMap(argv[0], entries)) {
+        return 1;
+    }
+
+    transformMap(entries, makeTransform(v));
+
+    return saveMap(argv[1], entries) ? 0 : 1;
+}
+
+
+static int cmdReorigin(int argc, char **argv)
+{
+    int fid;
+    if ((argc != 3 && argc != 9) || !parseInt(argv[2], fid)) {
+        return -1;
+    }
+
+    vector<MapEntry> entries;
+    if (!loadMap(argv[0], entries)) {
+        return 1;
+    }
+
+    const MapEntry *origin = findEntry(entries, fid);
+    if (origin == nullptr) {
+        fprintf(stderr, "Fiducial %d is not in the map\n", fid);
+        return 1;
+    }
+
+    tf2::Transform T_mapFid = entryTransform(*origin);
+
+    // Pose that the fiducial should end up at
+    tf2::Transform target;
+    if (argc == 9) {
+        double v[6];
+        if (!parseDoubles(argv + 3, 6, v)) {
+            return 1;
+        }
+        target = makeTransform(v);
+    }
+    else {
+        target = tf2::Transform(T_mapFid.getRotation(), tf2::Vector3(0, 0, 0));
+    }
+
+    transformMap(entries, target * T_mapFid.inverse());
+
+    return saveMap(argv[1], entries) ? 0 : 1;
+}
+
+
+static int cmdSubset(int argc, char **argv)
+{
+    if (argc < 2) {
+        return -1;
+    }
+
+    vector<pair<int, int>> ranges;
+    bool haveBox = false;
+    double box[6];
+
+    for (int i=2; i<argc; i++) {
+        if (strcmp(argv[i], "--ids") == 0 && i + 1 < argc) {
+            if (!parseIdList(argv[++i], ranges)) {
+                fprintf(stderr, "Invalid id list: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--box") == 0 && i + 6 < argc) {
+            if (!parseDoubles(argv + i + 1, 6, box)) {
+                return 1;
+            }
+            haveBox = true;
+            i += 6;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    vector<MapEntry> entries;
+    if (!loadMap(argv[0], entries)) {
+        return 1;
+    }
+
+    vector<MapEntry> out;
+    for (const MapEntry &e : entries) {
+        if (!ranges.empty()) {
+            bool match = false;
+            for (const auto &r : ranges) {
+                if (e.id >= r.first && e.id <= r.second) {
+                    match = true;
+                    break;
+                }
+            }
+            if (!match) {
+                continue;
+            }
+        }
+        if (haveBox) {
+            if (e.tx < box[0] || e.ty < box[1] || e.tz < box[2] ||
+                e.tx > box[3] || e.ty > box[4] || e.tz > box[5]) {
+                continue;
+            }
+        }
+        out.push_back(e);
+    }
+
+    // Drop links to fiducials that are no longer in the map
+    vector<int> ids = sortedIds(out);
+    for (MapEntry &e : out) {
+        auto last = remove_if(e.links.begin(), e.links.end(), [&ids](int id) {
+            return !binary_search(ids.begin(), ids.end(), id);
+        });
+        e.links.erase(last, e.links.end());
+    }
+
+    return saveMap(argv[1], out) ? 0 : 1;
+}
+
+
+static int cmdStats(int argc, char **argv)
+{
+    if (argc != 1) {
+        return -1;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    vector<MapEntry> entries;
+    if (!loadMap(argv[0], entries)) {
+        return 1;
+    }
+    double loadTime = elapsedMs(start);
+
+    printf("Map %s\n", argv[0]);
+    printf("  fiducials    %d\n", (int)entries.size());
+    printf("  load time    %.2f ms\n", loadTime);
+
+    if (entries.empty()) {
+        return 0;
+    }
+
+    double minPos[3], maxPos[3];
+    double minVar = entries[0].variance, maxVar = minVar, sumVar = 0;
+    int minObs = entries[0].numObs, maxObs = minObs;
+    long sumObs = 0, numLinks = 0;
+    int minId = entries[0].id, maxId = minId;
+    int numFixed = 0, numUnlinked = 0;
+
+    for (int i=0; i<3; i++) {
+        minPos[i] = HUGE_VAL;
+        maxPos[i] = -HUGE_VAL;
+    }
+
+    for (const MapEntry &e : entries) {
+        double pos[3] = {e.tx, e.ty, e.tz};
+        for (int i=0; i<3; i++) {
+            minPos[i] = min(minPos[i], pos[i]);
+            maxPos[i] = max(maxPos[i], pos[i]);
+        }
+        minId = min(minId, e.id);
+        maxId = max(maxId, e.id);
+        minVar = min(minVar, e.variance);
+        maxVar = max(maxVar, e.variance);
+        sumVar += e.variance;
+        minObs = min(minObs, e.numObs);
+        maxObs = max(maxObs, e.numObs);
+        sumObs += e.numObs;
+        numLinks += e.links.size();
+        if (e.variance == 0.0) {
+            numFixed++;
+        }
+        if (e.links.empty()) {
+            numUnlinked++;
+        }
+    }
+
+    int n = entries.size();
+    printf("  ids          %d - %d\n", minId, maxId);
+    printf("  x            %.3f - %.3f\n", minPos[0], maxPos[0]);
+    printf("  y            %.3f - %.3f\n", minPos[1], maxPos[1]);
+    printf("  z            %.3f - %.3f\n", minPos[2], maxPos[2]);
+    printf("  variance     min %g mean %g max %g\n", minVar, sumVar / n, maxVar);
+    printf("  observations min %d mean %.1f max %d\n", minObs,
+           (double)sumObs / n, maxObs);
+    printf("  fixed        %d\n", numFixed);
+    printf("  links        %ld (mean %.1f per fiducial)\n", numLinks,
+           (double)numLinks / n);
+    printf("  unlinked     %d\n", numUnlinked);
+
+    return 0;
+}
+
+
+// Maximum number of problems of each kind to print
+
+static const int maxReported = 10;
+
+static void report(int &count, const char *fmt, int a, int b = 0)
+{
+    if (count < maxReported) {
+        printf(fmt, a, b);
+    }
+    else if (count == maxReported) {
+        printf("  ...\n");
+    }
+    count++;
+}
+
+
+static int cmdValidate(int argc, char **argv)
+{
+    if (argc != 1) {
+        return -1;
+    }
+
+    vector<MapEntry> entries;
+    if (!loadMap(argv[0], entries)) {
+        return 1;
+    }
+
+    vector<int> ids = sortedIds(entries);
+
+    int numDuplicates = 0;
+    for (size_t i=1; i<ids.size(); i++) {
+        if (ids[i] == ids[i-1] && (i < 2 || ids[i] != ids[i-2])) {
+            report(numDuplicates, "  fiducial %d appears more than once\n", ids[i]);
+        }
+    }
+
+    // Lookup of entries by id, for checking link symmetry
+    vector<pair<int, int>> index;
+    index.reserve(entries.size());
+    for (size_t i=0; i<entries.size(); i++) {
+        index.push_back(make_pair(entries[i].id, (int)i));
+    }
+    sort(index.begin(), index.end());
+
+    int numInvalid = 0, numBadVariance = 0, numBadLinks = 0, numAsymmetric = 0;
+
+    for (const MapEntry &e : entries) {
+        double values[6] = {e.tx, e.ty, e.tz, e.rx, e.ry, e.rz};
+        for (int i=0; i<6; i++) {
+            if (!std::isfinite(values[i])) {
+                report(numInvalid, "  fiducial %d has an invalid pose\n", e.id);
+                break;
+            }
+        }
+
+        if (!std::isfinite(e.variance) || e.variance < 0) {
+            report(numBadVariance, "  fiducial %d has an invalid variance\n", e.id);
+        }
+
+        for (int link : e.links) {
+            auto it = lower_bound(index.begin(), index.end(), make_pair(link, 0));
+            if (link == e.id || it == index.end() || it->first != link) {
+                report(numBadLinks, "  fiducial %d has an invalid link to %d\n",
+                       e.id, link);
+                continue;
+            }
+            const vector<int> &other = entries[it->second].links;
+            if (find(other.begin(), other.end(), e.id) == other.end()) {
+                report(numAsymmetric, "  fiducial %d links to %d but not the reverse\n",
+                       e.id, link);
+            }
+        }
+    }
+
+    // Asymmetric links are tolerated, as fiducial_slam only adds links
+    // to fiducials that it updates
+    int numErrors = numDuplicates + numInvalid + numBadVariance + numBadLinks;
+
+    printf("Map %s: %d fiducials, %d errors, %d asymmetric links\n",
+           argv[0], (int)entries.size(), numErrors, numAsymmetric);
+
+    return numErrors == 0 ? 0 : 1;
+}
+
+
+static int cmdDiff(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        return -1;
+    }
+
+    double posTolerance = 0.001;
+    double angleTolerance = 0.1;
+    if ((argc > 2 && !parseDouble(argv[2], posTolerance)) ||
+        (argc > 3 && !parseDouble(argv[3], angleTolerance))) {
+        return -1;
+    }
+
+    vector<MapEntry> a, b;
+    if (!loadMap(argv[0], a) || !loadMap(argv[1], b)) {
+        return 1;
+    }
+
+    vector<pair<int, int>> index;
+    index.reserve(b.size());
+    for (size_t i=0; i<b.size(); i++) {
+        index.push_back(make_pair(b[i].id, (int)i));
+    }
+    sort(index.begin(), index.end());
+    vector<bool> matched(b.size(), false);
+
+    int numOnlyA = 0, numOnlyB = 0, numChanged = 0, numCommon = 0;
+    double maxPos = 0, maxAngle = 0, sumPos2 = 0;
+
+    for (const MapEntry &ea : a) {
+        auto it = lower_bound(index.begin(), index.end(), make_pair(ea.id, 0));
+        if (it == index.end() || it->first != ea.id) {
+            printf("< %d\n", ea.id);
+            numOnlyA++;
+            continue;
+        }
+        const MapEntry &eb = b[it->second];
+        matched[it->second] = true;
+        numCommon++;
+
+        tf2::Transform ta = entryTransform(ea);
+        tf2::Transform tb = entryTransform(eb);
+
+        double dpos = ta.getOrigin().distance(tb.getOrigin());
+        double dangle = rad2deg(ta.getRotation().angleShortestPath(tb.getRotation()));
+
+        maxPos = max(maxPos, dpos);
+        maxAngle = max(maxAngle, dangle);
+        sumPos2 += dpos * dpos;
+
+        if (dpos > posTolerance || dangle > angleTolerance) {
+            printf("~ %d moved %.4f m rotated %.3f deg\n", ea.id, dpos, dangle);
+            numChanged++;
+        }
+    }
+
+    for (size_t i=0; i<b.size(); i++) {
+        if (!matched[i]) {
+            printf("> %d\n", b[i].id);
+            numOnlyB++;
+        }
+    }
+
+    printf("%d common, %d changed, %d only in %s, %d only in %s\n",
+           numCommon, numChanged, numOnlyA, argv[0], numOnlyB, argv[1]);
+    if (numCommon > 0) {
+        printf("position difference rms %.4f m max %.4f m, "
+               "angle difference max %.3f deg\n",
+               sqrt(sumPos2 / numCommon), maxPos, maxAngle);
+    }
+
+    return (numOnlyA + numOnlyB + numChanged) == 0 ? 0 : 1;
+}
+
+
+static int cmdConvert(int argc, char **argv)
+{
+    if (argc != 2) {
+        return -1;
+    }
+
+    vector<MapEntry> entries;
+    if (!loadMap(argv[0], entries)) {
+        return 1;
+    }
+
+    return saveMap(argv[1], entries) ? 0 : 1;
+}
+
+
+// Combine maps, such as a map and the archive of fiducials removed from
+// it by compaction. A fiducial in more than one map is taken from the
+// first, and one that is in a map more than once, as in an archive it was
+// added to each time it was removed, from the last entry. Links to
+// fiducials that are not in the result are dropped
+
+static int cmdMerge(int argc, char **argv)
+{
+    if (argc < 3) {
+        return -1;
+    }
+
+    vector<MapEntry> out;
+
+    // For each id, its position in out and the map it came from
+    unordered_map<int, pair<size_t, int>> index;
+
+    for (int i=0; i<argc-1; i++) {
+        vector<MapEntry> entries;
+        if (!loadMap(argv[i], entries)) {
+            return 1;
+        }
+
+        for (const MapEntry &e : entries) {
+            auto it = index.find(e.id);
+            if (it == index.end()) {
+                index[e.id] = make_pair(out.size(), i);
+                out.push_back(e);
+            }
+            else if (it->second.second == i) {
+                out[it->second.first] = e;
+            }
+        }
+    }
+
+    for (MapEntry &e : out) {
+        vector<int> links;
+        for (int link : e.links) {
+            if (index.count(link) != 0) {
+                links.push_back(link);
+            }
+        }
+        e.links.swap(links);
+    }
+
+    return saveMap(argv[argc-1], out) ? 0 : 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    string cmd = argv[1];
+    int nargs = argc - 2;
+    char **args = argv + 2;
+    int rc;
+
+    if (cmd == "init") {
+        rc = cmdInit(nargs, args);
+    }
+    else if (cmd == "transform") {
+        rc = cmdTransform(nargs, args);
+    }
+    else if (cmd == "reorigin") {
+        rc = cmdReorigin(nargs, args);
+    }
+    else if (cmd == "subset") {
+        rc = cmdSubset(nargs, args);
+    }
+    else if (cmd == "stats") {
+        rc = cmdStats(nargs, args);
+    }
+    else if (cmd == "validate") {
+        rc = cmdValidate(nargs, args);
+    }
+    else if (cmd == "diff") {
+        rc = cmdDiff(nargs, args);
+    }
+    else if (cmd == "convert") {
+        rc = cmdConvert(nargs, args);
+    }
+    else if (cmd == "merge") {
+        rc = cmdMerge(nargs, args);
+    }
+    else {
+        rc = -1;
+    }
+
+    if (rc < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    return rc;
+}
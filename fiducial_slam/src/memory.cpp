@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/memory.h>
+#include <fiducial_common/memory.h>
+
+#include <tf2/transform_storage.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+using namespace std;
+
+// Fixed cost of each frame in a TF buffer: its cache, name and lookup
+// table entries
+static const size_t tfFrameOverhead = 128;
+
+size_t tfBufferBytes(const tf2::BufferCore &buffer)
+{
+    // allFramesAsYAML is the only public view of the caches. Each frame
+    // has a rate and buffer_length, whose product is roughly the number
+    // of transforms stored. Static frames have a buffer_length of 0
+    istringstream yaml(buffer.allFramesAsYAML());
+    const size_t transformBytes = sizeof(tf2::TransformStorage) + listNodeOverhead;
+
+    size_t bytes = 0;
+    double rate = 0.0;
+    string line;
+    while (getline(yaml, line)) {
+        size_t colon = line.find(':');
+        if (colon == string::npos) {
+            continue;
+        }
+
+        string key = line.substr(line.find_first_not_of(' '),
+                                 colon - line.find_first_not_of(' '));
+        double value = atof(line.c_str() + colon + 1);
+
+        if (key == "rate") {
+            rate = value;
+        }
+        else if (key == "buffer_length") {
+            bytes += tfFrameOverhead +
+                     (size_t)(rate * value + 1.0) * transformBytes;
+            rate = 0.0;
+        }
+    }
+
+    return bytes;
+}
+
+void MemoryAccounts::set(const string &name, size_t bytes)
+{
+    fiducial_msgs::MemoryUsage *account = NULL;
+    for (fiducial_msgs::MemoryUsage &a : accounts) {
+        if (a.name == name) {
+            account = &a;
+            break;
+        }
+    }
+
+    if (account == NULL) {
+        accounts.push_back(fiducial_msgs::MemoryUsage());
+        account = &accounts.back();
+        account->name = name;
+        account->peak = 0;
+    }
+
+    account->bytes = bytes;
+    if (account->bytes > account->peak) {
+        account->peak = account->bytes;
+    }
+
+    uint64_t total = 0;
+    for (const fiducial_msgs::MemoryUsage &a : accounts) {
+        total += a.bytes;
+    }
+    if (total > peakTotal) {
+        peakTotal = total;
+    }
+}
+
+void MemoryAccounts::fill(fiducial_msgs::MemoryStats &msg) const
+{
+    msg.subsystems = accounts;
+    msg.total = 0;
+    for (const fiducial_msgs::MemoryUsage &a : accounts) {
+        msg.total += a.bytes;
+    }
+    msg.peak_total = peakTotal;
+    msg.resident = residentBytes();
+}
+
+string MemoryAccounts::report() const
+{
+    fiducial_msgs::MemoryStats msg;
+    fill(msg);
+
+    ostringstream out;
+    char line[100];
+
+    snprintf(line, sizeof(line), "%-16s %12s %12s\n", "subsystem", "kB", "peak kB");
+    out << line;
+    for (const fiducial_msgs::MemoryUsage &a : msg.subsystems) {
+        snprintf(line, sizeof(line), "%-16s %12.1f %12.1f\n", a.name.c_str(),
+                 a.bytes / 1024.0, a.peak / 1024.0);
+        out << line;
+    }
+    snprintf(line, sizeof(line), "%-16s %12.1f %12.1f\n", "total",
+             msg.total / 1024.0, msg.peak_total / 1024.0);
+    out << line;
+    snprintf(line, sizeof(line), "%-16s %12.1f\n", "resident",
+             msg.resident / 1024.0);
+    out << line;
+
+    return out.str();
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/refine.h>
+
+#include <fiducial_common/reprojection.h>
+
+#include <opencv2/calib3d.hpp>
+
+#include <algorithm>
+
+
+// Sum of squared residuals of the points for a camera pose
+
+static double poseCost(const cv::Matx33d &R, const cv::Vec3d &t,
+                       const cv::Point3f *objectPoints,
+                       const cv::Point2f *normPoints, int n)
+{
+    double cost = 0.0;
+    for (int i=0; i<n; i++) {
+        const cv::Point3f &op = objectPoints[i];
+        cv::Vec3d p = R * cv::Vec3d(op.x, op.y, op.z) + t;
+        double rx = p[0] / p[2] - normPoints[i].x;
+        double ry = p[1] / p[2] - normPoints[i].y;
+        cost += rx*rx + ry*ry;
+    }
+    return cost;
+}
+
+
+// The pose is updated by a small rotation w and translation v applied on
+// the left, so a point in the camera frame p becomes p + w x p + v. The
+// Jacobian of its projection (x/z, y/z) is accumulated into the normal
+// equations directly, one point at a time
+
+RefineResult refinePose(const cv::Point3f *objectPoints,
+                        const cv::Point2f *normPoints, int n,
+                        cv::Vec3d &rvec, cv::Vec3d &tvec, int maxIterations)
+{
+    RefineResult result;
+    result.iterations = 0;
+    result.converged = false;
+
+    cv::Matx33d R = rotationMatrix(rvec);
+    cv::Vec3d t = tvec;
+
+    double cost = poseCost(R, t, objectPoints, normPoints, n);
+    result.initialCost = cost;
+
+    double lambda = 1e-3;
+
+    while (result.iterations < maxIterations) {
+        result.iterations++;
+
+        cv::Matx66d JtJ = cv::Matx66d::zeros();
+        cv::Vec6d Jtr;
+
+        for (int i=0; i<n; i++) {
+            const cv::Point3f &op = objectPoints[i];
+            cv::Vec3d p = R * cv::Vec3d(op.x, op.y, op.z) + t;
+            if (p[2] <= 0.0) {
+                continue;
+            }
+
+            double iz = 1.0 / p[2];
+            double x = p[0] * iz;
+            double y = p[1] * iz;
+            double r[2] = {x - normPoints[i].x, y - normPoints[i].y};
+
+            // d(x,y)/dp is [iz 0 -x*iz; 0 iz -y*iz], dp/dw is -[p]x and
+            // dp/dv is the identity
+            double J[2][6] = {
+                { -x*iz*p[1], iz*p[2] + x*iz*p[0], -iz*p[1], iz, 0.0, -x*iz },
+                { -iz*p[2] - y*iz*p[1], y*iz*p[0], iz*p[0], 0.0, iz, -y*iz }
+            };
+
+            for (int k=0; k<2; k++) {
+                for (int a=0; a<6; a++) {
+                    Jtr[a] += J[k][a] * r[k];
+                    for (int b=a; b<6; b++) {
+                        JtJ(a, b) += J[k][a] * J[k][b];
+                    }
+                }
+            }
+        }
+
+        for (int a=0; a<6; a++) {
+            for (int b=0; b<a; b++) {
+                JtJ(a, b) = JtJ(b, a);
+            }
+        }
+
+        // Try steps with increasing damping until one reduces the cost
+        bool improved = false;
+        while (!improved && lambda < 1e8) {
+            cv::Matx66d A = JtJ;
+            for (int a=0; a<6; a++) {
+                A(a, a) += lambda * std::max(JtJ(a, a), 1e-12);
+            }
+
+            cv::Vec6d delta = A.solve(-Jtr, cv::DECOMP_CHOLESKY);
+
+            cv::Matx33d dR = rotationMatrix(cv::Vec3d(delta[0], delta[1], delta[2]));
+            cv::Matx33d newR = dR * R;
+            cv::Vec3d newT = dR * t + cv::Vec3d(delta[3], delta[4], delta[5]);
+            double newCost = poseCost(newR, newT, objectPoints, normPoints, n);
+
+            if (newCost < cost) {
+                improved = true;
+                R = newR;
+                t = newT;
+                lambda = std::max(lambda * 0.1, 1e-9);
+
+                if (cost - newCost < 1e-10 * cost || cv::norm(delta) < 1e-9) {
+                    result.converged = true;
+                }
+                cost = newCost;
+            }
+            else {
+                lambda *= 10.0;
+            }
+        }
+
+        // No step reduces the cost, so this is a minimum
+        if (!improved) {
+            result.converged = true;
+        }
+        if (result.converged) {
+            break;
+        }
+    }
+
+    result.finalCost = cost;
+
+    cv::Rodrigues(R, rvec);
+    tvec = t;
+
+    return result;
+}
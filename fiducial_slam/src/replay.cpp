@@ -0,0 +1,738 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+/*
+ * fiducial_slam_replay: run fiducial_slam on a bag file as fast as
+ * possible, without a ROS master. Run without arguments for usage.
+ */
+
+#include <fiducial_slam/map.h>
+#include <fiducial_slam/estimator.h>
+#include <fiducial_slam/helpers.h>
+#include <fiducial_slam/map_file.h>
+#include <fiducial_common/detection_log.h>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <tf2_msgs/TFMessage.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <sensor_msgs/CompressedImage.h>
+#include <sensor_msgs/image_encodings.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <cv_bridge/cv_bridge.h>
+
+#include <opencv2/aruco.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+"Usage: %s [options] bag|log.fdet\n"
+"\n"
+"Builds a map from the fiducial transforms in a bag, or from the fiducial\n"
+"vertices and camera info with --do-pose-estimation, or from the images and\n"
+"camera info with --detect. Transforms on /tf and /tf_static are used for\n"
+"odometry and the poses of the cameras.\n"
+"\n"
+"A .fdet detection log written by aruco_detect is replayed from its fiducial\n"
+"vertices and camera info. It has no transforms, see --camera-frame.\n"
+"\n"
+"With --truth-map the final map is compared with the true one, and if the\n"
+"bag has the true robot poses they are compared with the estimated ones.\n"
+"\n"
+"Options:\n"
+"  --map file              map to write (map.txt)\n"
+"  --initial-map file      map to start from\n"
+"  --trajectory file       write the estimated robot poses as CSV\n"
+"  --stats file            write timing and accuracy statistics\n"
+"  --do-pose-estimation    estimate poses from fiducial vertices\n"
+"  --detect                detect fiducials in the images, raw or compressed,\n"
+"                          with the defaults of aruco_detect\n"
+"  --dictionary n          aruco dictionary for --detect (7)\n"
+"  --fiducial-len meters   size of the fiducials (0.14)\n"
+"  --pose-error-threshold  largest reprojection error of a pose (1.0)\n"
+"  --camera-frame frame    frame of the observations, instead of the one\n"
+"                          in the messages\n"
+"  --truth-map file        true map\n"
+"  --truth-topic topic     true robot poses, as PoseStamped (/ground_truth)\n"
+"  --map-frame frame       (map)\n"
+"  --odom-frame frame      odometry frame, none by default\n"
+"  --base-frame frame      (base_link)\n"
+"  --verbose               log everything the node would\n", prog);
+}
+
+
+// Time since start in milliseconds
+
+static double elapsedMs(const chrono::steady_clock::time_point &start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+
+// User and system CPU time used by the process, in seconds
+
+static double cpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+// Records the robot poses estimated by the map, everything else it
+// publishes is discarded
+
+class TrajectoryWriter : public MapOutput {
+    FILE *fp;
+
+  public:
+    vector<pair<ros::Time, tf2::Transform>> poses;
+
+    TrajectoryWriter(FILE *fp) : fp(fp) {
+        if (fp) {
+            fprintf(fp, "stamp,x,y,z,qx,qy,qz,qw,variance\n");
+        }
+    }
+
+    void publishPose(const geometry_msgs::PoseWithCovarianceStamped &pose) override {
+        tf2::Transform T;
+        tf2::fromMsg(pose.pose.pose, T);
+        poses.push_back(make_pair(pose.header.stamp, T));
+        if (!fp) {
+            return;
+        }
+
+        const geometry_msgs::Point &p = pose.pose.pose.position;
+        const geometry_msgs::Quaternion &q = pose.pose.pose.orientation;
+        fprintf(fp, "%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+                pose.header.stamp.toSec(), p.x, p.y, p.z, q.x, q.y, q.z, q.w,
+                pose.pose.covariance[0]);
+    }
+
+    void publishTransforms(const vector<geometry_msgs::TransformStamped> &transforms) override {}
+    void publishMap(const fiducial_msgs::FiducialMapEntryArray &fmea) override {}
+    void publishMarker(const visualization_msgs::Marker &marker) override {}
+};
+
+
+// Everything measured by a replay
+
+struct ReplayStats {
+    vector<double> frameMs;
+    vector<double> detectMs;
+    double wallMs;
+    double cpuSeconds;
+    double bagSeconds;
+    int numPoses;
+    int numFiducials;
+
+    // Errors of the robot poses that have a true pose
+    vector<double> posePositionErrors;
+    vector<double> poseAngleErrors;
+
+    // Errors of the fiducials of the true map, if one was given
+    bool haveTruthMap;
+    int mapMatched;
+    int mapMissing;
+    vector<double> mapPositionErrors;
+    vector<double> mapAngleErrors;
+
+    ReplayStats() : wallMs(0.0), cpuSeconds(0.0), bagSeconds(0.0), numPoses(0),
+                    numFiducials(0), haveTruthMap(false), mapMatched(0),
+                    mapMissing(0) {}
+};
+
+
+// Observations from the fiducial transforms produced by a detector
+
+static void toObservations(const fiducial_msgs::FiducialTransformArray &msg,
+                           const string &frame, vector<Observation> &observations)
+{
+    for (const fiducial_msgs::FiducialTransform &ft : msg.transforms) {
+        observations.push_back(Observation(ft.fiducial_id,
+            tf2::Stamped<TransformWithVariance>(
+                TransformWithVariance(ft.transform, ft.object_error),
+                msg.header.stamp, frame),
+            ft.image_error, ft.object_error));
+    }
+}
+
+
+// The parameters of aruco_detect where its defaults differ from OpenCV's
+
+static cv::Ptr<cv::aruco::DetectorParameters> detectorParameters()
+{
+    cv::Ptr<cv::aruco::DetectorParameters> params = new cv::aruco::DetectorParameters();
+
+    params->adaptiveThreshWinSizeMax = 53;
+    params->adaptiveThreshWinSizeStep = 4;
+    params->cornerRefinementMinAccuracy = 0.01;
+#if OPENCV_MINOR_VERSION==2
+    params->doCornerRefinement = true;
+#else
+    params->cornerRefinementMethod = cv::aruco::CORNER_REFINE_SUBPIX;
+#endif
+    params->maxErroneousBitsInBorderRate = 0.04;
+    params->minMarkerPerimeterRate = 0.1;
+    params->perspectiveRemovePixelPerCell = 8;
+    params->polygonalApproxAccuracyRate = 0.01;
+
+    return params;
+}
+
+
+// Grey image from a raw or compressed image message. Returns false if the
+// message is not an image or cannot be decoded
+
+static bool toImage(const rosbag::MessageInstance &m, cv::Mat &image,
+                    std_msgs::Header &header)
+{
+    sensor_msgs::Image::ConstPtr raw = m.instantiate<sensor_msgs::Image>();
+    if (raw) {
+        header = raw->header;
+        try {
+            image = cv_bridge::toCvCopy(raw, sensor_msgs::image_encodings::MONO8)->image;
+        }
+        catch (cv_bridge::Exception &e) {
+            ROS_WARN("Cannot convert image on %s: %s", m.getTopic().c_str(), e.what());
+            return false;
+        }
+        return true;
+    }
+
+    sensor_msgs::CompressedImage::ConstPtr compressed =
+        m.instantiate<sensor_msgs::CompressedImage>();
+    if (compressed) {
+        header = compressed->header;
+        image = cv::imdecode(compressed->data, cv::IMREAD_GRAYSCALE);
+        return !image.empty();
+    }
+
+    return false;
+}
+
+
+// Vertices of the fiducials detected in an image, as published by
+// aruco_detect
+
+static void detect(const cv::Mat &image, const cv::Ptr<cv::aruco::Dictionary> &dictionary,
+                   const cv::Ptr<cv::aruco::DetectorParameters> &params,
+                   fiducial_msgs::FiducialArray &vertices)
+{
+    vector<int> ids;
+    vector<vector<cv::Point2f>> corners;
+    cv::aruco::detectMarkers(image, dictionary, corners, ids, params);
+
+    vertices.fiducials.clear();
+    for (size_t i = 0; i < ids.size(); i++) {
+        fiducial_msgs::Fiducial fid;
+        fid.fiducial_id = ids[i];
+        fid.direction = 0;
+        fid.x0 = corners[i][0].x;
+        fid.y0 = corners[i][0].y;
+        fid.x1 = corners[i][1].x;
+        fid.y1 = corners[i][1].y;
+        fid.x2 = corners[i][2].x;
+        fid.y2 = corners[i][2].y;
+        fid.x3 = corners[i][3].x;
+        fid.y3 = corners[i][3].y;
+        vertices.fiducials.push_back(fid);
+    }
+}
+
+
+// Position error in meters and angle error in degrees between two poses
+
+static void poseError(const tf2::Transform &estimated, const tf2::Transform &truth,
+                      double &position, double &angle)
+{
+    position = (estimated.getOrigin() - truth.getOrigin()).length();
+    angle = rad2deg(estimated.getRotation().angleShortestPath(truth.getRotation()));
+}
+
+
+// Compare the estimated robot poses with the true ones. A pose is compared
+// with the true pose nearest in time, if there is one within maxDt
+
+static void comparePoses(const vector<pair<ros::Time, tf2::Transform>> &poses,
+                         const std::map<ros::Time, tf2::Transform> &truth,
+                         ReplayStats &stats)
+{
+    const double maxDt = 0.05;
+    if (truth.empty()) {
+        return;
+    }
+
+    for (const pair<ros::Time, tf2::Transform> &p : poses) {
+        std::map<ros::Time, tf2::Transform>::const_iterator next =
+            truth.lower_bound(p.first);
+        std::map<ros::Time, tf2::Transform>::const_iterator nearest = next;
+
+        if (next == truth.end() ||
+            (next != truth.begin() &&
+             (p.first - prev(next)->first).toSec() < (next->first - p.first).toSec())) {
+            nearest = prev(next);
+        }
+        if (fabs((nearest->first - p.first).toSec()) > maxDt) {
+            continue;
+        }
+
+        double position, angle;
+        poseError(p.second, nearest->second, position, angle);
+        stats.posePositionErrors.push_back(position);
+        stats.poseAngleErrors.push_back(angle);
+    }
+}
+
+
+// Compare the map with the true one. Fiducials that are in the map but not
+// the true one are not counted, they may be outside the area it covers
+
+static bool compareMap(const string &filename, const Map &map, ReplayStats &stats)
+{
+    vector<MapEntry> entries;
+    if (!loadMapFile(filename, entries)) {
+        return false;
+    }
+
+    stats.haveTruthMap = true;
+    for (const MapEntry &e : entries) {
+        std::map<int, Fiducial>::const_iterator it = map.fiducials.find(e.id);
+        if (it == map.fiducials.end()) {
+            stats.mapMissing++;
+            continue;
+        }
+
+        tf2::Quaternion q;
+        q.setRPY(deg2rad(e.rx), deg2rad(e.ry), deg2rad(e.rz));
+        tf2::Transform truth(q, tf2::Vector3(e.tx, e.ty, e.tz));
+
+        double position, angle;
+        poseError(it->second.pose.transform, truth, position, angle);
+        stats.mapMatched++;
+        stats.mapPositionErrors.push_back(position);
+        stats.mapAngleErrors.push_back(angle);
+    }
+    return true;
+}
+
+
+// Mean, percentiles and maximum of a set of values, as name_statistic_unit
+
+static void writeSummary(FILE *fp, const char *name, const char *unit,
+                         vector<double> values)
+{
+    double total = 0.0;
+    for (double v : values) {
+        total += v;
+    }
+    sort(values.begin(), values.end());
+
+    auto percentile = [&values](double p) {
+        if (values.empty()) {
+            return 0.0;
+        }
+        return values[min(values.size() - 1, (size_t)(p * values.size()))];
+    };
+
+    fprintf(fp, "%s_mean_%s %.3f\n", name, unit,
+            values.empty() ? 0.0 : total / values.size());
+    fprintf(fp, "%s_p50_%s %.3f\n", name, unit, percentile(0.50));
+    fprintf(fp, "%s_p95_%s %.3f\n", name, unit, percentile(0.95));
+    fprintf(fp, "%s_p99_%s %.3f\n", name, unit, percentile(0.99));
+    fprintf(fp, "%s_max_%s %.3f\n", name, unit, values.empty() ? 0.0 : values.back());
+}
+
+
+static void writeStats(FILE *fp, const ReplayStats &stats)
+{
+    int frames = stats.frameMs.size();
+
+    fprintf(fp, "frames %d\n", frames);
+    fprintf(fp, "poses %d\n", stats.numPoses);
+    fprintf(fp, "fiducials %d\n", stats.numFiducials);
+    fprintf(fp, "bag_duration_s %.3f\n", stats.bagSeconds);
+    fprintf(fp, "wall_time_s %.3f\n", stats.wallMs / 1000.0);
+    fprintf(fp, "speedup %.1f\n",
+            stats.wallMs > 0 ? stats.bagSeconds * 1000.0 / stats.wallMs : 0.0);
+    fprintf(fp, "cpu_time_s %.3f\n", stats.cpuSeconds);
+    fprintf(fp, "cpu_per_frame_ms %.3f\n",
+            frames > 0 ? stats.cpuSeconds * 1000.0 / frames : 0.0);
+    writeSummary(fp, "frame", "ms", stats.frameMs);
+
+    if (!stats.detectMs.empty()) {
+        writeSummary(fp, "detect", "ms", stats.detectMs);
+    }
+
+    if (!stats.posePositionErrors.empty()) {
+        fprintf(fp, "pose_compared %d\n", (int)stats.posePositionErrors.size());
+        writeSummary(fp, "pose_position", "m", stats.posePositionErrors);
+        writeSummary(fp, "pose_angle", "deg", stats.poseAngleErrors);
+    }
+
+    if (stats.haveTruthMap) {
+        fprintf(fp, "map_matched %d\n", stats.mapMatched);
+        fprintf(fp, "map_missing %d\n", stats.mapMissing);
+        writeSummary(fp, "map_position", "m", stats.mapPositionErrors);
+        writeSummary(fp, "map_angle", "deg", stats.mapAngleErrors);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    string bagFilename;
+    string mapFilename = "map.txt";
+    string initialMap;
+    string trajectoryFilename;
+    string statsFilename;
+    string truthMap;
+    string truthTopic = "/ground_truth";
+    string cameraFrame;
+    bool doPoseEstimation = false;
+    bool doDetection = false;
+    int dictionary = 7;
+    double fiducialLen = 0.14;
+    double errorThreshold = 1.0;
+    bool verbose = false;
+
+    string mapFrame = "map";
+    string odomFrame = "";
+    string baseFrame = "base_link";
+
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        bool haveValue = i + 1 < argc;
+
+        if (arg == "--map" && haveValue) {
+            mapFilename = argv[++i];
+        }
+        else if (arg == "--initial-map" && haveValue) {
+            initialMap = argv[++i];
+        }
+        else if (arg == "--trajectory" && haveValue) {
+            trajectoryFilename = argv[++i];
+        }
+        else if (arg == "--stats" && haveValue) {
+            statsFilename = argv[++i];
+        }
+        else if (arg == "--do-pose-estimation") {
+            doPoseEstimation = true;
+        }
+        else if (arg == "--detect") {
+            doDetection = true;
+        }
+        else if (arg == "--dictionary" && haveValue) {
+            dictionary = atoi(argv[++i]);
+        }
+        else if (arg == "--fiducial-len" && haveValue) {
+            fiducialLen = atof(argv[++i]);
+        }
+        else if (arg == "--pose-error-threshold" && haveValue) {
+            errorThreshold = atof(argv[++i]);
+        }
+        else if (arg == "--camera-frame" && haveValue) {
+            cameraFrame = argv[++i];
+        }
+        else if (arg == "--truth-map" && haveValue) {
+            truthMap = argv[++i];
+        }
+        else if (arg == "--truth-topic" && haveValue) {
+            truthTopic = argv[++i];
+        }
+        else if (arg == "--map-frame" && haveValue) {
+            mapFrame = argv[++i];
+        }
+        else if (arg == "--odom-frame" && haveValue) {
+            odomFrame = argv[++i];
+        }
+        else if (arg == "--base-frame" && haveValue) {
+            baseFrame = argv[++i];
+        }
+        else if (arg == "--verbose") {
+            verbose = true;
+        }
+        else if (arg[0] != '-' && bagFilename.empty()) {
+            bagFilename = arg;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (bagFilename.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ros::Time::init();
+    if (!verbose &&
+        ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME,
+                                       ros::console::levels::Warn)) {
+        ros::console::notifyLoggerLevelsChanged();
+    }
+
+    // The input is a bag, or a detection log which is read into memory
+    bool isLog = bagFilename.size() > 5 &&
+                 bagFilename.compare(bagFilename.size() - 5, 5, ".fdet") == 0;
+    rosbag::Bag bag;
+    rosbag::View view;
+    vector<DetectionLogRecord> records;
+    ros::Time beginTime, endTime;
+
+    if (isLog) {
+        if (!loadDetectionLog(bagFilename, records)) {
+            fprintf(stderr, "Could not read detection log %s\n", bagFilename.c_str());
+            return 1;
+        }
+        for (const DetectionLogRecord &record : records) {
+            if (record.frame) {
+                if (beginTime.isZero()) {
+                    beginTime = record.stamp();
+                }
+                endTime = record.stamp();
+            }
+        }
+    }
+    else {
+        try {
+            bag.open(bagFilename, rosbag::bagmode::Read);
+        }
+        catch (rosbag::BagException &e) {
+            fprintf(stderr, "Could not read bag %s: %s\n", bagFilename.c_str(), e.what());
+            return 1;
+        }
+        view.addQuery(bag);
+        beginTime = view.getBeginTime();
+        endTime = view.getEndTime();
+    }
+
+    // The map and estimator run on the time the messages were recorded
+    ros::Time::setNow(beginTime);
+
+    FILE *trajectoryFp = nullptr;
+    if (!trajectoryFilename.empty()) {
+        trajectoryFp = fopen(trajectoryFilename.c_str(), "w");
+        if (!trajectoryFp) {
+            fprintf(stderr, "Could not write %s\n", trajectoryFilename.c_str());
+            return 1;
+        }
+    }
+    TrajectoryWriter trajectory(trajectoryFp);
+
+    Map map;
+    map.mapFrame = mapFrame;
+    map.odomFrame = odomFrame;
+    map.baseFrame = baseFrame;
+    map.mapFilename = mapFilename;
+    map.output = &trajectory;
+    if (!initialMap.empty() && !map.loadMap(initialMap)) {
+        fprintf(stderr, "Could not read map %s\n", initialMap.c_str());
+        return 1;
+    }
+
+    Estimator estimator(map);
+    estimator.setFiducialLen(fiducialLen);
+    estimator.setErrorThreshold(errorThreshold);
+
+    cv::Ptr<cv::aruco::Dictionary> detectorDictionary;
+    cv::Ptr<cv::aruco::DetectorParameters> detectorParams;
+    if (doDetection) {
+        detectorDictionary = cv::aruco::getPredefinedDictionary(dictionary);
+        detectorParams = detectorParameters();
+    }
+
+    ReplayStats stats;
+    std::map<ros::Time, tf2::Transform> truthPoses;
+    BudgetCounters budgetCounters;
+    vector<Observation> observations;
+    fiducial_msgs::FiducialTransformArray fta;
+    cv::Mat image;
+
+    auto start = chrono::steady_clock::now();
+    double cpuStart = cpuSeconds();
+
+    for (const rosbag::MessageInstance &m : view) {
+        ros::Time::setNow(m.getTime());
+
+        tf2_msgs::TFMessage::ConstPtr tfMsg = m.instantiate<tf2_msgs::TFMessage>();
+        if (tfMsg) {
+            bool isStatic = m.getTopic() == "/tf_static";
+            for (const geometry_msgs::TransformStamped &ts : tfMsg->transforms) {
+                map.tfBuffer.setTransform(ts, "bag", isStatic);
+            }
+            continue;
+        }
+
+        if (m.getTopic() == truthTopic) {
+            geometry_msgs::PoseStamped::ConstPtr truthMsg =
+                m.instantiate<geometry_msgs::PoseStamped>();
+            if (truthMsg) {
+                tf2::fromMsg(truthMsg->pose, truthPoses[truthMsg->header.stamp]);
+            }
+            continue;
+        }
+
+        auto frameStart = chrono::steady_clock::now();
+        FrameBudget budget(0.0, budgetCounters);
+        observations.clear();
+
+        if (doDetection || doPoseEstimation) {
+            sensor_msgs::CameraInfo::ConstPtr infoMsg =
+                m.instantiate<sensor_msgs::CameraInfo>();
+            if (infoMsg) {
+                estimator.camInfoCallback(infoMsg);
+                continue;
+            }
+        }
+
+        if (doDetection) {
+            fiducial_msgs::FiducialArray::Ptr verticesMsg(new fiducial_msgs::FiducialArray);
+            if (!toImage(m, image, verticesMsg->header)) {
+                continue;
+            }
+            verticesMsg->image_seq = verticesMsg->header.seq;
+            if (!cameraFrame.empty()) {
+                verticesMsg->header.frame_id = cameraFrame;
+            }
+
+            detect(image, detectorDictionary, detectorParams, *verticesMsg);
+            stats.detectMs.push_back(elapsedMs(frameStart));
+
+            estimator.estimatePoses(verticesMsg, observations, fta, budget);
+            map.update(observations, verticesMsg->header.stamp, budget);
+        }
+        else if (doPoseEstimation) {
+            fiducial_msgs::FiducialArray::ConstPtr verticesMsg =
+                m.instantiate<fiducial_msgs::FiducialArray>();
+            if (!verticesMsg) {
+                continue;
+            }
+            if (!cameraFrame.empty()) {
+                fiducial_msgs::FiducialArray::Ptr renamed(
+                    new fiducial_msgs::FiducialArray(*verticesMsg));
+                renamed->header.frame_id = cameraFrame;
+                verticesMsg = renamed;
+            }
+            estimator.estimatePoses(verticesMsg, observations, fta, budget);
+            map.update(observations, verticesMsg->header.stamp, budget);
+        }
+        else {
+            fiducial_msgs::FiducialTransformArray::ConstPtr transformsMsg =
+                m.instantiate<fiducial_msgs::FiducialTransformArray>();
+            if (!transformsMsg) {
+                continue;
+            }
+            toObservations(*transformsMsg,
+                           cameraFrame.empty() ? transformsMsg->header.frame_id : cameraFrame,
+                           observations);
+            map.update(observations, transformsMsg->header.stamp, budget);
+        }
+
+        stats.frameMs.push_back(elapsedMs(frameStart));
+    }
+
+    // Camera infos in a log may come from a calibration file, without a
+    // time, so only frames set the time
+    for (const DetectionLogRecord &record : records) {
+        if (record.cameraInfo) {
+            estimator.camInfoCallback(record.cameraInfo);
+            continue;
+        }
+
+        const fiducial_msgs::FiducialArray::Ptr &verticesMsg = record.frame;
+        if (!cameraFrame.empty()) {
+            verticesMsg->header.frame_id = cameraFrame;
+        }
+        ros::Time::setNow(verticesMsg->header.stamp);
+
+        auto frameStart = chrono::steady_clock::now();
+        FrameBudget budget(0.0, budgetCounters);
+        observations.clear();
+
+        estimator.estimatePoses(verticesMsg, observations, fta, budget);
+        map.update(observations, verticesMsg->header.stamp, budget);
+
+        stats.frameMs.push_back(elapsedMs(frameStart));
+    }
+
+    stats.wallMs = elapsedMs(start);
+    stats.cpuSeconds = cpuSeconds() - cpuStart;
+    stats.bagSeconds = (endTime - beginTime).toSec();
+    if (!isLog) {
+        bag.close();
+    }
+
+    if (trajectoryFp) {
+        fclose(trajectoryFp);
+    }
+
+    bool saved = map.saveMap();
+
+    stats.numPoses = trajectory.poses.size();
+    stats.numFiducials = map.fiducials.size();
+    comparePoses(trajectory.poses, truthPoses, stats);
+    if (!truthMap.empty() && !compareMap(truthMap, map, stats)) {
+        fprintf(stderr, "Could not read map %s\n", truthMap.c_str());
+        return 1;
+    }
+
+    writeStats(stdout, stats);
+    if (!statsFilename.empty()) {
+        FILE *fp = fopen(statsFilename.c_str(), "w");
+        if (!fp) {
+            fprintf(stderr, "Could not write %s\n", statsFilename.c_str());
+            return 1;
+        }
+        writeStats(fp, stats);
+        fclose(fp);
+    }
+
+    return saved ? 0 : 1;
+}
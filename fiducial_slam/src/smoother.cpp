@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/smoother.h>
+
+#include <algorithm>
+
+
+PoseSmoother::PoseSmoother(int window, double motionVariance,
+                           double odomVariance, double maxGap)
+    : window(window), motionVariance(motionVariance),
+      odomVariance(odomVariance), maxGap(maxGap),
+      frames(window), z(window), d(window), rhs(window),
+      w(window), u(window), diag(window)
+{
+    reset();
+}
+
+
+size_t PoseSmoother::memoryUsage() const
+{
+    return frames.capacity() * sizeof(Frame) +
+           (z.capacity() + d.capacity() + rhs.capacity()) * sizeof(cv::Vec6d) +
+           (w.capacity() + u.capacity() + diag.capacity()) * sizeof(double);
+}
+
+
+void PoseSmoother::reset()
+{
+    first = 0;
+    count = 0;
+}
+
+
+// Convert a pose to a translation and a rotation vector relative to a
+// reference rotation
+
+cv::Vec6d PoseSmoother::toVector(const tf2::Quaternion &qRefInv, const tf2::Transform &T)
+{
+    tf2::Quaternion q = qRefInv * T.getRotation();
+    if (q.w() < 0) {
+        q = -q;
+    }
+
+    tf2::Vector3 r(0, 0, 0);
+    double angle = q.getAngle();
+    if (angle > 1e-9) {
+        r = q.getAxis() * angle;
+    }
+
+    tf2::Vector3 t = T.getOrigin();
+    return cv::Vec6d(t.x(), t.y(), t.z(), r.x(), r.y(), r.z());
+}
+
+
+tf2::Transform PoseSmoother::fromVector(const tf2::Quaternion &qRef, const cv::Vec6d &v)
+{
+    tf2::Quaternion q = qRef;
+
+    tf2::Vector3 r(v[3], v[4], v[5]);
+    double angle = r.length();
+    if (angle > 1e-9) {
+        q = qRef * tf2::Quaternion(r / angle, angle);
+    }
+
+    return tf2::Transform(q.normalized(), tf2::Vector3(v[0], v[1], v[2]));
+}
+
+
+// Add a frame to the window and solve for all the poses in it
+
+void PoseSmoother::update(const tf2::Stamped<TransformWithVariance> &measured,
+                          const tf2::Transform *odom,
+                          tf2::Stamped<TransformWithVariance> &smoothed)
+{
+    smoothed = measured;
+
+    if (count > 0) {
+        double dt = (measured.stamp_ - frame(count - 1).stamp).toSec();
+        if (dt < 0 || dt > maxGap) {
+            ROS_INFO("Resetting smoother after gap of %lf seconds", dt);
+            reset();
+        }
+    }
+
+    if (count == window) {
+        first = (first + 1) % window;
+        count--;
+    }
+
+    Frame &newest = frame(count);
+    count++;
+
+    newest.stamp = measured.stamp_;
+    newest.measured = measured.transform;
+    newest.variance = std::max(measured.variance, 1e-9);
+    newest.haveOdom = (odom != nullptr);
+    if (odom) {
+        newest.odom = *odom;
+    }
+    newest.estimate = measured.transform;
+
+    if (count == 1) {
+        return;
+    }
+
+    const int n = count;
+    tf2::Quaternion qRef = measured.transform.getRotation();
+    tf2::Quaternion qRefInv = qRef.inverse();
+
+    // Measurements and the motion between consecutive frames. The motion
+    // is linearised about the previous estimates of the poses
+    for (int i=0; i<n; i++) {
+        const Frame &fi = frame(i);
+        z[i] = toVector(qRefInv, fi.measured);
+        w[i] = 1.0 / fi.variance;
+
+        if (i == n - 1) {
+            break;
+        }
+
+        const Frame &fn = frame(i + 1);
+        double dt = std::max((fn.stamp - fi.stamp).toSec(), 1e-3);
+
+        if (fi.haveOdom && fn.haveOdom) {
+            tf2::Transform predicted = fi.estimate * (fi.odom.inverse() * fn.odom);
+            d[i] = toVector(qRefInv, predicted) - toVector(qRefInv, fi.estimate);
+            u[i] = 1.0 / (odomVariance * dt);
+        }
+        else {
+            d[i] = cv::Vec6d();
+            u[i] = 1.0 / (motionVariance * dt);
+        }
+    }
+
+    // Normal equations, tridiagonal with -u[i] off the diagonal
+    for (int i=0; i<n; i++) {
+        diag[i] = w[i];
+        rhs[i] = w[i] * z[i];
+        if (i > 0) {
+            diag[i] += u[i - 1];
+            rhs[i] += u[i - 1] * d[i - 1];
+        }
+        if (i < n - 1) {
+            diag[i] += u[i];
+            rhs[i] -= u[i] * d[i];
+        }
+    }
+
+    // Forward elimination. The last pivot is the information of the
+    // newest pose given all the frames in the window
+    for (int i=1; i<n; i++) {
+        double m = u[i - 1] / diag[i - 1];
+        diag[i] -= m * u[i - 1];
+        rhs[i] += m * rhs[i - 1];
+    }
+
+    // Back substitution, solving in place
+    rhs[n - 1] = rhs[n - 1] / diag[n - 1];
+    for (int i=n-2; i>=0; i--) {
+        rhs[i] = (rhs[i] + u[i] * rhs[i + 1]) / diag[i];
+    }
+
+    for (int i=0; i<n; i++) {
+        frame(i).estimate = fromVector(qRef, rhs[i]);
+    }
+
+    smoothed.transform = frame(n - 1).estimate;
+    smoothed.variance = 1.0 / diag[n - 1];
+}
@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <fiducial_slam/synthetic.h>
+#include <fiducial_slam/helpers.h>
+
+#include <tf2/LinearMath/Matrix3x3.h>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+// Pose of a fiducial on a wall, facing into the room along normal
+
+static tf2::Transform wallPose(const tf2::Vector3 &position,
+                               const tf2::Vector3 &normal)
+{
+    tf2::Vector3 y(0, 0, 1);
+    tf2::Vector3 x = y.cross(normal);
+
+    tf2::Matrix3x3 R(x.x(), y.x(), normal.x(),
+                     x.y(), y.y(), normal.y(),
+                     x.z(), y.z(), normal.z());
+    return tf2::Transform(R, position);
+}
+
+
+// Create a site with the requested number of fiducials
+
+SyntheticSite::SyntheticSite(const SiteParams &params)
+    : params(params), rng(params.seed)
+{
+    int n = max(1, (int)(params.roomSize / params.spacing));
+    perRoom = n * n + 4 * n;
+    numRooms = max(1, (params.numFiducials + perRoom - 1) / perRoom);
+    roomsPerSide = (int)ceil(sqrt((double)numRooms));
+
+    poses.reserve(numRooms * perRoom);
+
+    tf2::Quaternion down;
+    down.setRPY(M_PI, 0, 0);
+
+    for (int room = 0; room < numRooms; room++) {
+        tf2::Vector3 center = roomCenter(room);
+        double x0 = center.x() - params.roomSize / 2.0;
+        double y0 = center.y() - params.roomSize / 2.0;
+        double x1 = x0 + params.roomSize;
+        double y1 = y0 + params.roomSize;
+
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                tf2::Vector3 p(x0 + (i + 0.5) * params.spacing,
+                               y0 + (j + 0.5) * params.spacing,
+                               params.ceilingHeight);
+                poses.push_back(tf2::Transform(down, p));
+            }
+        }
+
+        for (int k = 0; k < n; k++) {
+            double offset = (k + 0.5) * params.spacing;
+            double z = params.wallHeight;
+            poses.push_back(wallPose(tf2::Vector3(x0 + offset, y0, z),
+                                     tf2::Vector3(0, 1, 0)));
+            poses.push_back(wallPose(tf2::Vector3(x0 + offset, y1, z),
+                                     tf2::Vector3(0, -1, 0)));
+            poses.push_back(wallPose(tf2::Vector3(x0, y0 + offset, z),
+                                     tf2::Vector3(1, 0, 0)));
+            poses.push_back(wallPose(tf2::Vector3(x1, y0 + offset, z),
+                                     tf2::Vector3(-1, 0, 0)));
+        }
+    }
+
+    if ((int)poses.size() > params.numFiducials) {
+        poses.resize(max(1, params.numFiducials));
+    }
+}
+
+
+// Rooms are numbered in a serpentine, so that consecutive rooms are
+// next to each other
+
+tf2::Vector3 SyntheticSite::roomCenter(int room) const
+{
+    int row = room / roomsPerSide;
+    int col = room % roomsPerSide;
+    if (row % 2 == 1) {
+        col = roomsPerSide - 1 - col;
+    }
+
+    return tf2::Vector3((col + 0.5) * params.roomSize,
+                        (row + 0.5) * params.roomSize, 0.0);
+}
+
+
+int SyntheticSite::roomAt(const tf2::Vector3 &position) const
+{
+    int col = (int)floor(position.x() / params.roomSize);
+    int row = (int)floor(position.y() / params.roomSize);
+    if (col < 0 || row < 0 || col >= roomsPerSide || row >= roomsPerSide) {
+        return -1;
+    }
+
+    if (row % 2 == 1) {
+        col = roomsPerSide - 1 - col;
+    }
+    int room = row * roomsPerSide + col;
+    return room < numRooms ? room : -1;
+}
+
+
+int SyntheticSite::numFrames() const
+{
+    return numRooms * params.framesPerRoom;
+}
+
+
+ros::Time SyntheticSite::frameTime(int frame) const
+{
+    return ros::Time(1.0 + frame * params.frameInterval);
+}
+
+
+// The robot drives from the center of each room to the center of the
+// next one, weaving from side to side. In the last room, or if there is
+// only one, it drives in a circle
+
+tf2::Transform SyntheticSite::cameraPose(int frame) const
+{
+    int room = min(frame / params.framesPerRoom, numRooms - 1);
+    double u = (double)(frame - room * params.framesPerRoom) / params.framesPerRoom;
+
+    tf2::Vector3 center = roomCenter(room);
+    tf2::Vector3 position;
+    double yaw;
+
+    if (room + 1 < numRooms) {
+        tf2::Vector3 d = roomCenter(room + 1) - center;
+        tf2::Vector3 side(-d.y(), d.x(), 0.0);
+        side /= side.length();
+
+        position = center + d * u +
+                   side * (0.2 * params.roomSize * sin(2.0 * M_PI * u));
+        yaw = atan2(d.y(), d.x()) + 0.3 * cos(2.0 * M_PI * u);
+    }
+    else {
+        double a = 2.0 * M_PI * u;
+        position = center + 0.25 * params.roomSize * tf2::Vector3(cos(a), sin(a), 0);
+        yaw = a + M_PI / 2.0;
+    }
+    position.setZ(params.cameraHeight);
+
+    tf2::Quaternion q;
+    q.setRPY(0, 0, yaw);
+    return tf2::Transform(q, position);
+}
+
+
+void SyntheticSite::cameraInfo(sensor_msgs::CameraInfo &info) const
+{
+    double f = (params.imageWidth / 2.0) / tan(deg2rad(params.fov) / 2.0);
+    double cx = params.imageWidth / 2.0;
+    double cy = params.imageHeight / 2.0;
+
+    info.width = params.imageWidth;
+    info.height = params.imageHeight;
+    info.distortion_model = "plumb_bob";
+    info.D = vector<double>(5, 0.0);
+    info.K = {f, 0.0, cx, 0.0, f, cy, 0.0, 0.0, 1.0};
+    info.R = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+    info.P = {f, 0.0, cx, 0.0, 0.0, f, cy, 0.0, 0.0, 0.0, 1.0, 0.0};
+}
+
+
+// Fiducials in the room the camera is in that are in front of it, facing
+// it, within range, and entirely in the image
+
+void SyntheticSite::visible(int frame, double scale, vector<int> &indexes,
+                            vector<cv::Point2f> &corners) const
+{
+    indexes.clear();
+    corners.clear();
+
+    tf2::Transform T_camMap = cameraPose(frame).inverse();
+    int room = roomAt(T_camMap.inverse().getOrigin());
+    if (room < 0) {
+        return;
+    }
+
+    double f = (params.imageWidth / 2.0) / tan(deg2rad(params.fov) / 2.0);
+    double cx = params.imageWidth / 2.0;
+    double cy = params.imageHeight / 2.0;
+    double maxAngle = deg2rad(params.fov) / 2.0;
+    double l = scale * params.fiducialLen / 2.0;
+
+    // Corners in the order used by aruco
+    const tf2::Vector3 fidCorners[4] = {
+        tf2::Vector3(-l, l, 0), tf2::Vector3(l, l, 0),
+        tf2::Vector3(l, -l, 0), tf2::Vector3(-l, -l, 0)
+    };
+
+    int first = room * perRoom;
+    int last = min(first + perRoom, (int)poses.size());
+
+    for (int i = first; i < last; i++) {
+        tf2::Transform T_camFid = T_camMap * poses[i];
+        tf2::Vector3 p = T_camFid.getOrigin();
+
+        if (p.z() <= 0 || p.length() > params.maxRange ||
+            atan2(sqrt(p.x() * p.x() + p.y() * p.y()), p.z()) > maxAngle ||
+            T_camFid.getBasis().getColumn(2).dot(p) >= 0) {
+            continue;
+        }
+
+        cv::Point2f pixels[4];
+        bool inImage = true;
+        for (int c = 0; c < 4; c++) {
+            tf2::Vector3 q = T_camFid * fidCorners[c];
+            pixels[c] = cv::Point2f(f * q.x() / q.z() + cx, f * q.y() / q.z() + cy);
+            if (q.z() <= 0 || pixels[c].x < 0 || pixels[c].y < 0 ||
+                pixels[c].x >= params.imageWidth || pixels[c].y >= params.imageHeight) {
+                inImage = false;
+            }
+        }
+        if (!inImage) {
+            continue;
+        }
+
+        indexes.push_back(i);
+        corners.insert(corners.end(), pixels, pixels + 4);
+    }
+}
+
+
+void SyntheticSite::observe(int frame, const string &frameId,
+                            fiducial_msgs::FiducialTransformArray &transforms,
+                            fiducial_msgs::FiducialArray &vertices)
+{
+    transforms.header.stamp = frameTime(frame);
+    transforms.header.frame_id = frameId;
+    transforms.image_seq = frame;
+    transforms.transforms.clear();
+
+    vertices.header = transforms.header;
+    vertices.image_seq = frame;
+    vertices.fiducials.clear();
+
+    vector<int> indexes;
+    vector<cv::Point2f> corners;
+    visible(frame, 1.0, indexes, corners);
+
+    tf2::Transform T_camMap = cameraPose(frame).inverse();
+    normal_distribution<double> unit(0.0, 1.0);
+
+    for (size_t k = 0; k < indexes.size(); k++) {
+        int i = indexes[k];
+        tf2::Transform T_camFid = T_camMap * poses[i];
+        tf2::Vector3 p = T_camFid.getOrigin();
+        double range = p.length();
+
+        double px[4], py[4];
+        for (int c = 0; c < 4; c++) {
+            px[c] = corners[4 * k + c].x + params.pixelNoise * unit(rng);
+            py[c] = corners[4 * k + c].y + params.pixelNoise * unit(rng);
+        }
+
+        fiducial_msgs::Fiducial fid;
+        fid.fiducial_id = i + 1;
+        fid.direction = 0;
+        fid.x0 = px[0]; fid.y0 = py[0];
+        fid.x1 = px[1]; fid.y1 = py[1];
+        fid.x2 = px[2]; fid.y2 = py[2];
+        fid.x3 = px[3]; fid.y3 = py[3];
+        vertices.fiducials.push_back(fid);
+
+        // Pose with noise in position proportional to distance, and
+        // a small random rotation
+        double sigma = params.positionNoise * range;
+        tf2::Vector3 noisyP = p + sigma * tf2::Vector3(unit(rng), unit(rng), unit(rng));
+
+        tf2::Quaternion dq;
+        dq.setRPY(params.angleNoise * unit(rng), params.angleNoise * unit(rng),
+                  params.angleNoise * unit(rng));
+        tf2::Transform noisy(T_camFid.getRotation() * dq, noisyP);
+
+        double area = 0.0;
+        for (int c = 0; c < 4; c++) {
+            int n = (c + 1) % 4;
+            area += px[c] * py[n] - px[n] * py[c];
+        }
+
+        fiducial_msgs::FiducialTransform ft;
+        ft.fiducial_id = i + 1;
+        ft.transform = tf2::toMsg(noisy);
+        ft.image_error = params.pixelNoise * params.pixelNoise;
+        ft.object_error = max(sigma * sigma, 1e-4);
+        ft.fiducial_area = fabs(area) / 2.0;
+        transforms.transforms.push_back(ft);
+    }
+}
+
+
+// Each fiducial is warped into the image from a picture of it as printed,
+// then noise is added. The noise depends only on the seed and the frame,
+// so renders are repeatable
+
+void SyntheticSite::render(int frame, const cv::Ptr<cv::aruco::Dictionary> &dictionary,
+                           cv::Mat &image) const
+{
+    const int cellPixels = 16;
+    int markerPixels = (dictionary->markerSize + 2) * cellPixels;
+    int printedPixels = markerPixels + 2 * cellPixels;
+
+    image.create(params.imageHeight, params.imageWidth, CV_8UC1);
+    image.setTo(cv::Scalar(128));
+
+    vector<int> indexes;
+    vector<cv::Point2f> corners;
+    visible(frame, (double)printedPixels / markerPixels, indexes, corners);
+
+    cv::Mat printed(printedPixels, printedPixels, CV_8UC1);
+    cv::Mat printedMarker = printed(cv::Rect(cellPixels, cellPixels,
+                                             markerPixels, markerPixels));
+    cv::Mat marker;
+
+    const cv::Point2f printedCorners[4] = {
+        cv::Point2f(0, 0), cv::Point2f(printedPixels, 0),
+        cv::Point2f(printedPixels, printedPixels), cv::Point2f(0, printedPixels)
+    };
+
+    for (size_t k = 0; k < indexes.size(); k++) {
+        int id = indexes[k] + 1;
+        if (id >= dictionary->bytesList.rows) {
+            continue;
+        }
+
+        printed.setTo(cv::Scalar(255));
+        cv::aruco::drawMarker(dictionary, id, markerPixels, marker, 1);
+        marker.copyTo(printedMarker);
+
+        cv::Mat H = cv::getPerspectiveTransform(printedCorners, &corners[4 * k]);
+        cv::warpPerspective(printed, image, H, image.size(), cv::INTER_LINEAR,
+                            cv::BORDER_TRANSPARENT);
+    }
+
+    if (params.imageNoise > 0) {
+        cv::RNG imageRng(params.seed * 100003ULL + frame);
+        cv::Mat noise(image.size(), CV_16SC1);
+        imageRng.fill(noise, cv::RNG::NORMAL, 0.0, params.imageNoise);
+
+        cv::Mat noisy;
+        image.convertTo(noisy, CV_16SC1);
+        noisy += noise;
+        noisy.convertTo(image, CV_8UC1);
+    }
+}
+
+
+void SyntheticSite::groundTruthMap(vector<MapEntry> &entries, double variance,
+                                   int rooms) const
+{
+    int count = poses.size();
+    if (rooms >= 0) {
+        count = min(count, rooms * perRoom);
+    }
+
+    entries.clear();
+    entries.reserve(count);
+
+    for (int i = 0; i < count; i++) {
+        const tf2::Transform &pose = poses[i];
+        double roll, pitch, yaw;
+        pose.getBasis().getRPY(roll, pitch, yaw);
+
+        MapEntry e;
+        e.id = i + 1;
+        e.tx = pose.getOrigin().x();
+        e.ty = pose.getOrigin().y();
+        e.tz = pose.getOrigin().z();
+        e.rx = rad2deg(roll);
+        e.ry = rad2deg(pitch);
+        e.rz = rad2deg(yaw);
+        e.variance = variance;
+        e.numObs = 10;
+
+        // Link to the other fiducials in the same room, which are the
+        // ones that can be seen together
+        int first = (i / perRoom) * perRoom;
+        int last = min(first + perRoom, count);
+        for (int j = first; j < last; j++) {
+            if (j != i) {
+                e.links.push_back(j + 1);
+            }
+        }
+        entries.push_back(e);
+    }
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2018, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+/*
+ * fiducial_slam_synthetic: generate a synthetic site and a bag of
+ * observations of it, with ground truth. Run without arguments for usage.
+ */
+
+#include <fiducial_slam/synthetic.h>
+#include <fiducial_slam/map_file.h>
+
+#include <rosbag/bag.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+"Usage: %s [options] prefix\n"
+"\n"
+"Generates a site of rooms with fiducials on the ceilings and walls, and a\n"
+"robot driving through every room. Writes:\n"
+"  prefix.bag          /fiducial_transforms, /fiducial_vertices, /camera_info\n"
+"                      and the true robot pose on /ground_truth\n"
+"  prefix_truth.txt    the true map\n"
+"  prefix_initial.txt  the fiducials of the first room, to start mapping from\n"
+"  prefix_truth.csv    the true robot trajectory\n"
+"With --images the bag also has the camera images on /camera/image, for\n"
+"running the detector. These are large, use fewer fiducials.\n"
+"\n"
+"Options:\n"
+"  --fiducials n       number of fiducials (1000)\n"
+"  --frames-per-room n (20)\n"
+"  --noise scale       multiply all noise by scale (1.0)\n"
+"  --seed n            random seed (1)\n"
+"  --fiducial-len m    size of the fiducials (0.14)\n"
+"  --frame-id frame    frame of the observations (base_link)\n"
+"  --images            render the camera images\n"
+"  --dictionary n      aruco dictionary of the images (7)\n", prog);
+}
+
+
+int main(int argc, char **argv)
+{
+    SiteParams params;
+    string prefix;
+    string frameId = "base_link";
+    double noise = 1.0;
+    bool images = false;
+    int dictionary = 7;
+
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        bool haveValue = i + 1 < argc;
+
+        if (arg == "--fiducials" && haveValue) {
+            params.numFiducials = atoi(argv[++i]);
+        }
+        else if (arg == "--frames-per-room" && haveValue) {
+            params.framesPerRoom = atoi(argv[++i]);
+        }
+        else if (arg == "--noise" && haveValue) {
+            noise = atof(argv[++i]);
+        }
+        else if (arg == "--seed" && haveValue) {
+            params.seed = atoi(argv[++i]);
+        }
+        else if (arg == "--fiducial-len" && haveValue) {
+            params.fiducialLen = atof(argv[++i]);
+        }
+        else if (arg == "--frame-id" && haveValue) {
+            frameId = argv[++i];
+        }
+        else if (arg == "--images") {
+            images = true;
+        }
+        else if (arg == "--dictionary" && haveValue) {
+            dictionary = atoi(argv[++i]);
+        }
+        else if (arg[0] != '-' && prefix.empty()) {
+            prefix = arg;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (prefix.empty() || params.numFiducials < 1 || params.framesPerRoom < 1 ||
+        params.fiducialLen <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    params.positionNoise *= noise;
+    params.angleNoise *= noise;
+    params.pixelNoise *= noise;
+    params.imageNoise *= noise;
+
+    SyntheticSite site(params);
+
+    vector<MapEntry> entries;
+    site.groundTruthMap(entries, 0.0);
+    if (!saveMapFile(prefix + "_truth.txt", entries)) {
+        fprintf(stderr, "Could not write %s_truth.txt\n", prefix.c_str());
+        return 1;
+    }
+
+    site.groundTruthMap(entries, 0.0, 1);
+    if (!saveMapFile(prefix + "_initial.txt", entries)) {
+        fprintf(stderr, "Could not write %s_initial.txt\n", prefix.c_str());
+        return 1;
+    }
+
+    string trajectoryFilename = prefix + "_truth.csv";
+    FILE *fp = fopen(trajectoryFilename.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write %s\n", trajectoryFilename.c_str());
+        return 1;
+    }
+    fprintf(fp, "stamp,x,y,z,qx,qy,qz,qw,variance\n");
+
+    rosbag::Bag bag;
+    try {
+        bag.open(prefix + ".bag", rosbag::bagmode::Write);
+    }
+    catch (rosbag::BagException &e) {
+        fprintf(stderr, "Could not write %s.bag: %s\n", prefix.c_str(), e.what());
+        fclose(fp);
+        return 1;
+    }
+
+    sensor_msgs::CameraInfo info;
+    site.cameraInfo(info);
+    info.header.frame_id = frameId;
+
+    fiducial_msgs::FiducialTransformArray transforms;
+    fiducial_msgs::FiducialArray vertices;
+    long numObservations = 0;
+
+    cv::Ptr<cv::aruco::Dictionary> dict;
+    cv_bridge::CvImage image;
+    if (images) {
+        dict = cv::aruco::getPredefinedDictionary(dictionary);
+        image.header.frame_id = frameId;
+        image.encoding = sensor_msgs::image_encodings::MONO8;
+    }
+
+    for (int frame = 0; frame < site.numFrames(); frame++) {
+        ros::Time stamp = site.frameTime(frame);
+        site.observe(frame, frameId, transforms, vertices);
+        numObservations += transforms.transforms.size();
+
+        info.header.stamp = stamp;
+        bag.write("/camera_info", stamp, info);
+        bag.write("/fiducial_vertices", stamp, vertices);
+        bag.write("/fiducial_transforms", stamp, transforms);
+
+        if (images) {
+            site.render(frame, dict, image.image);
+            image.header.stamp = stamp;
+            image.header.seq = frame;
+            bag.write("/camera/image", stamp, image.toImageMsg());
+        }
+
+        tf2::Transform pose = site.cameraPose(frame);
+        geometry_msgs::PoseStamped truth;
+        truth.header.stamp = stamp;
+        truth.header.frame_id = "map";
+        tf2::toMsg(pose, truth.pose);
+        bag.write("/ground_truth", stamp, truth);
+
+        const tf2::Vector3 &p = pose.getOrigin();
+        tf2::Quaternion q = pose.getRotation();
+        fprintf(fp, "%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+                stamp.toSec(), p.x(), p.y(), p.z(), q.x(), q.y(), q.z(), q.w(), 0.0);
+    }
+
+    bag.close();
+    fclose(fp);
+
+    printf("Wrote %d fiducials and %d frames with %ld observations to %s\n",
+           site.numFiducials(), site.numFrames(), numObservations, prefix.c_str());
+    return 0;
+}
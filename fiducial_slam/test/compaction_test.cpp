@@ -0,0 +1,218 @@
+/*
+Tests of map compaction: the selection of fiducials to remove by
+observations, variance, age and memory budget, and their removal from
+the map into the archive file
+*/
+
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/map.h>
+#include <fiducial_slam/map_file.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+
+static CompactionCandidate candidate(int id, int numObs, double variance,
+                                     double lastSeen, size_t bytes = 100)
+{
+  CompactionCandidate c;
+  c.id = id;
+  c.numObs = numObs;
+  c.variance = variance;
+  c.lastSeen = lastSeen;
+  c.bytes = bytes;
+  return c;
+}
+
+static std::vector<int> sorted(std::vector<int> ids)
+{
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+
+TEST(SelectForCompaction, rules) {
+  CompactionParams params = {3, 1.0, 600.0, 3600.0, 0};
+  double now = 10000.0;
+
+  std::vector<CompactionCandidate> candidates = {
+    candidate(1, 10, 0.01, now - 10),     // good
+    candidate(2, 1, 0.01, now - 10),      // few observations, in grace period
+    candidate(3, 1, 0.01, now - 1000),    // few observations
+    candidate(4, 10, 2.0, now - 1000),    // large variance
+    candidate(5, 10, 0.01, now - 4000),   // too old
+    candidate(6, 1, 2.0, 0.0),            // loaded and not seen since
+  };
+
+  EXPECT_EQ(std::vector<int>({3, 4, 5}),
+            sorted(selectForCompaction(candidates, 0, params, now)));
+
+  // Variance and age limits disabled
+  params.maxVariance = 0.0;
+  params.maxAge = 0.0;
+  EXPECT_EQ(std::vector<int>({3}),
+            sorted(selectForCompaction(candidates, 0, params, now)));
+}
+
+TEST(SelectForCompaction, memoryBudget) {
+  CompactionParams params = {0, 0.0, 600.0, 0.0, 500};
+  double now = 10000.0;
+
+  std::vector<CompactionCandidate> candidates = {
+    candidate(1, 5, 0.01, now - 10),
+    candidate(2, 2, 0.01, now - 10),
+    candidate(3, 5, 0.01, now - 20),
+    candidate(4, 9, 0.01, now - 30),
+    candidate(5, 2, 0.01, 0.0),
+  };
+
+  // Within budget
+  EXPECT_TRUE(selectForCompaction(candidates, 0, params, now).empty());
+
+  // Fewest observations first, then least recently seen, with loaded
+  // fiducials counted as the least recently seen
+  EXPECT_EQ(std::vector<int>({5}),
+            selectForCompaction(candidates, 100, params, now));
+  EXPECT_EQ(std::vector<int>({5, 2, 3}),
+            selectForCompaction(candidates, 300, params, now));
+
+  // Protected fiducials alone are over budget
+  EXPECT_EQ(5u, selectForCompaction(candidates, 600, params, now).size());
+}
+
+
+class MapCompactionTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    char dir[] = "/tmp/compaction_testXXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != nullptr);
+    tmpdir = dir;
+    map.archiveFilename = tmpdir + "/archive.txt";
+    now = ros::Time(100000, 0);
+  }
+
+  virtual void TearDown() {
+    unlink(map.archiveFilename.c_str());
+    rmdir(tmpdir.c_str());
+  }
+
+  // Add a fiducial to the map, last seen age seconds ago
+  void add(int id, int numObs, double variance, double age,
+           const std::vector<int> &links = {}) {
+    tf2::Transform T(tf2::Quaternion(0, 0, 0, 1), tf2::Vector3(id, 2.0 * id, 0));
+    Fiducial f(id, tf2::Stamped<TransformWithVariance>(
+                   TransformWithVariance(T, variance), now, "map"));
+    f.numObs = numObs;
+    f.lastSeen = now - ros::Duration(age);
+    for (int link : links) {
+      f.addLink(link);
+    }
+    map.fiducials[id] = f;
+  }
+
+  void compact() {
+    map.startCompaction(now);
+    map.pendingCompaction.wait();
+    map.finishCompaction();
+    if (map.compactionCleanup.valid()) {
+      map.compactionCleanup.wait();
+    }
+  }
+
+  Map map;
+  ros::Time now;
+  std::string tmpdir;
+};
+
+
+TEST_F(MapCompactionTest, archiveRoundTrip) {
+  map.compactionParams = {3, 1.0, 600.0, 0.0, 0};
+  add(1, 10, 0.01, 10, {2, 3});
+  add(2, 1, 0.01, 1000, {1, 3});
+  add(3, 10, 5.0, 1000, {1, 2});
+  add(4, 10, 5.0, 10);
+
+  compact();
+
+  ASSERT_EQ(2u, map.fiducials.size());
+  EXPECT_EQ(1u, map.fiducials.count(1));
+  EXPECT_EQ(1u, map.fiducials.count(4));
+  EXPECT_TRUE(map.fiducials[1].links.empty());
+  EXPECT_EQ(0u, map.fiducials[1].links.capacity());
+  EXPECT_NEAR(2.0, map.fiducials[1].pose.transform.getOrigin().y(), 1e-9);
+
+  // The removed fiducials are in the archive, and can be merged back
+  std::vector<MapEntry> archived;
+  ASSERT_TRUE(loadMapFile(map.archiveFilename, archived));
+  ASSERT_EQ(2u, archived.size());
+  std::sort(archived.begin(), archived.end(),
+            [](const MapEntry &a, const MapEntry &b) { return a.id < b.id; });
+
+  EXPECT_EQ(2, archived[0].id);
+  EXPECT_EQ(1, archived[0].numObs);
+  EXPECT_NEAR(2.0, archived[0].tx, 1e-6);
+  EXPECT_NEAR(4.0, archived[0].ty, 1e-6);
+  EXPECT_NEAR(0.01, archived[0].variance, 1e-9);
+  EXPECT_EQ(std::vector<int>({1, 3}), archived[0].links);
+
+  EXPECT_EQ(3, archived[1].id);
+  EXPECT_NEAR(3.0, archived[1].tx, 1e-6);
+  EXPECT_NEAR(5.0, archived[1].variance, 1e-9);
+
+  // A second compaction appends to the archive
+  map.fiducials[4].lastSeen = now - ros::Duration(1000);
+  now += ros::Duration(10);
+  compact();
+
+  archived.clear();
+  ASSERT_TRUE(loadMapFile(map.archiveFilename, archived));
+  EXPECT_EQ(3u, archived.size());
+  EXPECT_EQ(1u, map.fiducials.size());
+}
+
+TEST_F(MapCompactionTest, memoryBudget) {
+  for (int i=1; i<=100; i++) {
+    add(i, 10 + i, 0.01, 10);
+  }
+  size_t before = map.memoryUsage();
+
+  // Nothing breaks the rules, so only the budget removes fiducials
+  map.compactionParams = {3, 1.0, 600.0, 0.0, before / 2};
+  compact();
+
+  EXPECT_LE(map.memoryUsage(), before / 2);
+  EXPECT_GE(map.memoryUsage(), before / 2 - before / 50);
+  EXPECT_EQ(50u, map.fiducials.size());
+
+  // The fewest observed were removed
+  EXPECT_EQ(0u, map.fiducials.count(50));
+  EXPECT_EQ(1u, map.fiducials.count(51));
+
+  // Once within the budget nothing more is removed
+  compact();
+  EXPECT_EQ(50u, map.fiducials.size());
+}
+
+TEST_F(MapCompactionTest, protectedFiducials) {
+  map.compactionParams = {3, 1.0, 600.0, 0.0, 0};
+  add(1, 1, 0.0, 1000);
+  add(2, 1, 0.01, 1000);
+  add(3, 1, 0.01, 1000);
+  map.fiducials[2].visible = true;
+  map.originFid = 3;
+
+  compact();
+  EXPECT_EQ(3u, map.fiducials.size());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  ros::Time::init();
+  return RUN_ALL_TESTS();
+}
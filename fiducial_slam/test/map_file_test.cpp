@@ -0,0 +1,369 @@
+/*
+Tests of map file reading and writing in each format, including files
+that are truncated or corrupt, and of the fiducial_map_tool commands
+*/
+
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/map_file.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+
+class MapFileTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    char tmpl[] = "/tmp/map_file_testXXXXXX";
+    ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+    dir = tmpl;
+
+    for (int i=0; i<3; i++) {
+      MapEntry e;
+      e.id = 100 + i;
+      e.tx = 1.5 * i;
+      e.ty = -0.25 * i;
+      e.tz = 2.0;
+      e.rx = 180.0;
+      e.ry = 0.5 * i;
+      e.rz = -90.0;
+      e.variance = 0.001 * (i + 1);
+      e.numObs = 10 * i + 1;
+      if (i > 0) {
+        e.links.push_back(100 + i - 1);
+      }
+      if (i < 2) {
+        e.links.push_back(100 + i + 1);
+      }
+      entries.push_back(e);
+    }
+  }
+
+  virtual void TearDown() {
+    std::string cmd = "rm -rf " + dir;
+    ASSERT_EQ(0, system(cmd.c_str()));
+  }
+
+  std::string path(const std::string &name) {
+    return dir + "/" + name;
+  }
+
+  void writeFile(const std::string &filename, const std::string &contents) {
+    FILE *fp = fopen(filename.c_str(), "wb");
+    ASSERT_TRUE(fp != NULL);
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+  }
+
+  std::string readFile(const std::string &filename) {
+    std::string contents;
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp != NULL) {
+      char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        contents.append(buf, n);
+      }
+      fclose(fp);
+    }
+    return contents;
+  }
+
+  void expectEqual(const std::vector<MapEntry> &expected,
+                   const std::vector<MapEntry> &actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i=0; i<expected.size(); i++) {
+      EXPECT_EQ(expected[i].id, actual[i].id);
+      EXPECT_NEAR(expected[i].tx, actual[i].tx, 1e-6);
+      EXPECT_NEAR(expected[i].ty, actual[i].ty, 1e-6);
+      EXPECT_NEAR(expected[i].tz, actual[i].tz, 1e-6);
+      EXPECT_NEAR(expected[i].rx, actual[i].rx, 1e-6);
+      EXPECT_NEAR(expected[i].ry, actual[i].ry, 1e-6);
+      EXPECT_NEAR(expected[i].rz, actual[i].rz, 1e-6);
+      EXPECT_NEAR(expected[i].variance, actual[i].variance, 1e-6);
+      EXPECT_EQ(expected[i].numObs, actual[i].numObs);
+      EXPECT_EQ(expected[i].links, actual[i].links);
+    }
+  }
+
+  void roundTrip(const std::string &name) {
+    std::string filename = path(name);
+    ASSERT_TRUE(saveMapFile(filename, entries));
+
+    std::vector<MapEntry> loaded;
+    std::vector<std::string> invalid;
+    ASSERT_TRUE(loadMapFile(filename, loaded, &invalid));
+    EXPECT_TRUE(invalid.empty());
+    expectEqual(entries, loaded);
+  }
+
+  void append(const std::string &name) {
+    std::string filename = path(name);
+    std::vector<MapEntry> first(entries.begin(), entries.begin() + 1);
+    std::vector<MapEntry> rest(entries.begin() + 1, entries.end());
+
+    ASSERT_TRUE(appendMapFile(filename, first));
+    ASSERT_TRUE(appendMapFile(filename, rest));
+
+    std::vector<MapEntry> loaded;
+    ASSERT_TRUE(loadMapFile(filename, loaded));
+    expectEqual(entries, loaded);
+  }
+
+  // Run fiducial_map_tool, returning its exit status
+  int mapTool(const std::string &args) {
+    std::string cmd = std::string(MAP_TOOL) + " " + args + " >/dev/null 2>&1";
+    int rc = system(cmd.c_str());
+    return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+  }
+
+  std::string dir;
+  std::vector<MapEntry> entries;
+};
+
+
+TEST_F(MapFileTest, formatFromFilename) {
+  EXPECT_EQ(MAP_FORMAT_TEXT, mapFormatFromFilename("map.txt"));
+  EXPECT_EQ(MAP_FORMAT_TEXT, mapFormatFromFilename("map"));
+  EXPECT_EQ(MAP_FORMAT_CSV, mapFormatFromFilename("map.csv"));
+  EXPECT_EQ(MAP_FORMAT_BINARY, mapFormatFromFilename("map.fmap"));
+}
+
+TEST_F(MapFileTest, roundTripText) {
+  roundTrip("map.txt");
+}
+
+TEST_F(MapFileTest, roundTripCsv) {
+  roundTrip("map.csv");
+  EXPECT_EQ(0, readFile(path("map.csv")).find("id,"));
+}
+
+TEST_F(MapFileTest, roundTripBinary) {
+  roundTrip("map.fmap");
+}
+
+TEST_F(MapFileTest, appendText) {
+  append("map.txt");
+}
+
+TEST_F(MapFileTest, appendCsv) {
+  append("map.csv");
+
+  // The header is only written once
+  std::string contents = readFile(path("map.csv"));
+  EXPECT_EQ(std::string::npos, contents.find("id,", 1));
+}
+
+TEST_F(MapFileTest, appendBinary) {
+  append("map.fmap");
+}
+
+TEST_F(MapFileTest, progress) {
+  std::vector<MapEntry> many;
+  for (int i=0; i<10000; i++) {
+    MapEntry e = entries[0];
+    e.id = i;
+    many.push_back(e);
+  }
+
+  const char *names[] = {"map.txt", "map.csv", "map.fmap"};
+  for (const char *name : names) {
+    std::string filename = path(name);
+    ASSERT_TRUE(saveMapFile(filename, many));
+
+    std::vector<size_t> sizes;
+    std::vector<MapEntry> loaded;
+    ASSERT_TRUE(loadMapFile(filename, loaded, nullptr,
+                            [&sizes](const std::vector<MapEntry> &read) {
+                              sizes.push_back(read.size());
+                            }));
+    EXPECT_EQ(many.size(), loaded.size());
+    EXPECT_EQ(std::vector<size_t>({4096, 8192}), sizes) << name;
+  }
+}
+
+TEST_F(MapFileTest, missingFile) {
+  std::vector<MapEntry> loaded;
+  EXPECT_FALSE(loadMapFile(path("none.txt"), loaded));
+  EXPECT_FALSE(loadMapFile(path("none.csv"), loaded));
+  EXPECT_FALSE(loadMapFile(path("none.fmap"), loaded));
+}
+
+TEST_F(MapFileTest, invalidLines) {
+  std::string filename = path("map.txt");
+  writeFile(filename,
+            "1 0 0 0 180 0 180 0 1\n"
+            "garbage\n"
+            "2 1 0 0 180 0 180 0.5\n"
+            "3 2 0 0 180 0 180 0.1 4 1 2\n"
+            "4 3 0 0 180 0 180 0.1 4 1 2");
+
+  std::vector<MapEntry> loaded;
+  std::vector<std::string> invalid;
+  ASSERT_TRUE(loadMapFile(filename, loaded, &invalid));
+
+  ASSERT_EQ(3u, loaded.size());
+  EXPECT_EQ(1, loaded[0].id);
+  EXPECT_TRUE(loaded[0].links.empty());
+  EXPECT_EQ(3, loaded[1].id);
+  EXPECT_EQ(std::vector<int>({1, 2}), loaded[1].links);
+  EXPECT_EQ(4, loaded[2].id);
+
+  ASSERT_EQ(2u, invalid.size());
+  EXPECT_EQ("garbage", invalid[0]);
+  EXPECT_EQ("2 1 0 0 180 0 180 0.5", invalid[1]);
+}
+
+TEST_F(MapFileTest, truncatedBinary) {
+  std::string filename = path("map.fmap");
+  ASSERT_TRUE(saveMapFile(filename, entries));
+  std::string contents = readFile(filename);
+
+  // Every truncation, including one within the header, is rejected
+  for (size_t len=0; len<contents.size(); len++) {
+    writeFile(filename, contents.substr(0, len));
+    std::vector<MapEntry> loaded;
+    EXPECT_FALSE(loadMapFile(filename, loaded)) << "length " << len;
+  }
+}
+
+TEST_F(MapFileTest, corruptBinary) {
+  std::string filename = path("map.fmap");
+  ASSERT_TRUE(saveMapFile(filename, entries));
+  std::string contents = readFile(filename);
+  std::vector<MapEntry> loaded;
+
+  std::string bad = contents;
+  bad[0] = 'X';
+  writeFile(filename, bad);
+  EXPECT_FALSE(loadMapFile(filename, loaded));
+
+  bad = contents;
+  uint32_t version = 99;
+  memcpy(&bad[4], &version, sizeof(version));
+  writeFile(filename, bad);
+  EXPECT_FALSE(loadMapFile(filename, loaded));
+
+  // A huge count must be rejected rather than reserved
+  bad = contents;
+  uint32_t count = 0xffffffff;
+  memcpy(&bad[8], &count, sizeof(count));
+  writeFile(filename, bad);
+  EXPECT_FALSE(loadMapFile(filename, loaded));
+
+  // As must a huge link count in the first entry
+  bad = contents;
+  uint32_t numLinks = 0xffffffff;
+  memcpy(&bad[12 + 4 + 7 * 8 + 4], &numLinks, sizeof(numLinks));
+  writeFile(filename, bad);
+  EXPECT_FALSE(loadMapFile(filename, loaded));
+
+  // Appending to a corrupt file leaves it alone
+  bad = contents;
+  memcpy(&bad[8], &count, sizeof(count));
+  writeFile(filename, bad);
+  EXPECT_FALSE(appendMapFile(filename, entries));
+  EXPECT_EQ(bad, readFile(filename));
+}
+
+TEST_F(MapFileTest, mapToolInitConvertValidate) {
+  std::string text = path("sub/map.txt");
+  std::string binary = path("map.fmap");
+  std::string csv = path("map.csv");
+
+  EXPECT_EQ(0, mapTool("init 7 " + text));
+
+  // init does not overwrite an existing map
+  EXPECT_EQ(1, mapTool("init 7 " + text));
+
+  EXPECT_EQ(0, mapTool("convert " + text + " " + binary));
+  EXPECT_EQ(0, mapTool("convert " + binary + " " + csv));
+  EXPECT_EQ(0, mapTool("validate " + csv));
+
+  std::vector<MapEntry> loaded;
+  ASSERT_TRUE(loadMapFile(csv, loaded));
+  ASSERT_EQ(1u, loaded.size());
+  EXPECT_EQ(7, loaded[0].id);
+  EXPECT_NEAR(180.0, loaded[0].rx, 1e-6);
+  EXPECT_NEAR(180.0, loaded[0].rz, 1e-6);
+}
+
+TEST_F(MapFileTest, mapToolSubset) {
+  std::string in = path("map.txt");
+  std::string out = path("subset.txt");
+  ASSERT_TRUE(saveMapFile(in, entries));
+
+  EXPECT_EQ(0, mapTool("subset " + in + " " + out + " --ids 101-102"));
+
+  std::vector<MapEntry> loaded;
+  ASSERT_TRUE(loadMapFile(out, loaded));
+  ASSERT_EQ(2u, loaded.size());
+  EXPECT_EQ(101, loaded[0].id);
+  EXPECT_EQ(102, loaded[1].id);
+
+  EXPECT_NE(0, mapTool("subset " + in + " " + out + " --ids x"));
+}
+
+TEST_F(MapFileTest, mapToolMerge) {
+  // The map has fiducials 100 and 101, with 102 compacted to the archive
+  // twice and 101 once before it was seen again
+  std::string map = path("map.txt");
+  std::string archive = path("map.txt.archive");
+  std::string out = path("merged.txt");
+
+  std::vector<MapEntry> current(entries.begin(), entries.begin() + 2);
+  current[1].links.clear();
+  ASSERT_TRUE(saveMapFile(map, current));
+
+  std::vector<MapEntry> archived;
+  archived.push_back(entries[2]);
+  archived.push_back(entries[1]);
+  archived.back().tx = 99.0;
+  archived.push_back(entries[2]);
+  archived.back().numObs = 50;
+  archived.back().links.push_back(999);
+  ASSERT_TRUE(saveMapFile(archive, archived));
+
+  EXPECT_EQ(0, mapTool("merge " + map + " " + archive + " " + out));
+
+  std::vector<MapEntry> loaded;
+  ASSERT_TRUE(loadMapFile(out, loaded));
+  ASSERT_EQ(3u, loaded.size());
+  EXPECT_EQ(100, loaded[0].id);
+  EXPECT_EQ(101, loaded[1].id);
+  EXPECT_NEAR(entries[1].tx, loaded[1].tx, 1e-6);
+  EXPECT_EQ(102, loaded[2].id);
+  EXPECT_EQ(50, loaded[2].numObs);
+  EXPECT_EQ(std::vector<int>({101}), loaded[2].links);
+
+  EXPECT_NE(0, mapTool("merge " + map + " " + out));
+  EXPECT_NE(0, mapTool("merge " + map + " " + path("none.txt") + " " + out));
+}
+
+TEST_F(MapFileTest, mapToolRejectsBadInput) {
+  std::string filename = path("map.fmap");
+  ASSERT_TRUE(saveMapFile(filename, entries));
+  EXPECT_EQ(0, mapTool("validate " + filename));
+
+  std::string bad = readFile(filename);
+  uint32_t count = 0xffffffff;
+  memcpy(&bad[8], &count, sizeof(count));
+  writeFile(filename, bad);
+
+  EXPECT_NE(0, mapTool("validate " + filename));
+  EXPECT_NE(0, mapTool("convert " + filename + " " + path("out.txt")));
+  EXPECT_NE(0, mapTool("validate " + path("none.txt")));
+  EXPECT_NE(0, mapTool("nosuchcommand"));
+
+  // A link to a fiducial that is not in the map is an error
+  std::vector<MapEntry> broken = entries;
+  broken[0].links.push_back(999);
+  ASSERT_TRUE(saveMapFile(path("broken.txt"), broken));
+  EXPECT_NE(0, mapTool("validate " + path("broken.txt")));
+}
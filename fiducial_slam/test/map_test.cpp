@@ -0,0 +1,315 @@
+/*
+Tests of the map: the co-visibility graph of links updated from the
+fiducials seen together in each frame and the neighbourhood queries,
+loading maps in the background and replacing the map
+*/
+
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/map.h>
+#include <fiducial_slam/map_file.h>
+#include <fiducial_slam/smoother.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+
+
+// Frees of a watched block of memory are recorded with whether they were
+// on the main thread, to check that the old map is freed in the background
+static std::atomic<void *> watchedBlock(nullptr);
+static std::atomic<bool> watchedFreed(false);
+static std::atomic<bool> watchedFreedOnMain(false);
+static std::thread::id mainThread;
+
+void *operator new(size_t size)
+{
+  void *p = malloc(size ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  if (p != nullptr && p == watchedBlock.load()) {
+    watchedFreedOnMain = std::this_thread::get_id() == mainThread;
+    watchedFreed = true;
+  }
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  operator delete(p);
+}
+
+
+class MapLinksTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    time = ros::Time(1000, 0);
+  }
+
+  // An observation of a fiducial straight ahead of the camera
+  Observation observe(int fid, double x, double variance = 0.01) {
+    tf2::Transform T(tf2::Quaternion::getIdentity(), tf2::Vector3(x, 0, 1));
+    tf2::Stamped<TransformWithVariance> T_camFid(
+        TransformWithVariance(T, variance), time, "camera");
+    return Observation(fid, T_camFid, 0.0, 0.0);
+  }
+
+  // Update the map with a frame taken with the camera at the map origin
+  void update(std::vector<Observation> obs) {
+    time += ros::Duration(0.1);
+    tf2::Stamped<TransformWithVariance> T_mapCam(
+        TransformWithVariance(tf2::Transform::getIdentity(), 0.0), time, "map");
+    map.updateMap(obs, time, T_mapCam);
+  }
+
+  Map map;
+  ros::Time time;
+};
+
+
+TEST_F(MapLinksTest, linkStatistics) {
+  update({observe(1, 0.0), observe(2, 1.0)});
+  update({observe(1, 0.0), observe(2, 1.2)});
+
+  const Fiducial &f1 = map.fiducials[1];
+  ASSERT_EQ(1u, f1.links.size());
+  const Link *link = f1.findLink(2);
+  ASSERT_TRUE(link != nullptr);
+  EXPECT_EQ(2, link->count);
+  EXPECT_EQ(time, link->lastSeen);
+  EXPECT_NEAR(1.1, link->meanOffset.x(), 1e-9);
+  EXPECT_NEAR(0.0, link->meanOffset.y(), 1e-9);
+  EXPECT_NEAR(0.01, link->offsetVariance(), 1e-9);
+
+  const Link *back = map.fiducials[2].findLink(1);
+  ASSERT_TRUE(back != nullptr);
+  EXPECT_EQ(2, back->count);
+  EXPECT_NEAR(-1.1, back->meanOffset.x(), 1e-9);
+
+  EXPECT_TRUE(f1.findLink(1) == nullptr);
+  EXPECT_TRUE(f1.findLink(3) == nullptr);
+}
+
+TEST_F(MapLinksTest, duplicateObservationsAreMerged) {
+  // Fiducial 2 seen by two cameras, the better observation is used
+  update({observe(2, 1.3, 0.1), observe(1, 0.0), observe(2, 1.0, 0.01)});
+
+  const Fiducial &f1 = map.fiducials[1];
+  ASSERT_EQ(1u, f1.links.size());
+  EXPECT_EQ(2, f1.links[0].id);
+  EXPECT_EQ(1, f1.links[0].count);
+  EXPECT_NEAR(1.0, f1.links[0].meanOffset.x(), 1e-9);
+
+  const Fiducial &f2 = map.fiducials[2];
+  ASSERT_EQ(1u, f2.links.size());
+  EXPECT_EQ(1, f2.links[0].id);
+  EXPECT_EQ(1, f2.links[0].count);
+
+  // Links stay sorted and unique as more fiducials are seen
+  update({observe(3, 2.0), observe(2, 1.0), observe(2, 1.0), observe(1, 0.0)});
+  ASSERT_EQ(2u, f2.links.size());
+  EXPECT_EQ(1, f2.links[0].id);
+  EXPECT_EQ(2, f2.links[0].count);
+  EXPECT_EQ(3, f2.links[1].id);
+  EXPECT_EQ(1, f2.links[1].count);
+}
+
+TEST_F(MapLinksTest, neighbours) {
+  update({observe(1, 0.0), observe(2, 1.0)});
+  update({observe(1, 0.0), observe(2, 1.0)});
+  for (int i=0; i<3; i++) {
+    update({observe(2, 1.0), observe(3, 2.0)});
+  }
+  update({observe(4, 5.0)});
+
+  std::vector<int> neighbours;
+  map.getNeighbours(2, 1, neighbours);
+  EXPECT_EQ(std::vector<int>({3, 1}), neighbours);
+
+  map.getNeighbours(2, 3, neighbours);
+  EXPECT_EQ(std::vector<int>({3}), neighbours);
+
+  map.getNeighbours(4, 1, neighbours);
+  EXPECT_TRUE(neighbours.empty());
+
+  map.getNeighbours(99, 1, neighbours);
+  EXPECT_TRUE(neighbours.empty());
+}
+
+TEST_F(MapLinksTest, neighbourhood) {
+  update({observe(1, 0.0), observe(2, 1.0)});
+  update({observe(1, 0.0), observe(2, 1.0)});
+  for (int i=0; i<3; i++) {
+    update({observe(2, 1.0), observe(3, 2.0)});
+  }
+  update({observe(4, 5.0)});
+
+  std::vector<int> hood;
+  map.getNeighbourhood({1}, 0, 1, hood);
+  EXPECT_EQ(std::vector<int>({1}), hood);
+
+  map.getNeighbourhood({1}, 1, 1, hood);
+  EXPECT_EQ(std::vector<int>({1, 2}), hood);
+
+  map.getNeighbourhood({1}, 2, 1, hood);
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), hood);
+
+  // The link from 1 to 2 has only been seen twice
+  map.getNeighbourhood({1}, 2, 3, hood);
+  EXPECT_EQ(std::vector<int>({1}), hood);
+
+  map.getNeighbourhood({3}, 2, 3, hood);
+  EXPECT_EQ(std::vector<int>({2, 3}), hood);
+
+  // Unknown and repeated fiducials are ignored
+  map.getNeighbourhood({4, 99, 4}, 2, 1, hood);
+  EXPECT_EQ(std::vector<int>({4}), hood);
+}
+
+TEST_F(MapLinksTest, initializeReplacesMap) {
+  update({observe(1, 0.0), observe(2, 1.0)});
+  map.havePose = true;
+  map.originFid = 1;
+
+  // Smooth a few poses at the origin
+  map.smoother.reset(new PoseSmoother(5, 0.5, 0.01, 1.0));
+  tf2::Stamped<TransformWithVariance> measured(
+      TransformWithVariance(tf2::Transform::getIdentity(), 0.01), time, "map");
+  tf2::Stamped<TransformWithVariance> smoothed;
+  for (int i=0; i<3; i++) {
+    measured.stamp_ = time + ros::Duration(0.1 * i);
+    map.smoother->update(measured, nullptr, smoothed);
+  }
+
+  // The array of links of a fiducial in the old map is freed with it
+  mainThread = std::this_thread::get_id();
+  watchedBlock = map.fiducials[1].links.data();
+
+  std::vector<fiducial_msgs::FiducialMapEntry> entries(2);
+  entries[0].fiducial_id = 7;
+  entries[0].x = 1.0;
+  entries[0].y = 2.0;
+  entries[0].z = 3.0;
+  entries[0].rz = M_PI / 2;
+  entries[1].fiducial_id = 8;
+  entries[1].x = -1.0;
+
+  ASSERT_TRUE(map.initialize(entries));
+  EXPECT_FALSE(map.initialize(entries));
+  map.pendingMap.wait();
+  map.installPendingMap();
+
+  ASSERT_EQ(2u, map.fiducials.size());
+  EXPECT_EQ(0u, map.fiducials.count(1));
+  const Fiducial &f = map.fiducials[7];
+  EXPECT_EQ(7, f.id);
+  EXPECT_EQ(1, f.numObs);
+  EXPECT_EQ(0.0, f.pose.variance);
+  EXPECT_EQ("map", f.pose.frame_id_);
+  EXPECT_NEAR(1.0, f.pose.transform.getOrigin().x(), 1e-9);
+  EXPECT_NEAR(2.0, f.pose.transform.getOrigin().y(), 1e-9);
+  EXPECT_NEAR(3.0, f.pose.transform.getOrigin().z(), 1e-9);
+  double roll, pitch, yaw;
+  f.pose.transform.getBasis().getRPY(roll, pitch, yaw);
+  EXPECT_NEAR(M_PI / 2, yaw, 1e-9);
+  EXPECT_NEAR(-1.0, map.fiducials[8].pose.transform.getOrigin().x(), 1e-9);
+
+  EXPECT_FALSE(map.havePose);
+  EXPECT_FALSE(map.isInitializingMap);
+  EXPECT_EQ(-1, map.originFid);
+  EXPECT_FALSE(map.pendingMap.valid());
+
+  // The smoother starts again, so a pose far from the earlier ones is
+  // returned as it was measured
+  measured.transform.setOrigin(tf2::Vector3(10.0, 0.0, 0.0));
+  measured.stamp_ += ros::Duration(0.1);
+  map.smoother->update(measured, nullptr, smoothed);
+  EXPECT_NEAR(10.0, smoothed.transform.getOrigin().x(), 1e-9);
+
+  for (int i=0; i<1000 && !watchedFreed; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(watchedFreed);
+  EXPECT_FALSE(watchedFreedOnMain);
+  watchedBlock = nullptr;
+
+  // Another map can be installed once this one has been
+  EXPECT_TRUE(map.initialize(entries));
+}
+
+// Write a map file with many fiducials in a row, returning its name
+static std::string writeLargeMap(int count)
+{
+  char filename[] = "/tmp/map_testXXXXXX";
+  int fd = mkstemp(filename);
+  close(fd);
+  std::string name = std::string(filename) + ".txt";
+  rename(filename, name.c_str());
+
+  std::vector<MapEntry> entries(count);
+  for (int i=0; i<count; i++) {
+    MapEntry &e = entries[i];
+    e.id = i + 1;
+    e.tx = 0.5 * i;
+    e.ty = e.tz = 0.0;
+    e.rx = 180.0;
+    e.ry = 0.0;
+    e.rz = 180.0;
+    e.variance = 0.01;
+    e.numObs = 5;
+  }
+  EXPECT_TRUE(saveMapFile(name, entries));
+  return name;
+}
+
+TEST(MapLoading, loadInBackground) {
+  std::string filename = writeLargeMap(1000);
+
+  Map map;
+  ASSERT_TRUE(map.loadMapAsync(filename));
+  EXPECT_TRUE(map.isLoadingMap);
+  while (map.isLoadingMap) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    map.finishLoading();
+  }
+
+  EXPECT_EQ(1000u, map.fiducials.size());
+  EXPECT_NEAR(2.0, map.fiducials[5].pose.transform.getOrigin().x(), 1e-9);
+  EXPECT_TRUE(map.fiducials[5].lastSeen.isZero());
+  EXPECT_FALSE(std::atomic_load(&map.loadedPoses));
+  unlink(filename.c_str());
+}
+
+TEST(MapLoading, destroyWhileLoading) {
+  // Large enough that the load is still running when the map goes away,
+  // the background task must not outlive what it writes to
+  std::string filename = writeLargeMap(200000);
+
+  for (int i=0; i<3; i++) {
+    Map *map = new Map();
+    ASSERT_TRUE(map->loadMapAsync(filename));
+    std::this_thread::sleep_for(std::chrono::milliseconds(i));
+    delete map;
+  }
+  unlink(filename.c_str());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  ros::Time::init();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,97 @@
+/*
+Tests of the Levenberg-Marquardt camera pose refinement: a known pose
+is recovered from seeds perturbed away from it
+*/
+
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/refine.h>
+#include <fiducial_common/reprojection.h>
+
+#include <random>
+#include <vector>
+
+
+class RefineTest : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    rvec = cv::Vec3d(0.2, -0.3, 0.1);
+    tvec = cv::Vec3d(0.1, -0.2, 3.0);
+
+    // The corners of fiducials on a ceiling, seen by a tilted camera
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    cv::Matx33d R = rotationMatrix(rvec);
+    for (int i=0; i<40; i++) {
+      cv::Point3f op;
+      op.x = uniform(rng);
+      op.y = uniform(rng);
+      op.z = 0.1 * uniform(rng);
+      cv::Vec3d p = R * cv::Vec3d(op.x, op.y, op.z) + tvec;
+      objectPoints.push_back(op);
+      cv::Point2f np;
+      np.x = p[0] / p[2];
+      np.y = p[1] / p[2];
+      normPoints.push_back(np);
+    }
+  }
+
+  RefineResult refine(cv::Vec3d &r, cv::Vec3d &t, int maxIterations) {
+    return refinePose(objectPoints.data(), normPoints.data(),
+                      objectPoints.size(), r, t, maxIterations);
+  }
+
+  cv::Vec3d rvec, tvec;
+  std::vector<cv::Point3f> objectPoints;
+  std::vector<cv::Point2f> normPoints;
+};
+
+
+TEST_F(RefineTest, recoversPoseFromPerturbedSeeds) {
+  std::mt19937 rng(2);
+  std::normal_distribution<double> angle(0.0, 0.05);
+  std::normal_distribution<double> offset(0.0, 0.1);
+
+  for (int k=0; k<20; k++) {
+    cv::Vec3d r = rvec + cv::Vec3d(angle(rng), angle(rng), angle(rng));
+    cv::Vec3d t = tvec + cv::Vec3d(offset(rng), offset(rng), offset(rng));
+
+    RefineResult result = refine(r, t, 20);
+    EXPECT_TRUE(result.converged) << "seed " << k;
+    EXPECT_LT(result.finalCost, result.initialCost);
+    EXPECT_LT(result.finalCost, 1e-8);
+    for (int i=0; i<3; i++) {
+      EXPECT_NEAR(rvec[i], r[i], 1e-4) << "seed " << k;
+      EXPECT_NEAR(tvec[i], t[i], 1e-4) << "seed " << k;
+    }
+  }
+}
+
+TEST_F(RefineTest, exactSeedIsUnchanged) {
+  cv::Vec3d r = rvec, t = tvec;
+  RefineResult result = refine(r, t, 5);
+  EXPECT_TRUE(result.converged);
+  EXPECT_LT(result.finalCost, 1e-10);
+  for (int i=0; i<3; i++) {
+    EXPECT_NEAR(rvec[i], r[i], 1e-6);
+    EXPECT_NEAR(tvec[i], t[i], 1e-6);
+  }
+}
+
+TEST_F(RefineTest, noIterations) {
+  cv::Vec3d r = rvec + cv::Vec3d(0.05, 0, 0), t = tvec;
+  cv::Vec3d r0 = r;
+  RefineResult result = refine(r, t, 0);
+  EXPECT_EQ(0, result.iterations);
+  EXPECT_FALSE(result.converged);
+  for (int i=0; i<3; i++) {
+    EXPECT_NEAR(r0[i], r[i], 1e-9);
+    EXPECT_NEAR(tvec[i], t[i], 1e-9);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,183 @@
+/*
+Scaling benchmarks of the map on synthetic sites of 1000 to 100000
+fiducials: the time to update the map with a frame of observations, the
+memory used by the map, and the time to load and save it. Like
+slam_benchmark, these do not need a ROS master.
+
+Run with, for example:
+  rosrun fiducial_slam scaling_benchmark --benchmark_filter=Load
+*/
+
+#include <benchmark/benchmark.h>
+
+#include <ros/ros.h>
+
+#include "fiducial_slam/map.h"
+#include "fiducial_slam/map_file.h"
+#include "fiducial_slam/synthetic.h"
+
+#include <boost/filesystem.hpp>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Number of distinct frames of observations that updates cycle through
+static const int maxFrames = 500;
+
+static const char *formats[] = { ".txt", ".fmap" };
+
+// Sites and their true maps are generated once for each size
+
+struct SiteData {
+    unique_ptr<SyntheticSite> site;
+    string mapFilename;
+    vector<vector<Observation>> frames;
+};
+
+static std::map<int, SiteData> sites;
+
+static SiteData &getSite(int numFiducials)
+{
+    SiteData &data = sites[numFiducials];
+    if (data.site) {
+        return data;
+    }
+
+    SiteParams params;
+    params.numFiducials = numFiducials;
+    data.site.reset(new SyntheticSite(params));
+
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path("site-%%%%%%%%.txt");
+    data.mapFilename = path.string();
+
+    vector<MapEntry> entries;
+    data.site->groundTruthMap(entries, 1e-4);
+    saveMapFile(data.mapFilename, entries);
+
+    fiducial_msgs::FiducialTransformArray fta;
+    fiducial_msgs::FiducialArray fa;
+    int numFrames = min(data.site->numFrames(), maxFrames);
+
+    for (int frame = 0; frame < numFrames; frame++) {
+        data.site->observe(frame, "base_link", fta, fa);
+
+        vector<Observation> obs;
+        for (const fiducial_msgs::FiducialTransform &ft : fta.transforms) {
+            obs.push_back(Observation(ft.fiducial_id,
+                tf2::Stamped<TransformWithVariance>(
+                    TransformWithVariance(ft.transform, ft.object_error),
+                    fta.header.stamp, fta.header.frame_id),
+                ft.image_error, ft.object_error));
+        }
+        data.frames.push_back(obs);
+    }
+
+    return data;
+}
+
+// Update of a mapped site with a frame of observations
+static void BM_MapUpdate(benchmark::State& state)
+{
+    SiteData &data = getSite(state.range(0));
+
+    Map map;
+    map.odomFrame = "";
+    map.loadMap(data.mapFilename);
+
+    BudgetCounters counters;
+    size_t frame = 0;
+    size_t numObs = 0;
+
+    for (auto _ : state) {
+        vector<Observation> &obs = data.frames[frame % data.frames.size()];
+        FrameBudget budget(0.0, counters);
+        map.update(obs, obs.empty() ? ros::Time::now() : obs[0].T_camFid.stamp_,
+                   budget);
+
+        numObs += obs.size();
+        frame++;
+    }
+
+    size_t bytes = map.memoryUsage();
+    state.counters["fiducials"] = map.fiducials.size();
+    state.counters["map_MB"] = bytes / (1024.0 * 1024.0);
+    state.counters["bytes_per_fiducial"] = (double)bytes / map.fiducials.size();
+    state.counters["obs_per_frame"] = (double)numObs / max(frame, (size_t)1);
+}
+BENCHMARK(BM_MapUpdate)->Arg(1000)->Arg(10000)->Arg(100000)
+    ->Unit(benchmark::kMicrosecond);
+
+// Loading a map in the text or binary format, including building the
+// co-visibility links
+static void BM_LoadMap(benchmark::State& state)
+{
+    SiteData &data = getSite(state.range(0));
+
+    string filename = data.mapFilename + formats[state.range(1)];
+    {
+        Map map;
+        map.loadMap(data.mapFilename);
+        map.saveMap(filename);
+    }
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        unique_ptr<Map> map(new Map());
+        state.ResumeTiming();
+
+        map->loadMap(filename);
+
+        state.PauseTiming();
+        map.reset();
+        state.ResumeTiming();
+    }
+
+    state.counters["file_MB"] = boost::filesystem::file_size(filename) / (1024.0 * 1024.0);
+    boost::filesystem::remove(filename);
+}
+BENCHMARK(BM_LoadMap)->ArgsProduct({{1000, 10000, 100000}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_SaveMap(benchmark::State& state)
+{
+    SiteData &data = getSite(state.range(0));
+
+    string filename = data.mapFilename + formats[state.range(1)];
+    Map map;
+    map.loadMap(data.mapFilename);
+
+    for (auto _ : state) {
+        map.saveMap(filename);
+    }
+
+    state.counters["file_MB"] = boost::filesystem::file_size(filename) / (1024.0 * 1024.0);
+    boost::filesystem::remove(filename);
+}
+BENCHMARK(BM_SaveMap)->ArgsProduct({{1000, 10000, 100000}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv)
+{
+    ros::Time::init();
+
+    if (ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME,
+                                       ros::console::levels::Warn)) {
+        ros::console::notifyLoggerLevelsChanged();
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+
+    for (const auto &it : sites) {
+        boost::filesystem::remove(it.second.mapFilename);
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+Microbenchmarks of the math in fiducial_slam that runs for every frame.
+These do not need a ROS master, the map is created without any ROS
+connections and logging below warnings is turned off.
+
+Run with, for example:
+  rosrun fiducial_slam slam_benchmark --benchmark_filter=UpdatePose
+*/
+
+#include <benchmark/benchmark.h>
+
+#include <ros/ros.h>
+#include <sensor_msgs/CameraInfo.h>
+
+#include "fiducial_slam/estimator.h"
+#include "fiducial_slam/map.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+static const double fiducialLen = 0.14;
+
+static TransformWithVariance makeTransform(double x, double y, double z,
+                                           double yaw, double var)
+{
+    tf2::Quaternion q;
+    q.setRPY(0.0, 0.0, yaw);
+    return TransformWithVariance(tf2::Vector3(x, y, z), q, var);
+}
+
+static void BM_TransformUpdate(benchmark::State& state)
+{
+    TransformWithVariance t = makeTransform(1.0, 2.0, 0.5, 0.3, 0.01);
+    TransformWithVariance newT = makeTransform(1.01, 1.98, 0.52, 0.31, 0.02);
+
+    for (auto _ : state) {
+        TransformWithVariance out = t;
+        out.update(newT);
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_TransformUpdate);
+
+static void BM_AverageTransforms(benchmark::State& state)
+{
+    TransformWithVariance t1 = makeTransform(1.0, 2.0, 0.5, 0.3, 0.01);
+    TransformWithVariance t2 = makeTransform(1.01, 1.98, 0.52, 0.31, 0.02);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(averageTransforms(t1, t2));
+    }
+}
+BENCHMARK(BM_AverageTransforms);
+
+static void BM_UpdateVarianceDavid(benchmark::State& state)
+{
+    tf2::Vector3 mean1(1.0, 2.0, 0.5);
+    tf2::Vector3 mean2(1.01, 1.98, 0.52);
+    tf2::Vector3 newMean = (mean1 + mean2) / 2.0;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            updateVarianceDavid(newMean, mean1, 0.01, mean2, 0.02));
+    }
+}
+BENCHMARK(BM_UpdateVarianceDavid);
+
+// Object points of 1 fiducial or a grid of them, as seen by the
+// multi-fiducial estimate, and their noisy normalized image coordinates
+static void makeImagePoints(int numFids, vector<Point3f> &objectPoints,
+                            vector<Point2f> &normPoints,
+                            Vec3d &rvec, Vec3d &tvec)
+{
+    std::mt19937 rng(42);
+    std::normal_distribution<double> noise(0.0, 0.001);
+
+    vector<Point3f> corners;
+    getSingleMarkerObjectPoints(fiducialLen, corners);
+
+    objectPoints.clear();
+    int side = ceil(sqrt(numFids));
+    for (int i=0; i<numFids; i++) {
+        float x = (i % side) * 0.5;
+        float y = (i / side) * 0.5;
+        for (const Point3f &c : corners) {
+            objectPoints.push_back(Point3f(c.x + x, c.y + y, 0.0));
+        }
+    }
+
+    rvec = Vec3d(0.1, -0.2, 0.05);
+    tvec = Vec3d(-0.2, -0.3, 2.0);
+
+    Matx33d R;
+    cv::Rodrigues(rvec, R);
+
+    normPoints.clear();
+    for (const Point3f &p : objectPoints) {
+        Vec3d c = R * Vec3d(p.x, p.y, p.z) + tvec;
+        normPoints.push_back(Point2f(c[0] / c[2] + noise(rng),
+                                     c[1] / c[2] + noise(rng)));
+    }
+}
+
+static void BM_ReprojectionError(benchmark::State& state)
+{
+    sensor_msgs::CameraInfo info;
+    info.K = {1006.1, 0.0, 655.9, 0.0, 1004.0, 490.6, 0.0, 0.0, 1.0};
+    info.D = {0.135, -0.234, 0.0007, 0.0048, 0.0};
+    CameraModel camera(info);
+
+    vector<Point3f> objectPoints;
+    vector<Point2f> normPoints;
+    Vec3d rvec, tvec;
+    makeImagePoints(state.range(0), objectPoints, normPoints, rvec, tvec);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Estimator::getReprojectionError(
+            camera, objectPoints, normPoints, rvec, tvec));
+    }
+    state.SetItemsProcessed(state.iterations() * objectPoints.size());
+}
+BENCHMARK(BM_ReprojectionError)->Arg(1)->Arg(4)->Arg(16);
+
+static void BM_CalcFiducialArea(benchmark::State& state)
+{
+    Point2f corners[4] = {Point2f(100.0, 100.0), Point2f(180.0, 104.0),
+                          Point2f(176.0, 182.0), Point2f(98.0, 178.0)};
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(calcFiducialArea(corners));
+    }
+}
+BENCHMARK(BM_CalcFiducialArea);
+
+static void BM_GetSingleMarkerObjectPoints(benchmark::State& state)
+{
+    vector<Point3f> objPoints;
+    objPoints.reserve(4);
+
+    for (auto _ : state) {
+        objPoints.clear();
+        getSingleMarkerObjectPoints(fiducialLen, objPoints);
+        benchmark::DoNotOptimize(objPoints.data());
+    }
+}
+BENCHMARK(BM_GetSingleMarkerObjectPoints);
+
+// Pose of the camera from a map of fiducials on the ceiling, all of
+// which are observed
+static void BM_UpdatePose(benchmark::State& state)
+{
+    int numFids = state.range(0);
+
+    Map map;
+    map.odomFrame = "";
+
+    ros::Time now = ros::Time::now();
+    TransformWithVariance T_mapCam = makeTransform(0.3, -0.2, 0.5, 0.4, 0.0);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<double> noise(0.0, 0.005);
+
+    vector<Observation> obs;
+    for (int i=0; i<numFids; i++) {
+        int fid = i + 1;
+        TransformWithVariance T_mapFid =
+            makeTransform(i % 8, i / 8, 2.5, 0.1 * i, 0.01);
+        map.fiducials[fid] = Fiducial(fid,
+            tf2::Stamped<TransformWithVariance>(T_mapFid, now, "map"));
+
+        TransformWithVariance T_camFid(T_mapCam.transform.inverse() *
+                                       T_mapFid.transform, 0.01);
+        T_camFid.transform.getOrigin() += tf2::Vector3(noise(rng), noise(rng),
+                                                       noise(rng));
+        obs.push_back(Observation(fid,
+            tf2::Stamped<TransformWithVariance>(T_camFid, now, "base_link"),
+            0.1, 0.01));
+    }
+
+    tf2::Stamped<TransformWithVariance> cameraPose;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(map.updatePose(obs, now, cameraPose));
+    }
+    state.SetItemsProcessed(state.iterations() * numFids);
+}
+BENCHMARK(BM_UpdatePose)->RangeMultiplier(4)->Range(1, 64);
+
+int main(int argc, char** argv)
+{
+    ros::Time::init();
+
+    if (ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME,
+                                       ros::console::levels::Warn)) {
+        ros::console::notifyLoggerLevelsChanged();
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
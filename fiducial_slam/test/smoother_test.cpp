@@ -0,0 +1,116 @@
+/*
+Tests of the fixed-lag pose smoother: input that fits its motion model
+exactly is returned unchanged, and noise on the measurements is reduced
+*/
+
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/smoother.h>
+
+#include <random>
+
+
+// Robot moving at constant speed and turn rate
+static tf2::Transform truePose(double t)
+{
+    tf2::Quaternion q;
+    q.setRPY(0, 0, 0.2 * t);
+    return tf2::Transform(q, tf2::Vector3(0.5 * t, 0.1 * t, 0.0));
+}
+
+static double distance(const tf2::Transform &a, const tf2::Transform &b)
+{
+    return (a.getOrigin() - b.getOrigin()).length() +
+           a.getRotation().angleShortestPath(b.getRotation());
+}
+
+static tf2::Stamped<TransformWithVariance> measure(const tf2::Transform &T, double t,
+                                                   double variance)
+{
+    return tf2::Stamped<TransformWithVariance>(TransformWithVariance(T, variance),
+                                               ros::Time(t), "map");
+}
+
+
+TEST(PoseSmoother, constantVelocityWithOdometry) {
+    PoseSmoother smoother(10, 0.5, 0.01, 1.0);
+
+    // Odometry drifts from the map, but the motion is exact
+    tf2::Transform T_odomMap(tf2::Quaternion(tf2::Vector3(0, 0, 1), 0.3),
+                             tf2::Vector3(2.0, -1.0, 0.0));
+
+    for (int k=0; k<30; k++) {
+        double t = 100.0 + 0.1 * k;
+        tf2::Transform T = truePose(t);
+        tf2::Transform odom = T_odomMap * T;
+
+        tf2::Stamped<TransformWithVariance> smoothed;
+        smoother.update(measure(T, t, 0.01), &odom, smoothed);
+        EXPECT_NEAR(0.0, distance(T, smoothed.transform), 1e-6) << "frame " << k;
+        EXPECT_LE(smoothed.variance, 0.01);
+    }
+}
+
+TEST(PoseSmoother, stationaryWithoutOdometry) {
+    PoseSmoother smoother(10, 0.5, 0.01, 1.0);
+    tf2::Transform T = truePose(3.0);
+
+    for (int k=0; k<30; k++) {
+        double t = 100.0 + 0.1 * k;
+        tf2::Stamped<TransformWithVariance> smoothed;
+        smoother.update(measure(T, t, 0.01), nullptr, smoothed);
+        EXPECT_NEAR(0.0, distance(T, smoothed.transform), 1e-6) << "frame " << k;
+    }
+}
+
+TEST(PoseSmoother, jitterIsReduced) {
+    PoseSmoother smoother(10, 0.5, 0.01, 1.0);
+    std::mt19937 rng(1);
+    std::normal_distribution<double> noise(0.0, 0.05);
+
+    double rawSq = 0.0, smoothedSq = 0.0;
+    double measuredVariance = 0.0025;
+    for (int k=0; k<200; k++) {
+        double t = 100.0 + 0.05 * k;
+        tf2::Transform T = truePose(t);
+        tf2::Transform odom = T;
+
+        tf2::Quaternion qNoise;
+        qNoise.setRPY(0.2 * noise(rng), 0.2 * noise(rng), noise(rng));
+        tf2::Transform measured(T.getRotation() * qNoise,
+                                T.getOrigin() + tf2::Vector3(noise(rng), noise(rng),
+                                                             noise(rng)));
+
+        tf2::Stamped<TransformWithVariance> smoothed;
+        smoother.update(measure(measured, t, measuredVariance), &odom, smoothed);
+
+        if (k >= 10) {
+            rawSq += (measured.getOrigin() - T.getOrigin()).length2();
+            smoothedSq += (smoothed.transform.getOrigin() - T.getOrigin()).length2();
+            EXPECT_LT(smoothed.variance, measuredVariance);
+        }
+    }
+
+    EXPECT_LT(smoothedSq, 0.5 * rawSq);
+}
+
+TEST(PoseSmoother, resetAfterGap) {
+    PoseSmoother smoother(10, 0.5, 0.01, 1.0);
+    tf2::Stamped<TransformWithVariance> smoothed;
+
+    for (int k=0; k<5; k++) {
+        smoother.update(measure(truePose(0.0), 100.0 + 0.1 * k, 0.01), nullptr, smoothed);
+    }
+
+    // After the gap the window restarts, so the measurement is returned
+    tf2::Transform T = truePose(10.0);
+    smoother.update(measure(T, 110.0, 0.01), nullptr, smoothed);
+    EXPECT_NEAR(0.0, distance(T, smoothed.transform), 1e-9);
+    EXPECT_NEAR(0.01, smoothed.variance, 1e-12);
+}
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}